@@ -0,0 +1,27 @@
+# Once done, this will define
+#
+#  LMDB_FOUND - system has LMDB
+#  LMDB_INCLUDE_DIRS - the LMDB include directories
+#  LMDB_LIBRARIES - link these to use LMDB
+
+# Include dir
+find_path(LMDB_INCLUDE_DIR
+  NAMES lmdb.h
+  PATHS /usr/include /usr/local/include /sw/include
+)
+
+# The library itself
+find_library(LMDB_LIBRARY
+  NAMES lmdb
+  PATHS /usr/lib /lib /sw/lib /usr/local/lib
+)
+
+set(LMDB_INCLUDE_DIRS ${LMDB_INCLUDE_DIR})
+set(LMDB_LIBRARIES ${LMDB_LIBRARY})
+
+include(FindPackageHandleStandardArgs)
+FIND_PACKAGE_HANDLE_STANDARD_ARGS(LMDB
+    FOUND_VAR LMDB_FOUND
+    REQUIRED_VARS LMDB_LIBRARY LMDB_INCLUDE_DIR
+)
+mark_as_advanced(LMDB_INCLUDE_DIR LMDB_LIBRARY)
@@ -0,0 +1,102 @@
+/**
+ * Copyright (c) Sjors Gielen, 2014
+ * See LICENSE for license.
+ */
+
+#include "commandparser.h"
+#include <strings.h>
+
+static bool isWhitespace(char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+static std::string_view trimView(std::string_view s) {
+	while(!s.empty() && isWhitespace(s.front())) {
+		s.remove_prefix(1);
+	}
+	while(!s.empty() && isWhitespace(s.back())) {
+		s.remove_suffix(1);
+	}
+	return s;
+}
+
+/**
+ * @brief Returns the part of a message after the nick or highlight.
+ *
+ * If the message isn't addressed to the bot, an empty view is returned.
+ */
+std::string_view dazeus::CommandParser::payload(std::string_view message, std::string_view nick,
+		std::string_view highlight) {
+	size_t n = nick.length();
+	if(message.length() > n && (message[n] == ':' || message[n] == ',')
+	&& strncasecmp(message.data(), nick.data(), n) == 0) {
+		return trimView(message.substr(n + 1));
+	} else if(message.length() >= highlight.length()
+	       && strncasecmp(message.data(), highlight.data(), highlight.length()) == 0) {
+		return trimView(message.substr(highlight.length()));
+	}
+	return std::string_view();
+}
+
+/**
+ * @brief Split a payload into its command and arguments.
+ *
+ * Returns false if the payload contains no command.
+ */
+bool dazeus::CommandParser::parse(std::string_view payload) {
+	buffer_.clear();
+	// the buffer can't grow while views into it are made
+	buffer_.reserve(payload.length());
+	words_.clear();
+	args_.clear();
+	command_ = std::string_view();
+	fullArgs_ = std::string_view();
+
+	bool inQuoteArg = false;
+	bool hadQuotesThisArg = false;
+	bool inEscape = false;
+	size_t fullArgsStart = std::string_view::npos;
+	size_t wordStart = 0;
+	for(size_t i = 0; i < payload.length(); ++i) {
+		char c = payload[i];
+		if(inEscape) {
+			inEscape = false;
+			buffer_ += c;
+		} else if(c == '\\') {
+			inEscape = true;
+		} else if(!inQuoteArg && c == ' ') {
+			// finish this word, unless it's empty and we had no quotes (i.e. multiple spaces between args)
+			if(buffer_.length() != wordStart || hadQuotesThisArg) {
+				words_.push_back(std::make_pair(wordStart, buffer_.length() - wordStart));
+			}
+			wordStart = buffer_.length();
+			hadQuotesThisArg = false;
+			// everything after the first separator are the arguments
+			if(fullArgsStart == std::string_view::npos) {
+				fullArgsStart = i + 1;
+			}
+		} else if(c == '"') {
+			inQuoteArg = !inQuoteArg;
+			hadQuotesThisArg = true;
+		} else {
+			buffer_ += c;
+		}
+	}
+	if(buffer_.length() != wordStart || hadQuotesThisArg) {
+		words_.push_back(std::make_pair(wordStart, buffer_.length() - wordStart));
+	}
+
+	if(words_.empty()) {
+		return false;
+	}
+
+	std::string_view buffer(buffer_);
+	command_ = buffer.substr(words_[0].first, words_[0].second);
+	for(size_t i = 1; i < words_.size(); ++i) {
+		args_.push_back(buffer.substr(words_[i].first, words_[i].second));
+	}
+	if(fullArgsStart != std::string_view::npos) {
+		fullArgs_ = trimView(payload.substr(fullArgsStart));
+	}
+	return true;
+}
@@ -0,0 +1,61 @@
+/**
+ * Copyright (c) Sjors Gielen, 2014
+ * See LICENSE for license.
+ */
+
+#ifndef COMMANDPARSER_H
+#define COMMANDPARSER_H
+
+#include <stddef.h>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace dazeus {
+
+/**
+ * @class CommandParser
+ * @brief Splits messages addressed to the bot into a command and arguments.
+ *
+ * Messages are addressed to the bot when they start with its nickname
+ * followed by a colon or comma, or with the configured highlight. Other
+ * messages are rejected by comparing their first bytes, without copying
+ * anything.
+ *
+ * Arguments are separated by spaces, can be quoted with double quotes, and
+ * can contain escaped characters. The parser runs over the message once,
+ * writing the unescaped arguments into a buffer that is reused between
+ * messages; the command and arguments it returns are views into that buffer
+ * and stay valid until the next call to parse().
+ */
+class CommandParser
+{
+  public:
+    CommandParser() : buffer_(), words_(), args_(), fullArgs_() {}
+
+    static std::string_view payload(std::string_view message, std::string_view nick,
+                                    std::string_view highlight);
+    bool parse(std::string_view payload);
+
+    std::string_view command() const { return command_; }
+    const std::vector<std::string_view> &args() const { return args_; }
+    // the message after the command, as it was sent
+    std::string_view fullArgs() const { return fullArgs_; }
+
+  private:
+    // explicitly disable copy constructor
+    CommandParser(const CommandParser&);
+    void operator=(const CommandParser&);
+
+    std::string buffer_;
+    // offset and length of every word in the buffer
+    std::vector<std::pair<size_t, size_t> > words_;
+    std::string_view command_;
+    std::vector<std::string_view> args_;
+    std::string_view fullArgs_;
+};
+
+}
+
+#endif
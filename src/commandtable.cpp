@@ -0,0 +1,108 @@
+/**
+ * Copyright (c) Sjors Gielen, 2014
+ * See LICENSE for license.
+ */
+
+#include "commandtable.h"
+#include <algorithm>
+
+/**
+ * @brief Returns the entry of a command, and remembers the socket uses it.
+ */
+dazeus::CommandTable::Entry &dazeus::CommandTable::entry(const std::string &command, int sock) {
+	std::vector<std::string> &commands = socketCommands_[sock];
+	if(std::find(commands.begin(), commands.end(), command) == commands.end()) {
+		commands.push_back(command);
+	}
+	return commands_[command];
+}
+
+void dazeus::CommandTable::subscribe(const std::string &command, int sock) {
+	entry(command, sock).global.push_back(sock);
+}
+
+void dazeus::CommandTable::subscribe(const std::string &command, int sock, const Network *network) {
+	entry(command, sock).network.push_back(RequirementInfo(sock, network));
+}
+
+void dazeus::CommandTable::subscribe(const std::string &command, int sock, const Network *network,
+		const std::string &object, bool isSender) {
+	Entry &e = entry(command, sock);
+	if(isSender) {
+		e.sender.push_back(RequirementInfo(sock, network, object));
+	} else {
+		e.receiver.push_back(RequirementInfo(sock, network, object));
+	}
+}
+
+void dazeus::CommandTable::unsubscribeAll(int sock) {
+	auto sit = socketCommands_.find(sock);
+	if(sit == socketCommands_.end()) {
+		return;
+	}
+
+	auto ownedBy = [sock](const RequirementInfo &r) { return r.sock == sock; };
+	for(auto cit = sit->second.begin(); cit != sit->second.end(); ++cit) {
+		auto it = commands_.find(*cit);
+		if(it == commands_.end()) {
+			continue;
+		}
+		Entry &e = it->second;
+		e.global.erase(std::remove(e.global.begin(), e.global.end(), sock), e.global.end());
+		e.network.erase(std::remove_if(e.network.begin(), e.network.end(), ownedBy), e.network.end());
+		e.receiver.erase(std::remove_if(e.receiver.begin(), e.receiver.end(), ownedBy), e.receiver.end());
+		e.sender.erase(std::remove_if(e.sender.begin(), e.sender.end(), ownedBy), e.sender.end());
+		if(e.empty()) {
+			commands_.erase(it);
+		}
+	}
+	socketCommands_.erase(sit);
+}
+
+/**
+ * @brief Returns whether a plugin only wants this command from some sender.
+ *
+ * If so, the sender needs to be identified before it can be dispatched.
+ */
+bool dazeus::CommandTable::mightNeedWhois(const std::string &command) const {
+	auto it = commands_.find(command);
+	return it != commands_.end() && !it->second.sender.empty();
+}
+
+/**
+ * @brief Returns the sockets a command should be sent to, in ascending order.
+ *
+ * Every socket is returned once, even if several of its requirements match.
+ */
+std::vector<int> dazeus::CommandTable::recipients(const std::string &command, const std::string &receiver,
+		const std::string &sender, bool identified, const Network &network) const {
+	std::vector<int> socks;
+	auto it = commands_.find(command);
+	if(it == commands_.end()) {
+		return socks;
+	}
+
+	const Entry &e = it->second;
+	socks = e.global;
+	for(auto rit = e.network.begin(); rit != e.network.end(); ++rit) {
+		if(rit->network == &network) {
+			socks.push_back(rit->sock);
+		}
+	}
+	for(auto rit = e.receiver.begin(); rit != e.receiver.end(); ++rit) {
+		if(rit->network == &network && rit->object == receiver) {
+			socks.push_back(rit->sock);
+		}
+	}
+	if(identified) {
+		for(auto rit = e.sender.begin(); rit != e.sender.end(); ++rit) {
+			if(rit->network == &network && rit->object == sender) {
+				socks.push_back(rit->sock);
+			}
+		}
+	}
+
+	std::sort(socks.begin(), socks.end());
+	socks.erase(std::unique(socks.begin(), socks.end()), socks.end());
+	return socks;
+}
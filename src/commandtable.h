@@ -0,0 +1,77 @@
+/**
+ * Copyright (c) Sjors Gielen, 2014
+ * See LICENSE for license.
+ */
+
+#ifndef COMMANDTABLE_H
+#define COMMANDTABLE_H
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace dazeus {
+
+class Network;
+
+/**
+ * @class CommandTable
+ * @brief Maps command names to the plugin sockets that want to receive them.
+ *
+ * Every command has one entry, in which the requirements of the subscribed
+ * sockets are kept apart by kind: global, bound to a network, bound to a
+ * receiver or bound to an identified sender. Finding the sockets a command
+ * goes to takes a single lookup, and only looks at requirements for that
+ * command. The requirements are owned by the table, and are removed when
+ * their socket goes away.
+ */
+class CommandTable
+{
+  public:
+    CommandTable() : commands_(), socketCommands_() {}
+
+    // Allow anything
+    void subscribe(const std::string &command, int sock);
+    // Allow anything on a network
+    void subscribe(const std::string &command, int sock, const Network *network);
+    // Allow anything from a sender (isSender=true) or to some receiver
+    // (isSender=false) on a network
+    void subscribe(const std::string &command, int sock, const Network *network,
+                   const std::string &object, bool isSender);
+    void unsubscribeAll(int sock);
+
+    bool mightNeedWhois(const std::string &command) const;
+    std::vector<int> recipients(const std::string &command, const std::string &receiver,
+                                const std::string &sender, bool identified,
+                                const Network &network) const;
+
+  private:
+    struct RequirementInfo {
+      int sock;
+      const Network *network;
+      // wanted receiver or sender, if any
+      std::string object;
+      RequirementInfo(int s, const Network *n, const std::string &o = std::string())
+      : sock(s), network(n), object(o) {}
+    };
+
+    struct Entry {
+      std::vector<int> global;
+      std::vector<RequirementInfo> network;
+      std::vector<RequirementInfo> receiver;
+      std::vector<RequirementInfo> sender;
+      bool empty() const {
+        return global.empty() && network.empty() && receiver.empty() && sender.empty();
+      }
+    };
+
+    Entry &entry(const std::string &command, int sock);
+
+    std::unordered_map<std::string, Entry> commands_;
+    // commands each socket subscribed to, for removing its requirements
+    std::unordered_map<int, std::vector<std::string> > socketCommands_;
+};
+
+}
+
+#endif
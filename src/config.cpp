@@ -69,6 +69,10 @@ static const configoption_t options[] = {
     {"database", ARG_RAW, option, NULL, CTX_ALL},
     {"filename", ARG_RAW, option, NULL, CTX_ALL},
 	{"options", ARG_RAW, option, NULL, CTX_ALL},
+	{"cachesize", ARG_INT, option, NULL, CTX_ALL},
+	{"writewindow", ARG_INT, option, NULL, CTX_ALL},
+	{"writebatch", ARG_INT, option, NULL, CTX_ALL},
+	{"connections", ARG_INT, option, NULL, CTX_ALL},
 	{"autoconnect", ARG_RAW, option, NULL, CTX_ALL},
 	{"priority", ARG_INT, option, NULL, CTX_ALL},
 	{"ssl", ARG_RAW, option, NULL, CTX_ALL},
@@ -325,6 +329,26 @@ static DOTCONF_CB(option)
 			dc.database = trim(cmd->data.str);
 		} else if(name == "options") {
 			dc.options = trim(cmd->data.str);
+		} else if(name == "cachesize") {
+			if(cmd->data.value < 0) {
+				return "Invalid value for 'cachesize'";
+			}
+			dc.cache_size = cmd->data.value;
+		} else if(name == "writewindow") {
+			if(cmd->data.value < 0) {
+				return "Invalid value for 'writewindow'";
+			}
+			dc.write_window = cmd->data.value;
+		} else if(name == "writebatch") {
+			if(cmd->data.value < 1) {
+				return "Invalid value for 'writebatch'";
+			}
+			dc.write_batch = cmd->data.value;
+		} else if(name == "connections") {
+			if(cmd->data.value < 1) {
+				return "Invalid value for 'connections'";
+			}
+			dc.connections = cmd->data.value;
 		} else {
 			s->error = "Invalid option name in database context: " + name;
 			return "Configuration file contains errors";
@@ -0,0 +1,209 @@
+/**
+ * Copyright (c) Sjors Gielen, 2014
+ * See LICENSE for license.
+ */
+
+#include "databaseworker.h"
+#include "reactor.h"
+#include "db/database.h"
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdexcept>
+#include <string>
+#include <algorithm>
+
+// minimum amount of milliseconds before a failed flush is retried
+#define FLUSH_RETRY_INTERVAL 1000
+
+dazeus::DatabaseWorker::DatabaseWorker(Reactor *reactor, db::Database *database)
+: reactor_(reactor)
+, database_(database)
+, event_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+, mutex_()
+, jobsChanged_()
+, jobs_()
+, running_(false)
+, stopping_(false)
+, flushInterval_(0)
+, dirty_(false)
+, flushDeadline_()
+, completions_()
+, thread_()
+{
+	if(event_ < 0) {
+		throw std::runtime_error("Failed to create eventfd: " + std::string(strerror(errno)));
+	}
+	reactor_->add(event_, EPOLLIN, [this](uint32_t) {
+		runCompletions();
+	});
+	thread_ = std::thread(&DatabaseWorker::run, this);
+}
+
+/**
+ * @brief Finish all submitted jobs and stop the worker.
+ *
+ * Completions that didn't run yet are dropped.
+ */
+dazeus::DatabaseWorker::~DatabaseWorker() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	jobsChanged_.notify_all();
+	thread_.join();
+	reactor_->remove(event_);
+	close(event_);
+}
+
+/**
+ * @brief Run a job on the worker thread.
+ */
+void dazeus::DatabaseWorker::submit(Job job) {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		jobs_.push_back(job);
+	}
+	jobsChanged_.notify_all();
+}
+
+/**
+ * @brief Wait until all submitted jobs have finished.
+ *
+ * Their completions are run before this method returns.
+ */
+void dazeus::DatabaseWorker::sync() {
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		jobsChanged_.wait(lock, [this] { return jobs_.empty() && !running_; });
+	}
+	runCompletions();
+}
+
+/**
+ * @brief Change the database jobs are run on.
+ *
+ * Jobs that were submitted before still run on the old database, which is
+ * flushed and may be deleted after this method returns.
+ */
+void dazeus::DatabaseWorker::setDatabase(db::Database *database) {
+	sync();
+	std::unique_lock<std::mutex> lock(mutex_);
+	if(dirty_) {
+		// the worker is idle, so the database can be used from here
+		running_ = true;
+		flush(lock);
+		running_ = false;
+		// a failed flush is not retried on the new database; the old one
+		// tries again when it is deleted
+		dirty_ = false;
+	}
+	database_ = database;
+}
+
+void dazeus::DatabaseWorker::setFlushInterval(std::chrono::milliseconds interval) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	flushInterval_ = interval;
+}
+
+/**
+ * @brief Flush the database; called with the lock held.
+ *
+ * If flushing fails, it is retried after the flush interval, unless the
+ * worker is stopping.
+ */
+void dazeus::DatabaseWorker::flush(std::unique_lock<std::mutex> &lock) {
+	db::Database *database = database_;
+	dirty_ = false;
+	lock.unlock();
+	bool failed = false;
+	try {
+		if(database) {
+			database->flush();
+		}
+	} catch(std::exception &e) {
+		fprintf(stderr, "Failed to flush database: %s\n", e.what());
+		failed = true;
+	}
+	lock.lock();
+	if(failed && !stopping_) {
+		// the changes are still held back; try again later
+		dirty_ = true;
+		flushDeadline_ = std::chrono::steady_clock::now()
+			+ std::max(flushInterval_, std::chrono::milliseconds(FLUSH_RETRY_INTERVAL));
+	}
+}
+
+void dazeus::DatabaseWorker::run() {
+	std::unique_lock<std::mutex> lock(mutex_);
+	while(1) {
+		auto ready = [this] { return stopping_ || !jobs_.empty(); };
+		if(dirty_) {
+			jobsChanged_.wait_until(lock, flushDeadline_, ready);
+		} else {
+			jobsChanged_.wait(lock, ready);
+		}
+
+		if(dirty_ && (jobs_.empty() || std::chrono::steady_clock::now() >= flushDeadline_)) {
+			running_ = true;
+			flush(lock);
+			running_ = false;
+			jobsChanged_.notify_all();
+			continue;
+		}
+		if(jobs_.empty()) {
+			// stopping, and everything is done
+			return;
+		}
+
+		Job job = jobs_.front();
+		jobs_.pop_front();
+		running_ = true;
+		db::Database *database = database_;
+		lock.unlock();
+
+		Completion completion;
+		try {
+			completion = job(database);
+		} catch(std::exception &e) {
+			fprintf(stderr, "Uncaught exception in database job: %s\n", e.what());
+		}
+		// whatever the job holds is released on this thread, before the
+		// completion can run
+		job = Job();
+
+		lock.lock();
+		running_ = false;
+		if(!dirty_ && flushInterval_.count() > 0) {
+			dirty_ = true;
+			flushDeadline_ = std::chrono::steady_clock::now() + flushInterval_;
+		}
+		if(completion) {
+			completions_.push_back(completion);
+			uint64_t one = 1;
+			if(write(event_, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+				fprintf(stderr, "Failed to signal database completion: %s\n", strerror(errno));
+			}
+		}
+		jobsChanged_.notify_all();
+	}
+}
+
+void dazeus::DatabaseWorker::runCompletions() {
+	uint64_t count;
+	if(read(event_, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		fprintf(stderr, "Failed to read database completions: %s\n", strerror(errno));
+	}
+
+	std::vector<Completion> completions;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		completions.swap(completions_);
+	}
+	for(auto it = completions.begin(); it != completions.end(); ++it) {
+		(*it)();
+	}
+}
@@ -0,0 +1,80 @@
+/**
+ * Copyright (c) Sjors Gielen, 2014
+ * See LICENSE for license.
+ */
+
+#ifndef DATABASEWORKER_H
+#define DATABASEWORKER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace dazeus {
+
+namespace db {
+  class Database;
+}
+
+class Reactor;
+
+/**
+ * @class DatabaseWorker
+ * @brief Runs database queries on a thread of its own.
+ *
+ * Jobs are run one at a time, in the order they were submitted, so the
+ * database backends don't need to be thread-safe. Every job returns a
+ * completion, which is run on the reactor thread after the job finished;
+ * completions run in the same order as their jobs.
+ *
+ * If a flush interval is set, the database is flushed that long after the
+ * first job since the previous flush, so changes it holds back in memory
+ * are written in time.
+ */
+class DatabaseWorker
+{
+  public:
+    typedef std::function<void()> Completion;
+    typedef std::function<Completion(db::Database*)> Job;
+
+         DatabaseWorker(Reactor *reactor, db::Database *database);
+        ~DatabaseWorker();
+
+    void submit(Job job);
+    void setDatabase(db::Database *database);
+    void setFlushInterval(std::chrono::milliseconds interval);
+    void sync();
+
+  private:
+    // explicitly disable copy constructor
+    DatabaseWorker(const DatabaseWorker&);
+    void operator=(const DatabaseWorker&);
+
+    void run();
+    void flush(std::unique_lock<std::mutex> &lock);
+    void runCompletions();
+
+    Reactor *reactor_;
+    db::Database *database_;
+    // signalled to the reactor when completions are waiting
+    int event_;
+    std::mutex mutex_;
+    std::condition_variable jobsChanged_;
+    std::deque<Job> jobs_;
+    bool running_;
+    bool stopping_;
+    std::chrono::milliseconds flushInterval_;
+    // whether jobs ran since the last flush, and when to flush them
+    bool dirty_;
+    std::chrono::steady_clock::time_point flushDeadline_;
+    std::vector<Completion> completions_;
+    std::thread thread_;
+};
+
+}
+
+#endif
@@ -7,12 +7,19 @@
 #include "db/database.h"
 #include "db/factory.h"
 #include "network.h"
+#include "networkwatch.h"
 #include "config.h"
 #include "plugincomm.h"
 #include "pluginmonitor.h"
+#include "reactor.h"
 #include <cassert>
 #include <sstream>
 #include <iostream>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
 
 using dazeus::db::DatabaseConfig;
 using dazeus::db::Database;
@@ -27,15 +34,33 @@ using dazeus::db::Factory;
  * @param configFileName Path to the configuration file.
  */
 dazeus::DaZeus::DaZeus( std::string configFileName )
-: config_(std::make_shared<ConfigReader>())
+: reactor_(new Reactor())
+, signalFd_(-1)
+, config_(std::make_shared<ConfigReader>())
 , configFileName_( configFileName )
 , plugins_( 0 )
 , plugin_monitor_( 0 )
 , database_( 0 )
 , networks_()
+, networkWatches_()
 , running_(false)
 , config_reload_pending_(true)
 {
+  // Child exits and reload requests are read from a signalfd in the event
+  // loop. The signals must be blocked before any threads are started, so
+  // that they inherit the mask and the signals reach the signalfd.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGCHLD);
+  sigaddset(&signals, SIGHUP);
+  if(sigprocmask(SIG_BLOCK, &signals, NULL) < 0) {
+    throw std::runtime_error("Failed to block signals: " + std::string(strerror(errno)));
+  }
+  signalFd_ = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  if(signalFd_ < 0) {
+    throw std::runtime_error("Failed to create signalfd: " + std::string(strerror(errno)));
+  }
+  reactor_->add(signalFd_, EPOLLIN, [this](uint32_t) { handleSignals(); });
 }
 
 
@@ -46,14 +71,19 @@ dazeus::DaZeus::~DaZeus()
 {
   for(auto it = networks_.begin(); it != networks_.end(); ++it)
   {
+    delete networkWatches_[it->first];
     it->second->disconnectFromNetwork( Network::ShutdownReason );
     delete it->second;
   }
   networks_.clear();
+  networkWatches_.clear();
 
   delete plugin_monitor_;
   delete plugins_;
   delete database_;
+  reactor_->remove(signalFd_);
+  close(signalFd_);
+  delete reactor_;
 }
 
 std::string dazeus::DaZeus::configFileName() const {
@@ -76,7 +106,12 @@ bool dazeus::DaZeus::connectDatabase()
 {
   assert(config_->isRead());
   if(database_) {
+    // wait for queries on the old database to finish
+    if(plugins_) {
+      plugins_->setDatabase(NULL);
+    }
     delete database_;
+    database_ = 0;
   }
   try {
     database_ = Factory::createDb(config_->getDatabaseConfig());
@@ -132,12 +167,12 @@ bool dazeus::DaZeus::loadConfig()
     plugins_->setDatabase(database_);
     // TODO: update socketconfig in PluginComm without breaking existing sockets
   } else {
-    plugins_ = new PluginComm( database_, config_, this );
+    plugins_ = new PluginComm( database_, config_, this, reactor_ );
     plugins_->init();
   }
 
   if(!plugin_monitor_) {
-    plugin_monitor_ = new PluginMonitor(config_);
+    plugin_monitor_ = new PluginMonitor(config_, reactor_);
   }
 
   try {
@@ -156,6 +191,7 @@ bool dazeus::DaZeus::loadConfig()
       Network *net = new Network(*it);
       net->addListener(plugins_);
       networks_[name] = net;
+      networkWatches_[name] = new NetworkWatch(reactor_, net);
 
       if(net->autoConnectEnabled()) {
         net->connectToNetwork();
@@ -178,6 +214,8 @@ bool dazeus::DaZeus::loadConfig()
     if(!found) {
       Network *net = nit->second;
       networks_.erase(nit++);
+      delete networkWatches_[name];
+      networkWatches_.erase(name);
       net->disconnectFromNetwork(Network::ConfigurationReloadReason);
       delete net;
     } else {
@@ -187,16 +225,7 @@ bool dazeus::DaZeus::loadConfig()
 
   // Pretty number of initialisations viewer -- and also an immediate database
   // check.
-  std::stringstream numInitsStr;
-  numInitsStr << database_->property("dazeus.numinits");
-  int numInits;
-  numInitsStr >> numInits;
-  if(!numInitsStr)
-    numInits = 0;
-  ++numInits;
-  numInitsStr.str(""); numInitsStr.clear();
-  numInitsStr << numInits;
-  database_->setProperty("dazeus.numinits", numInitsStr.str());
+  int numInits = (int)database_->incrementProperty("dazeus.numinits", 1);
   const char *suffix = "th";
   if(numInits%100 == 11 ) ;
   else if(numInits%100 == 12) ;
@@ -208,9 +237,28 @@ bool dazeus::DaZeus::loadConfig()
   return true;
 }
 
-void dazeus::DaZeus::sigchild()
+/**
+ * @brief Handle the signals that arrived on the signalfd.
+ *
+ * Exited plugins are reaped right away; a configuration reload is done at
+ * the start of the next loop iteration.
+ */
+void dazeus::DaZeus::handleSignals()
 {
-	plugin_monitor_->sigchild();
+	struct signalfd_siginfo info;
+	bool childExited = false;
+	while(read(signalFd_, &info, sizeof(info)) == sizeof(info)) {
+		if(info.ssi_signo == SIGHUP) {
+			reloadConfig();
+		} else if(info.ssi_signo == SIGCHLD) {
+			childExited = true;
+		}
+	}
+
+	if(childExited && plugin_monitor_) {
+		plugin_monitor_->sigchild();
+		plugin_monitor_->runOnce();
+	}
 }
 
 void dazeus::DaZeus::stop()
@@ -230,15 +278,19 @@ void dazeus::DaZeus::run()
 			}
 			initial_config = false;
 		}
-		plugin_monitor_->runOnce();
-		// The only non-socket processing in DaZeus is done by the
-		// plugin monitor. It works using signals (primarily SIGCHLD),
-		// which already interrupt select(). However, its timing in
-		// re-starting plugins has a granularity of 5 seconds, so if it
-		// is waiting to restart a plugin, we will decrease our timeout
-		// length to once every second. If it is in a normal state, we
-		// can use any granularity we want.
-		plugins_->run(plugin_monitor_->shouldRun() ? 1 : 30);
+		// Everything else is driven by the reactor: exited plugins
+		// are reported through the signalfd, and plugin restarts,
+		// network timeouts and the like are timers on the reactor,
+		// so it can sleep until the next one is due.
+		reactor_->runOnce();
+	}
+
+	// Let the plugins quit, while still handling I/O
+	if(plugin_monitor_) {
+		plugin_monitor_->shutdown();
+		while(plugin_monitor_->stopping()) {
+			reactor_->runOnce();
+		}
 	}
 }
 
@@ -20,7 +20,9 @@ class ConfigReader;
 typedef std::shared_ptr<ConfigReader> ConfigReaderPtr;
 class PluginComm;
 class Network;
+class NetworkWatch;
 class PluginMonitor;
+class Reactor;
 
 class DaZeus
 {
@@ -37,7 +39,6 @@ class DaZeus
     void     run();
     void     reloadConfig() { config_reload_pending_ = true; }
     void     stop();
-    void     sigchild();
 
   private:
     // explicitly disable copy constructor
@@ -46,13 +47,17 @@ class DaZeus
 
     bool     loadConfig();
     bool     connectDatabase();
+    void     handleSignals();
 
+    Reactor         *reactor_;
+    int              signalFd_;
     ConfigReaderPtr  config_;
     std::string      configFileName_;
     PluginComm      *plugins_;
     PluginMonitor   *plugin_monitor_;
     db::Database    *database_;
     std::map<std::string, Network*>  networks_;
+    std::map<std::string, NetworkWatch*>  networkWatches_;
     bool             running_;
     bool config_reload_pending_;
 };
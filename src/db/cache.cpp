@@ -0,0 +1,265 @@
+/**
+ * Copyright (c) 2014 Sjors Gielen, Ruben Nijveld, Aaron van Geffen
+ * See LICENSE for license.
+ */
+
+#include "cache.h"
+#include <algorithm>
+#include <iostream>
+
+namespace dazeus {
+namespace db {
+
+CachingDatabase::CachingDatabase(DatabaseConfig dbc, Database *backend)
+    : Database(dbc), backend_(backend), entries_(), index_(), variables_(),
+      hits_(0), misses_(0), evictions_(0) {}
+
+CachingDatabase::~CachingDatabase()
+{
+  std::cout << "Property cache: " << hits_ << " hits, " << misses_
+            << " misses, " << evictions_ << " evictions." << std::endl;
+  delete backend_;
+}
+
+void CachingDatabase::open()
+{
+  backend_->open();
+}
+
+std::string CachingDatabase::cacheKey(const std::string &variable,
+                                      const std::string &network,
+                                      const std::string &receiver,
+                                      const std::string &sender)
+{
+  std::string key;
+  key.reserve(variable.length() + network.length() + receiver.length() +
+              sender.length() + 3);
+  key.append(variable).append(1, '\0').append(network).append(1, '\0')
+     .append(receiver).append(1, '\0').append(sender);
+  return key;
+}
+
+/**
+ * @brief Remove an entry from the cache.
+ */
+void CachingDatabase::forget(Entries::iterator entry)
+{
+  auto vit = variables_.find(entry->variable);
+  if (vit != variables_.end()) {
+    std::vector<Entries::iterator> &entries = vit->second;
+    entries.erase(std::find(entries.begin(), entries.end(), entry));
+    if (entries.empty()) {
+      variables_.erase(vit);
+    }
+  }
+  index_.erase(entry->key);
+  entries_.erase(entry);
+}
+
+std::string CachingDatabase::property(const std::string &variable,
+                                      const std::string &networkScope,
+                                      const std::string &receiverScope,
+                                      const std::string &senderScope)
+{
+  std::string key = cacheKey(variable, networkScope, receiverScope, senderScope);
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    ++hits_;
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return it->second->value;
+  }
+
+  ++misses_;
+  std::string value = backend_->property(variable, networkScope, receiverScope,
+                                         senderScope);
+  remember(key, variable, networkScope, receiverScope, senderScope, value);
+  return value;
+}
+
+/**
+ * @brief Look up the properties that aren't remembered in one go.
+ */
+std::vector<std::string> CachingDatabase::properties(
+    const std::vector<std::string> &variables,
+    const std::string &networkScope, const std::string &receiverScope,
+    const std::string &senderScope)
+{
+  std::vector<std::string> values(variables.size());
+  std::vector<std::string> missing;
+  std::vector<size_t> missingIndices;
+  for (size_t i = 0; i < variables.size(); ++i) {
+    std::string key = cacheKey(variables[i], networkScope, receiverScope,
+                               senderScope);
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      ++hits_;
+      entries_.splice(entries_.begin(), entries_, it->second);
+      values[i] = it->second->value;
+    } else {
+      ++misses_;
+      missing.push_back(variables[i]);
+      missingIndices.push_back(i);
+    }
+  }
+
+  if (missing.empty()) {
+    return values;
+  }
+
+  std::vector<std::string> found = backend_->properties(missing, networkScope,
+      receiverScope, senderScope);
+  for (size_t i = 0; i < missing.size(); ++i) {
+    values[missingIndices[i]] = found[i];
+    std::string key = cacheKey(missing[i], networkScope, receiverScope,
+                               senderScope);
+    if (index_.count(key) == 0) {
+      remember(key, missing[i], networkScope, receiverScope, senderScope,
+               found[i]);
+    }
+  }
+  return values;
+}
+
+/**
+ * @brief Remember the result of a lookup, forgetting the least recently
+ * used one if the cache is full.
+ */
+void CachingDatabase::remember(const std::string &key,
+    const std::string &variable, const std::string &network,
+    const std::string &receiver, const std::string &sender,
+    const std::string &value)
+{
+  if (dbc_.cache_size == 0) {
+    return;
+  }
+
+  if (entries_.size() >= dbc_.cache_size) {
+    ++evictions_;
+    forget(std::prev(entries_.end()));
+  }
+
+  Entry entry;
+  entry.key = key;
+  entry.variable = variable;
+  entry.network = network;
+  entry.receiver = receiver;
+  entry.sender = sender;
+  entry.value = value;
+  entries_.push_front(entry);
+  index_[key] = entries_.begin();
+  variables_[variable].push_back(entries_.begin());
+}
+
+void CachingDatabase::setProperty(const std::string &variable,
+    const std::string &value, const std::string &networkScope,
+    const std::string &receiverScope,
+    const std::string &senderScope)
+{
+  backend_->setProperty(variable, value, networkScope, receiverScope,
+                        senderScope);
+  invalidate(variable, networkScope, receiverScope, senderScope);
+}
+
+void CachingDatabase::setProperties(const std::vector<PropertyChange> &changes)
+{
+  backend_->setProperties(changes);
+  for (auto it = changes.begin(); it != changes.end(); ++it) {
+    invalidate(it->variable, it->network, it->receiver, it->sender);
+  }
+}
+
+void CachingDatabase::flush()
+{
+  backend_->flush();
+}
+
+/**
+ * @brief Forget the lookups a change of a property may have affected.
+ */
+void CachingDatabase::invalidate(const std::string &variable,
+                                 const std::string &network,
+                                 const std::string &receiver,
+                                 const std::string &sender)
+{
+  auto vit = variables_.find(variable);
+  if (vit == variables_.end()) {
+    return;
+  }
+
+  // A property is visible from lookups in the same scope or a more specific
+  // one; those lookups may now have a different result.
+  std::vector<Entries::iterator> affected;
+  for (auto eit = vit->second.begin(); eit != vit->second.end(); ++eit) {
+    const Entry &e = **eit;
+    if ((network.empty() || network == e.network) &&
+        (receiver.empty() || receiver == e.receiver) &&
+        (sender.empty() || sender == e.sender)) {
+      affected.push_back(*eit);
+    }
+  }
+  for (auto ait = affected.begin(); ait != affected.end(); ++ait) {
+    forget(*ait);
+  }
+}
+
+int64_t CachingDatabase::incrementProperty(const std::string &variable,
+    int64_t delta, const std::string &networkScope,
+    const std::string &receiverScope, const std::string &senderScope)
+{
+  int64_t result = backend_->incrementProperty(variable, delta, networkScope,
+                                               receiverScope, senderScope);
+  invalidate(variable, networkScope, receiverScope, senderScope);
+  return result;
+}
+
+bool CachingDatabase::compareAndSetProperty(const std::string &variable,
+    const std::string &expected, const std::string &value,
+    const std::string &networkScope, const std::string &receiverScope,
+    const std::string &senderScope)
+{
+  bool changed = backend_->compareAndSetProperty(variable, expected, value,
+      networkScope, receiverScope, senderScope);
+  if (changed) {
+    invalidate(variable, networkScope, receiverScope, senderScope);
+  }
+  return changed;
+}
+
+std::vector<std::string> CachingDatabase::propertyKeyPage(
+      const std::string &prefix, const std::string &after, size_t limit,
+      std::string *next, const std::string &networkScope,
+      const std::string &receiverScope, const std::string &senderScope)
+{
+  return backend_->propertyKeyPage(prefix, after, limit, next, networkScope,
+                                   receiverScope, senderScope);
+}
+
+bool CachingDatabase::hasPermission(const std::string &perm_name,
+      const std::string &network, const std::string &channel,
+      const std::string &sender, bool defaultPermission) const
+{
+  return backend_->hasPermission(perm_name, network, channel, sender,
+                                 defaultPermission);
+}
+
+void CachingDatabase::unsetPermission(const std::string &perm_name,
+      const std::string &network, const std::string &receiver,
+      const std::string &sender)
+{
+  backend_->unsetPermission(perm_name, network, receiver, sender);
+}
+
+void CachingDatabase::setPermission(bool permission, const std::string &perm_name,
+      const std::string &network, const std::string &receiver,
+      const std::string &sender)
+{
+  backend_->setPermission(permission, perm_name, network, receiver, sender);
+}
+
+std::vector<PermissionEntry> CachingDatabase::permissions()
+{
+  return backend_->permissions();
+}
+
+}  // namespace db
+}  // namespace dazeus
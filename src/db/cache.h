@@ -0,0 +1,124 @@
+/**
+ * Copyright (c) 2014 Sjors Gielen, Ruben Nijveld, Aaron van Geffen
+ * See LICENSE for license.
+ */
+
+#ifndef DB_CACHE_H_
+#define DB_CACHE_H_
+
+#include <stdint.h>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "database.h"
+
+namespace dazeus {
+namespace db {
+
+/**
+ * @class CachingDatabase
+ * @brief Keeps recently looked up properties of another database in memory.
+ *
+ * Every lookup is remembered together with its scope, including lookups
+ * that found nothing. A property set in some scope is visible from exactly
+ * those scopes that are equal to it or more specific, so setting a property
+ * only forgets the remembered lookups of that variable in such scopes.
+ *
+ * The amount of remembered lookups is bounded by the cache size of the
+ * database configuration; the least recently used ones are forgotten first.
+ * Everything else is passed on to the wrapped database.
+ */
+class CachingDatabase : public Database {
+ public:
+  CachingDatabase(DatabaseConfig dbc, Database *backend);
+  ~CachingDatabase();
+
+  void open();
+  std::string property(const std::string &variable,
+                       const std::string &networkScope = "",
+                       const std::string &receiverScope = "",
+                       const std::string &senderScope = "");
+  void setProperty(const std::string &variable, const std::string &value,
+                   const std::string &networkScope = "",
+                   const std::string &receiverScope = "",
+                   const std::string &senderScope = "");
+  int64_t incrementProperty(const std::string &variable, int64_t delta,
+                            const std::string &networkScope = "",
+                            const std::string &receiverScope = "",
+                            const std::string &senderScope = "");
+  bool compareAndSetProperty(const std::string &variable,
+                             const std::string &expected,
+                             const std::string &value,
+                             const std::string &networkScope = "",
+                             const std::string &receiverScope = "",
+                             const std::string &senderScope = "");
+  std::vector<std::string> propertyKeyPage(
+      const std::string &prefix, const std::string &after, size_t limit,
+      std::string *next, const std::string &networkScope = "",
+      const std::string &receiverScope = "",
+      const std::string &senderScope = "");
+  bool hasPermission(const std::string &perm_name, const std::string &network,
+                     const std::string &channel, const std::string &sender,
+                     bool defaultPermission) const;
+  void unsetPermission(const std::string &perm_name, const std::string &network,
+                       const std::string &receiver = "",
+                       const std::string &sender = "");
+  void setPermission(bool permission, const std::string &perm_name,
+                     const std::string &network,
+                     const std::string &receiver = "",
+                     const std::string &sender   = "");
+  std::vector<PermissionEntry> permissions();
+  void setProperties(const std::vector<PropertyChange> &changes);
+  std::vector<std::string> properties(
+      const std::vector<std::string> &variables,
+      const std::string &networkScope = "",
+      const std::string &receiverScope = "",
+      const std::string &senderScope = "");
+  void flush();
+
+  uint64_t hits() const { return hits_; }
+  uint64_t misses() const { return misses_; }
+  uint64_t evictions() const { return evictions_; }
+
+ private:
+  // explicitly disable copy constructor
+  explicit CachingDatabase(const CachingDatabase&);
+  void operator=(const CachingDatabase&);
+
+  struct Entry {
+    std::string key;
+    std::string variable;
+    std::string network;
+    std::string receiver;
+    std::string sender;
+    std::string value;
+  };
+  typedef std::list<Entry> Entries;
+
+  static std::string cacheKey(const std::string &variable,
+                              const std::string &network,
+                              const std::string &receiver,
+                              const std::string &sender);
+  void remember(const std::string &key, const std::string &variable,
+                const std::string &network, const std::string &receiver,
+                const std::string &sender, const std::string &value);
+  void forget(Entries::iterator entry);
+  void invalidate(const std::string &variable, const std::string &network,
+                  const std::string &receiver, const std::string &sender);
+
+  Database *backend_;
+  // most recently used entries first
+  Entries entries_;
+  std::unordered_map<std::string, Entries::iterator> index_;
+  std::unordered_map<std::string, std::vector<Entries::iterator> > variables_;
+  uint64_t hits_;
+  uint64_t misses_;
+  uint64_t evictions_;
+};
+
+}  // namespace db
+}  // namespace dazeus
+
+#endif  // DB_CACHE_H_
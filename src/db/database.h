@@ -22,14 +22,19 @@ struct DatabaseConfig {
                  uint16_t p = 27017, const std::string &user = "",
                  const std::string &pass = "", const std::string &fname = "",
                  const std::string &db = "dazeus",
-                 const std::string &opt = "")
+                 const std::string &opt = "", uint32_t cache = 0,
+                 uint32_t window = 0, uint32_t batch = 100,
+                 uint32_t conns = 4)
       : type(t), hostname(h), port(p), username(user), password(pass),
-        filename(fname), database(db), options(opt) {}
+        filename(fname), database(db), options(opt), cache_size(cache),
+        write_window(window), write_batch(batch), connections(conns) {}
 
   DatabaseConfig(const DatabaseConfig &s)
       : type(s.type), hostname(s.hostname), port(s.port), username(s.username),
         password(s.password), filename(s.filename), database(s.database),
-        options(s.options) {}
+        options(s.options), cache_size(s.cache_size),
+        write_window(s.write_window), write_batch(s.write_batch),
+        connections(s.connections) {}
 
   const DatabaseConfig &operator=(const DatabaseConfig &s) {
     type = s.type;
@@ -40,6 +45,10 @@ struct DatabaseConfig {
     filename = s.filename;
     database = s.database;
     options = s.options;
+    cache_size = s.cache_size;
+    write_window = s.write_window;
+    write_batch = s.write_batch;
+    connections = s.connections;
     return *this;
   }
 
@@ -51,6 +60,36 @@ struct DatabaseConfig {
   std::string filename;
   std::string database;
   std::string options;
+  // amount of property lookups to cache, or 0 to disable the cache
+  uint32_t cache_size;
+  // milliseconds to hold back property writes, or 0 to write them directly
+  uint32_t write_window;
+  // amount of held back property writes after which they are written anyway
+  uint32_t write_batch;
+  // maximum amount of connections to open, for databases that pool them
+  uint32_t connections;
+};
+
+/**
+ * @brief A change of a property; an empty value removes the property.
+ */
+struct PropertyChange {
+  std::string variable;
+  std::string value;
+  std::string network;
+  std::string receiver;
+  std::string sender;
+};
+
+/**
+ * @brief A permission as stored in a database.
+ */
+struct PermissionEntry {
+  std::string permission;
+  std::string network;
+  std::string receiver;
+  std::string sender;
+  bool granted;
 };
 
 /**
@@ -80,9 +119,53 @@ class Database {
                            const std::string &networkScope = "",
                            const std::string &receiverScope = "",
                            const std::string &senderScope = "") = 0;
+  /**
+   * @brief Atomically add delta to an integer property, and return the sum.
+   *
+   * Only the property in exactly the given scope is changed; if it doesn't
+   * exist or isn't an integer, it counts as 0.
+   */
+  virtual int64_t incrementProperty(const std::string &variable,
+                                    int64_t delta,
+                                    const std::string &networkScope = "",
+                                    const std::string &receiverScope = "",
+                                    const std::string &senderScope = "") = 0;
+  /**
+   * @brief Atomically change a property, if it has the expected value.
+   *
+   * Only the property in exactly the given scope is compared and changed. An
+   * empty expected value means the property must not exist, an empty new
+   * value removes it. Returns whether the property was changed.
+   */
+  virtual bool compareAndSetProperty(const std::string &variable,
+                                     const std::string &expected,
+                                     const std::string &value,
+                                     const std::string &networkScope = "",
+                                     const std::string &receiverScope = "",
+                                     const std::string &senderScope = "") = 0;
+  /**
+   * @brief Retrieve all property keys with a certain prefix, set in exactly
+   * the given scope.
+   */
   virtual std::vector<std::string> propertyKeys(
       const std::string &prefix, const std::string &networkScope = "",
       const std::string &receiverScope = "",
+      const std::string &senderScope = "") {
+    return propertyKeyPage(prefix, "", 0, NULL, networkScope, receiverScope,
+                           senderScope);
+  }
+  /**
+   * @brief Retrieve a page of the property keys with a certain prefix.
+   *
+   * Keys are returned in order, starting after the given position, or at the
+   * start if it is empty; a limit of 0 returns all remaining keys. If more
+   * keys remain, next is set to the position to continue after, otherwise it
+   * is cleared. Positions are only meaningful to the same database.
+   */
+  virtual std::vector<std::string> propertyKeyPage(
+      const std::string &prefix, const std::string &after, size_t limit,
+      std::string *next, const std::string &networkScope = "",
+      const std::string &receiverScope = "",
       const std::string &senderScope = "") = 0;
   virtual bool hasPermission(const std::string &perm_name,
                              const std::string &network,
@@ -97,8 +180,71 @@ class Database {
                              const std::string &network,
                              const std::string &receiver = "",
                              const std::string &sender = "") = 0;
+  /**
+   * @brief Retrieve all stored permissions.
+   *
+   * Used to load the permission index; hasPermission() of a backend itself
+   * only matches the exact scope.
+   */
+  virtual std::vector<PermissionEntry> permissions() = 0;
+
+  /**
+   * @brief Apply a list of property changes, in order.
+   *
+   * Backends that support transactions apply them in a single one.
+   */
+  virtual void setProperties(const std::vector<PropertyChange> &changes) {
+    for (auto it = changes.begin(); it != changes.end(); ++it) {
+      setProperty(it->variable, it->value, it->network, it->receiver,
+                  it->sender);
+    }
+  }
+
+  /**
+   * @brief Retrieve several properties in the same scope at once.
+   *
+   * Every variable is resolved like property() would; the values are
+   * returned in the order of the variables, empty for missing properties.
+   * Backends that can, look them up in a single query.
+   */
+  virtual std::vector<std::string> properties(
+      const std::vector<std::string> &variables,
+      const std::string &networkScope = "",
+      const std::string &receiverScope = "",
+      const std::string &senderScope = "") {
+    std::vector<std::string> values;
+    values.reserve(variables.size());
+    for (auto it = variables.begin(); it != variables.end(); ++it) {
+      values.push_back(property(*it, networkScope, receiverScope, senderScope));
+    }
+    return values;
+  }
+
+  /**
+   * @brief Write changes that are held back in memory, if any.
+   */
+  virtual void flush() {}
 
  protected:
+  /**
+   * @brief Returns the smallest string that is greater than all strings
+   * starting with the prefix, or an empty string if there is none.
+   *
+   * This turns a prefix search into a range scan on an index.
+   */
+  static std::string prefixSuccessor(const std::string &prefix) {
+    std::string successor = prefix;
+    while (!successor.empty()) {
+      unsigned char last = successor.back();
+      if (last < 0xff) {
+        successor.back() = last + 1;
+        break;
+      }
+      successor.pop_back();
+    }
+    return successor;
+  }
+
   DatabaseConfig dbc_;
 };
 
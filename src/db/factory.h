@@ -2,6 +2,10 @@
 #define DB_FACTORY_H_
 
 #include "database.h"
+#include "cache.h"
+#include "writebehind.h"
+#include "memory.h"
+#include "permissionindex.h"
 
 #ifdef DB_POSTGRES
 #include "postgres.h"
@@ -15,6 +19,10 @@
 #include "mongo.h"
 #endif
 
+#ifdef DB_LMDB
+#include "lmdb.h"
+#endif
+
 namespace dazeus {
 namespace db {
 
@@ -24,6 +32,10 @@ class Factory {
   {
     Database *instance = NULL;
 
+    if (dbc.type == "memory") {
+      instance = new MemoryDatabase(dbc);
+    }
+
     #ifdef DB_POSTGRES
     if (dbc.type == "postgres" || dbc.type == "postgresql"
         || dbc.type == "pq" || dbc.type == "psql") {
@@ -43,11 +55,27 @@ class Factory {
     }
     #endif
 
+    #ifdef DB_LMDB
+    if (dbc.type == "lmdb") {
+      instance = new LMDBDatabase(dbc);
+    }
+    #endif
+
     if (!instance) {
       throw dazeus::db::exception(
           "Database of type '" + dbc.type + "' not supported");
     }
 
+    instance = new PermissionIndexDatabase(dbc, instance);
+
+    if (dbc.write_window > 0) {
+      instance = new WriteBehindDatabase(dbc, instance);
+    }
+
+    if (dbc.cache_size > 0) {
+      instance = new CachingDatabase(dbc, instance);
+    }
+
     return instance;
   }
 };
@@ -0,0 +1,498 @@
+/**
+ * Copyright (c) 2014 Sjors Gielen, Ruben Nijveld, Aaron van Geffen
+ * See LICENSE for license.
+ */
+
+#include "lmdb.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+
+// default size of the memory map, which is the most the database can grow to;
+// it only reserves address space, pages are mapped in as they are used
+#define LMDB_DEFAULT_MAP_SIZE (16ULL << 30)
+
+namespace dazeus {
+namespace db {
+
+/**
+ * @brief Throw an exception if an LMDB call failed.
+ */
+static void check(int result, const std::string &what)
+{
+  if (result != MDB_SUCCESS) {
+    throw exception(what + ": " + mdb_strerror(result));
+  }
+}
+
+static MDB_val toVal(const std::string &s)
+{
+  MDB_val val;
+  val.mv_size = s.length();
+  val.mv_data = const_cast<char*>(s.data());
+  return val;
+}
+
+namespace {
+
+/**
+ * @brief A write transaction, aborted unless it is committed.
+ */
+class WriteTransaction {
+ public:
+  explicit WriteTransaction(MDB_env *env) : txn_(NULL)
+  {
+    check(mdb_txn_begin(env, NULL, 0, &txn_), "Failed to begin transaction");
+  }
+  ~WriteTransaction()
+  {
+    if (txn_) {
+      mdb_txn_abort(txn_);
+    }
+  }
+
+  MDB_txn *get() const { return txn_; }
+  void commit()
+  {
+    MDB_txn *txn = txn_;
+    txn_ = NULL;
+    check(mdb_txn_commit(txn), "Failed to commit transaction");
+  }
+
+ private:
+  MDB_txn *txn_;
+};
+
+/**
+ * @brief A read transaction on a reused handle, which is renewed when the
+ * read starts and reset when it ends.
+ */
+class ReadTransaction {
+ public:
+  ReadTransaction(MDB_env *env, MDB_txn *&handle) : txn_(handle)
+  {
+    if (txn_) {
+      check(mdb_txn_renew(txn_), "Failed to renew read transaction");
+    } else {
+      check(mdb_txn_begin(env, NULL, MDB_RDONLY, &handle),
+            "Failed to begin read transaction");
+      txn_ = handle;
+    }
+  }
+  ~ReadTransaction() { mdb_txn_reset(txn_); }
+
+  MDB_txn *get() const { return txn_; }
+
+ private:
+  MDB_txn *txn_;
+};
+
+class Cursor {
+ public:
+  Cursor(MDB_txn *txn, MDB_dbi dbi) : cursor_(NULL)
+  {
+    check(mdb_cursor_open(txn, dbi, &cursor_), "Failed to open cursor");
+  }
+  ~Cursor() { mdb_cursor_close(cursor_); }
+
+  MDB_cursor *get() const { return cursor_; }
+
+ private:
+  MDB_cursor *cursor_;
+};
+
+}  // namespace
+
+/**
+ * @brief Store a value under a key, or remove the key if the value is empty.
+ *
+ * Keys longer than the LMDB key size can't be stored, so there is nothing to
+ * remove under them either.
+ */
+static void store(MDB_txn *txn, MDB_dbi dbi, const std::string &key,
+                  const std::string &value)
+{
+  MDB_val k = toVal(key);
+  if (value.empty()) {
+    int result = mdb_del(txn, dbi, &k, NULL);
+    if (result != MDB_NOTFOUND && result != MDB_BAD_VALSIZE) {
+      check(result, "Failed to remove key");
+    }
+  } else {
+    MDB_val v = toVal(value);
+    int result = mdb_put(txn, dbi, &k, &v, 0);
+    if (result == MDB_BAD_VALSIZE) {
+      throw exception("Name and scope are too long to store: " +
+                      std::to_string(key.length()) + " bytes, at most " +
+                      std::to_string(mdb_env_get_maxkeysize(
+                          mdb_txn_env(txn))) + " allowed");
+    }
+    check(result, "Failed to store key");
+  }
+}
+
+/**
+ * @brief Look up the value of a key, and return whether it exists.
+ *
+ * Keys longer than the LMDB key size are never stored, so they don't exist.
+ */
+static bool fetch(MDB_txn *txn, MDB_dbi dbi, const std::string &key,
+                  std::string *value)
+{
+  MDB_val k = toVal(key);
+  MDB_val v;
+  int result = mdb_get(txn, dbi, &k, &v);
+  if (result == MDB_NOTFOUND || result == MDB_BAD_VALSIZE) {
+    return false;
+  }
+  check(result, "Failed to look up key");
+  if (value) {
+    value->assign(static_cast<const char*>(v.mv_data), v.mv_size);
+  }
+  return true;
+}
+
+LMDBDatabase::~LMDBDatabase()
+{
+  if (env_) {
+    if (reader_) {
+      mdb_txn_abort(reader_);
+    }
+    mdb_env_close(env_);
+  }
+}
+
+/**
+ * @brief Open the database in the configured file.
+ *
+ * The options of the database config may set map_size, the most the
+ * database may grow to in bytes, and sync: full (the default) flushes every
+ * commit to disk, nometa leaves flushing the metadata to the next commit, and
+ * off leaves flushing to the operating system.
+ */
+void LMDBDatabase::open()
+{
+  if (dbc_.filename.empty()) {
+    throw exception("An LMDB database needs a Filename");
+  }
+
+  size_t mapSize = LMDB_DEFAULT_MAP_SIZE;
+  std::string sync = "full";
+  unsigned int flags = MDB_NOSUBDIR | MDB_NOTLS;
+
+  const std::string &options = dbc_.options;
+  size_t pos = 0;
+  while (pos < options.length()) {
+    size_t end = options.find_first_of(" \t,;", pos);
+    if (end == std::string::npos) {
+      end = options.length();
+    }
+    std::string option = options.substr(pos, end - pos);
+    pos = end + 1;
+    if (option.empty()) {
+      continue;
+    }
+
+    size_t eq = option.find('=');
+    std::string name = option.substr(0, eq);
+    std::string value = eq == std::string::npos ? "" : option.substr(eq + 1);
+    if (name == "map_size") {
+      char *valueEnd;
+      errno = 0;
+      unsigned long long size = strtoull(value.c_str(), &valueEnd, 10);
+      if (errno != 0 || value.empty() || *valueEnd != 0 || size == 0) {
+        throw exception("Invalid value for LMDB option map_size: " + value);
+      }
+      mapSize = size;
+    } else if (name == "sync") {
+      if (value == "nometa") {
+        flags |= MDB_NOMETASYNC;
+      } else if (value == "off") {
+        flags |= MDB_NOSYNC;
+      } else if (value != "full") {
+        throw exception("Invalid value for LMDB option sync: " + value);
+      }
+      sync = value;
+    } else {
+      throw exception("Unknown LMDB option: " + name);
+    }
+  }
+
+  check(mdb_env_create(&env_), "Failed to create LMDB environment");
+  check(mdb_env_set_mapsize(env_, mapSize), "Failed to set LMDB map size");
+  check(mdb_env_set_maxdbs(env_, 2), "Failed to set LMDB database count");
+  check(mdb_env_open(env_, dbc_.filename.c_str(), flags, 0644),
+        "Failed to open LMDB database " + dbc_.filename);
+
+  WriteTransaction txn(env_);
+  check(mdb_dbi_open(txn.get(), "properties", MDB_CREATE, &properties_),
+        "Failed to open properties");
+  check(mdb_dbi_open(txn.get(), "permissions", MDB_CREATE, &permissions_),
+        "Failed to open permissions");
+  txn.commit();
+
+  std::cout << "LMDB profile: map_size=" << mapSize << " sync=" << sync
+            << " max_key_size=" << mdb_env_get_maxkeysize(env_) << std::endl;
+}
+
+/**
+ * @brief Build the composite key of a property or permission.
+ *
+ * The scope fields are NUL-terminated, so the keys of one scope share a
+ * prefix that no other scope's keys have, and sort by name within it.
+ */
+std::string LMDBDatabase::makeKey(const std::string &network,
+                                  const std::string &receiver,
+                                  const std::string &sender,
+                                  const std::string &name)
+{
+  std::string key;
+  key.reserve(network.length() + receiver.length() + sender.length() +
+              name.length() + 3);
+  key.append(network).append(1, '\0');
+  key.append(receiver).append(1, '\0');
+  key.append(sender).append(1, '\0');
+  key.append(name);
+  return key;
+}
+
+/**
+ * @brief Find a property in the given scope or the most specific less
+ * specific one.
+ *
+ * Scopes are probed in the order the SQL backends sort them: by network,
+ * then receiver, then sender, each set before unset. Scopes whose key is
+ * longer than the LMDB key size can't hold the property, and are skipped.
+ */
+bool LMDBDatabase::find(MDB_cursor *cursor, const std::string &variable,
+                        const std::string &network, const std::string &receiver,
+                        const std::string &sender, std::string *value) const
+{
+  static const std::string none;
+  for (int mask = 7; mask >= 0; --mask) {
+    bool n = mask & 4, r = mask & 2, s = mask & 1;
+    if ((n && network.empty()) || (r && receiver.empty()) ||
+        (s && sender.empty())) {
+      continue;
+    }
+    std::string key = makeKey(n ? network : none, r ? receiver : none,
+                              s ? sender : none, variable);
+    MDB_val k = toVal(key);
+    MDB_val v;
+    int result = mdb_cursor_get(cursor, &k, &v, MDB_SET_KEY);
+    if (result == MDB_NOTFOUND || result == MDB_BAD_VALSIZE) {
+      continue;
+    }
+    check(result, "Failed to look up property");
+    value->assign(static_cast<const char*>(v.mv_data), v.mv_size);
+    return true;
+  }
+  return false;
+}
+
+std::string LMDBDatabase::property(const std::string &variable,
+                                   const std::string &networkScope,
+                                   const std::string &receiverScope,
+                                   const std::string &senderScope)
+{
+  ReadTransaction txn(env_, reader_);
+  Cursor cursor(txn.get(), properties_);
+  std::string value;
+  find(cursor.get(), variable, networkScope, receiverScope, senderScope,
+       &value);
+  return value;
+}
+
+std::vector<std::string> LMDBDatabase::properties(
+      const std::vector<std::string> &variables,
+      const std::string &networkScope, const std::string &receiverScope,
+      const std::string &senderScope)
+{
+  ReadTransaction txn(env_, reader_);
+  Cursor cursor(txn.get(), properties_);
+  std::vector<std::string> values(variables.size());
+  for (size_t i = 0; i < variables.size(); ++i) {
+    find(cursor.get(), variables[i], networkScope, receiverScope, senderScope,
+         &values[i]);
+  }
+  return values;
+}
+
+void LMDBDatabase::setProperty(const std::string &variable,
+    const std::string &value, const std::string &networkScope,
+    const std::string &receiverScope,
+    const std::string &senderScope)
+{
+  WriteTransaction txn(env_);
+  store(txn.get(), properties_,
+        makeKey(networkScope, receiverScope, senderScope, variable), value);
+  txn.commit();
+}
+
+void LMDBDatabase::setProperties(const std::vector<PropertyChange> &changes)
+{
+  WriteTransaction txn(env_);
+  for (auto it = changes.begin(); it != changes.end(); ++it) {
+    store(txn.get(), properties_,
+          makeKey(it->network, it->receiver, it->sender, it->variable),
+          it->value);
+  }
+  txn.commit();
+}
+
+int64_t LMDBDatabase::incrementProperty(const std::string &variable,
+    int64_t delta, const std::string &networkScope,
+    const std::string &receiverScope, const std::string &senderScope)
+{
+  // LMDB has a single writer, so the read and write can't be interleaved
+  WriteTransaction txn(env_);
+  std::string key = makeKey(networkScope, receiverScope, senderScope, variable);
+  std::string current;
+  int64_t sum = delta;
+  if (fetch(txn.get(), properties_, key, &current)) {
+    char *end;
+    errno = 0;
+    long long value = strtoll(current.c_str(), &end, 10);
+    if (errno == 0 && !current.empty() && *end == 0) {
+      sum += value;
+    }
+  }
+  store(txn.get(), properties_, key, std::to_string(sum));
+  txn.commit();
+  return sum;
+}
+
+bool LMDBDatabase::compareAndSetProperty(const std::string &variable,
+    const std::string &expected, const std::string &value,
+    const std::string &networkScope, const std::string &receiverScope,
+    const std::string &senderScope)
+{
+  WriteTransaction txn(env_);
+  std::string key = makeKey(networkScope, receiverScope, senderScope, variable);
+  std::string current;
+  bool exists = fetch(txn.get(), properties_, key, &current);
+  if (expected.empty() ? exists : !exists || current != expected) {
+    return false;
+  }
+  store(txn.get(), properties_, key, value);
+  txn.commit();
+  return true;
+}
+
+std::vector<std::string> LMDBDatabase::propertyKeyPage(
+      const std::string &prefix, const std::string &after, size_t limit,
+      std::string *next, const std::string &networkScope,
+      const std::string &receiverScope, const std::string &senderScope)
+{
+  std::vector<std::string> keys;
+  if (next) {
+    next->clear();
+  }
+
+  std::string scope = makeKey(networkScope, receiverScope, senderScope, "");
+  std::string begin = scope + prefix;
+  bool resume = !after.empty() && after >= prefix;
+  std::string start = resume ? scope + after : begin;
+  // no stored key is longer than the LMDB key size, so the first one after
+  // a longer start is the first one after its cut off start, but not that
+  // one itself
+  size_t maxKeySize = mdb_env_get_maxkeysize(env_);
+  if (start.length() > maxKeySize) {
+    start.resize(maxKeySize);
+    resume = true;
+  }
+
+  ReadTransaction txn(env_, reader_);
+  Cursor cursor(txn.get(), properties_);
+  MDB_val k = toVal(start);
+  MDB_val v;
+  int result = mdb_cursor_get(cursor.get(), &k, &v, MDB_SET_RANGE);
+  if (result == MDB_SUCCESS && resume && k.mv_size == start.length() &&
+      memcmp(k.mv_data, start.data(), k.mv_size) == 0) {
+    result = mdb_cursor_get(cursor.get(), &k, &v, MDB_NEXT);
+  }
+
+  while (result == MDB_SUCCESS) {
+    if (k.mv_size < begin.length() ||
+        memcmp(k.mv_data, begin.data(), begin.length()) != 0) {
+      break;
+    }
+    if (limit != 0 && keys.size() == limit) {
+      if (next) {
+        *next = keys.back();
+      }
+      break;
+    }
+    keys.emplace_back(static_cast<const char*>(k.mv_data) + scope.length(),
+                      k.mv_size - scope.length());
+    result = mdb_cursor_get(cursor.get(), &k, &v, MDB_NEXT);
+  }
+  if (result != MDB_NOTFOUND) {
+    check(result, "Failed to list properties");
+  }
+  return keys;
+}
+
+bool LMDBDatabase::hasPermission(const std::string &perm_name,
+      const std::string &network, const std::string &channel,
+      const std::string &sender, bool defaultPermission) const
+{
+  ReadTransaction txn(env_, reader_);
+  std::string granted;
+  if (fetch(txn.get(), permissions_,
+            makeKey(network, channel, sender, perm_name), &granted)) {
+    return granted != "0";
+  }
+  return defaultPermission;
+}
+
+void LMDBDatabase::unsetPermission(const std::string &perm_name,
+      const std::string &network, const std::string &receiver,
+      const std::string &sender)
+{
+  WriteTransaction txn(env_);
+  store(txn.get(), permissions_, makeKey(network, receiver, sender, perm_name),
+        "");
+  txn.commit();
+}
+
+void LMDBDatabase::setPermission(bool permission,
+      const std::string &perm_name, const std::string &network,
+      const std::string &receiver, const std::string &sender)
+{
+  WriteTransaction txn(env_);
+  store(txn.get(), permissions_, makeKey(network, receiver, sender, perm_name),
+        permission ? "1" : "0");
+  txn.commit();
+}
+
+std::vector<PermissionEntry> LMDBDatabase::permissions()
+{
+  std::vector<PermissionEntry> entries;
+  ReadTransaction txn(env_, reader_);
+  Cursor cursor(txn.get(), permissions_);
+  MDB_val k, v;
+  int result = mdb_cursor_get(cursor.get(), &k, &v, MDB_FIRST);
+  while (result == MDB_SUCCESS) {
+    std::string key(static_cast<const char*>(k.mv_data), k.mv_size);
+    PermissionEntry entry;
+    size_t receiver = key.find('\0') + 1;
+    size_t sender = key.find('\0', receiver) + 1;
+    size_t name = key.find('\0', sender) + 1;
+    entry.network = key.substr(0, receiver - 1);
+    entry.receiver = key.substr(receiver, sender - receiver - 1);
+    entry.sender = key.substr(sender, name - sender - 1);
+    entry.permission = key.substr(name);
+    entry.granted = !(v.mv_size == 1 && *static_cast<const char*>(v.mv_data) == '0');
+    entries.push_back(entry);
+    result = mdb_cursor_get(cursor.get(), &k, &v, MDB_NEXT);
+  }
+  if (result != MDB_NOTFOUND) {
+    check(result, "Failed to list permissions");
+  }
+  return entries;
+}
+
+}  // namespace db
+}  // namespace dazeus
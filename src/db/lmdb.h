@@ -0,0 +1,103 @@
+/**
+ * Copyright (c) 2014 Sjors Gielen, Ruben Nijveld, Aaron van Geffen
+ * See LICENSE for license.
+ */
+
+#ifndef DB_LMDB_H_
+#define DB_LMDB_H_
+
+#include <lmdb.h>
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "database.h"
+
+namespace dazeus {
+namespace db {
+
+/**
+ * @class LMDBDatabase
+ * @brief Keeps properties and permissions in an LMDB memory-mapped B-tree.
+ *
+ * Every property is stored under a composite key of its network, receiver,
+ * sender and variable, separated by NUL bytes, so all properties of a scope
+ * are adjacent and ordered by variable. A scoped lookup is a handful of
+ * cursor seeks, a key listing is a range seek followed by a scan, and values
+ * are copied straight out of the map.
+ */
+class LMDBDatabase : public Database {
+ public:
+  explicit LMDBDatabase(DatabaseConfig dbc)
+      : Database(dbc), env_(NULL), properties_(0), permissions_(0),
+        reader_(NULL) {}
+  ~LMDBDatabase();
+
+  void open();
+  std::string property(const std::string &variable,
+                       const std::string &networkScope = "",
+                       const std::string &receiverScope = "",
+                       const std::string &senderScope = "");
+  void setProperty(const std::string &variable, const std::string &value,
+                   const std::string &networkScope = "",
+                   const std::string &receiverScope = "",
+                   const std::string &senderScope = "");
+  int64_t incrementProperty(const std::string &variable, int64_t delta,
+                            const std::string &networkScope = "",
+                            const std::string &receiverScope = "",
+                            const std::string &senderScope = "");
+  bool compareAndSetProperty(const std::string &variable,
+                             const std::string &expected,
+                             const std::string &value,
+                             const std::string &networkScope = "",
+                             const std::string &receiverScope = "",
+                             const std::string &senderScope = "");
+  std::vector<std::string> propertyKeyPage(
+      const std::string &prefix, const std::string &after, size_t limit,
+      std::string *next, const std::string &networkScope = "",
+      const std::string &receiverScope = "",
+      const std::string &senderScope = "");
+  bool hasPermission(const std::string &perm_name, const std::string &network,
+                     const std::string &channel, const std::string &sender,
+                     bool defaultPermission) const;
+  void unsetPermission(const std::string &perm_name, const std::string &network,
+                       const std::string &receiver = "",
+                       const std::string &sender = "");
+  void setPermission(bool permission, const std::string &perm_name,
+                     const std::string &network,
+                     const std::string &receiver = "",
+                     const std::string &sender   = "");
+  std::vector<PermissionEntry> permissions();
+  void setProperties(const std::vector<PropertyChange> &changes);
+  std::vector<std::string> properties(
+      const std::vector<std::string> &variables,
+      const std::string &networkScope = "",
+      const std::string &receiverScope = "",
+      const std::string &senderScope = "");
+
+ private:
+  // explicitly disable copy constructor
+  explicit LMDBDatabase(const LMDBDatabase&);
+  void operator=(const LMDBDatabase&);
+
+  static std::string makeKey(const std::string &network,
+                             const std::string &receiver,
+                             const std::string &sender,
+                             const std::string &name);
+  bool find(MDB_cursor *cursor, const std::string &variable,
+            const std::string &network, const std::string &receiver,
+            const std::string &sender, std::string *value) const;
+
+  MDB_env *env_;
+  MDB_dbi properties_;
+  MDB_dbi permissions_;
+  // read-only transaction handle, reset between reads and renewed for the
+  // next one
+  mutable MDB_txn *reader_;
+};
+
+}  // namespace db
+}  // namespace dazeus
+
+#endif  // DB_LMDB_H_
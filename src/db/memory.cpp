@@ -0,0 +1,571 @@
+/**
+ * Copyright (c) 2014 Sjors Gielen, Ruben Nijveld, Aaron van Geffen
+ * See LICENSE for license.
+ */
+
+#include "memory.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <iostream>
+
+// the journal is compacted once it has at least this many records, and
+// twice as many as there are properties and permissions
+#define MEMORY_COMPACT_MINIMUM 1024
+
+namespace dazeus {
+namespace db {
+
+MemoryDatabase::MemoryDatabase(DatabaseConfig dbc)
+    : Database(dbc), snapshotPath_(dbc.filename),
+      journalPath_(dbc.filename.empty() ? "" : dbc.filename + ".journal"),
+      journal_(NULL), journalSize_(0), journalFailed_(false), pending_(),
+      journalRecords_(0), properties_(),
+      propertyCount_(0), permissions_() {}
+
+MemoryDatabase::~MemoryDatabase()
+{
+  if (journal_) {
+    // the snapshot has all changes, even those the journal failed to get
+    try {
+      if (journalRecords_ > 0) {
+        compact();
+      }
+    } catch (exception &e) {
+      std::cerr << "Failed to save properties: " << e.what() << std::endl;
+      try {
+        writeJournal();
+      } catch (exception &e) {
+        std::cerr << "Failed to save properties: " << e.what() << std::endl;
+      }
+    }
+    fclose(journal_);
+  }
+}
+
+/**
+ * @brief Load the snapshot and replay the journal, if the database is
+ * persisted.
+ *
+ * A journal that was replayed is compacted into the snapshot right away, so
+ * the next start only has to load the snapshot.
+ */
+void MemoryDatabase::open()
+{
+  if (snapshotPath_.empty()) {
+    std::cout << "Keeping properties in memory only." << std::endl;
+    return;
+  }
+
+  load(snapshotPath_, false);
+  journalRecords_ = load(journalPath_, true);
+  std::cout << "Loaded " << propertyCount_ << " properties and "
+            << permissions_.size() << " permissions from " << snapshotPath_
+            << " and " << journalRecords_ << " journal records." << std::endl;
+
+  // compacting also throws away a torn last record of the journal, which
+  // would otherwise swallow the next record appended to it
+  compact();
+}
+
+std::string MemoryDatabase::scopeKey(const std::string &network,
+                                     const std::string &receiver,
+                                     const std::string &sender)
+{
+  std::string key;
+  key.reserve(network.length() + receiver.length() + sender.length() + 2);
+  key.append(network).append(1, '\0');
+  key.append(receiver).append(1, '\0');
+  key.append(sender);
+  return key;
+}
+
+/**
+ * @brief Split a key of NUL-separated fields into the given amount of
+ * fields; the last one gets the remainder.
+ */
+static std::vector<std::string> splitKey(const std::string &key, size_t fields)
+{
+  std::vector<std::string> result;
+  size_t pos = 0;
+  while (result.size() + 1 < fields) {
+    size_t end = key.find('\0', pos);
+    result.push_back(key.substr(pos, end - pos));
+    pos = end == std::string::npos ? key.length() : end + 1;
+  }
+  result.push_back(key.substr(std::min(pos, key.length())));
+  return result;
+}
+
+/**
+ * @brief Append a record to a journal or snapshot.
+ *
+ * A record is its type, its fields as <tt>[length]:[bytes]</tt>, and a
+ * newline.
+ */
+void MemoryDatabase::writeRecord(std::string &out, char type,
+                                 const std::vector<std::string> &fields)
+{
+  out.append(1, type);
+  for (auto it = fields.begin(); it != fields.end(); ++it) {
+    out.append(std::to_string(it->length())).append(1, ':').append(*it);
+  }
+  out.append(1, '\n');
+}
+
+/**
+ * @brief Apply a record to the data in memory.
+ */
+void MemoryDatabase::apply(char type, const std::vector<std::string> &fields)
+{
+  switch (type) {
+    case RecordSetProperty: {
+      if (fields.size() != 5) break;
+      Variables &variables = properties_[scopeKey(fields[2], fields[3], fields[4])];
+      auto result = variables.insert(std::make_pair(fields[0], fields[1]));
+      if (result.second) {
+        ++propertyCount_;
+      } else {
+        result.first->second = fields[1];
+      }
+      return;
+    }
+    case RecordRemoveProperty: {
+      if (fields.size() != 4) break;
+      auto it = properties_.find(scopeKey(fields[1], fields[2], fields[3]));
+      if (it != properties_.end() && it->second.erase(fields[0]) > 0) {
+        --propertyCount_;
+        if (it->second.empty()) {
+          properties_.erase(it);
+        }
+      }
+      return;
+    }
+    case RecordSetPermission:
+      // records without the granted field grant the permission
+      if (fields.size() != 4 && fields.size() != 5) break;
+      permissions_[scopeKey(fields[1], fields[2], fields[3]) + '\0' + fields[0]] =
+          fields.size() == 4 || fields[4] != "0";
+      return;
+    case RecordRemovePermission:
+      if (fields.size() != 4) break;
+      permissions_.erase(scopeKey(fields[1], fields[2], fields[3]) + '\0' + fields[0]);
+      return;
+  }
+  throw exception("Invalid record of type " + std::string(1, type));
+}
+
+/**
+ * @brief Apply a change to the data in memory, and journal it.
+ *
+ * The journal is written by writeJournal(). If it could not be repaired
+ * after a failed write, the database is compacted first, and changes are
+ * refused as long as that fails.
+ */
+void MemoryDatabase::change(char type, const std::vector<std::string> &fields)
+{
+  if (journalFailed_) {
+    compact();
+    journalFailed_ = false;
+  }
+  apply(type, fields);
+  if (journal_) {
+    writeRecord(pending_, type, fields);
+    ++journalRecords_;
+  }
+}
+
+void MemoryDatabase::changeProperty(const std::string &variable,
+    const std::string &value, const std::string &network,
+    const std::string &receiver, const std::string &sender)
+{
+  if (value.empty()) {
+    if (find(variable, network, receiver, sender) == NULL) {
+      return;
+    }
+    change(RecordRemoveProperty, {variable, network, receiver, sender});
+  } else {
+    change(RecordSetProperty, {variable, value, network, receiver, sender});
+  }
+}
+
+/**
+ * @brief Write the journaled changes to the journal file, and compact it if
+ * it has grown large.
+ *
+ * If writing fails, the part that was written is cut off again, so no
+ * records are appended after a partial one; the changes stay journaled,
+ * and are written with the next change. If the journal can't be cut off,
+ * it is replaced by compacting right away.
+ */
+void MemoryDatabase::writeJournal()
+{
+  if (!journal_ || pending_.empty()) {
+    return;
+  }
+
+  // the journal is unbuffered, so a failed write leaves nothing behind
+  size_t written = fwrite(pending_.data(), 1, pending_.length(), journal_);
+  if (written != pending_.length()) {
+    std::string error = strerror(errno);
+    clearerr(journal_);
+    if (written > 0 && (ftruncate(fileno(journal_), journalSize_) != 0 ||
+                        fseeko(journal_, journalSize_, SEEK_SET) != 0)) {
+      try {
+        compact();
+      } catch (exception &) {
+        journalFailed_ = true;
+      }
+    }
+    throw exception("Failed to write journal " + journalPath_ + ": " + error);
+  }
+  journalSize_ += written;
+  pending_.clear();
+
+  if (journalRecords_ >= MEMORY_COMPACT_MINIMUM &&
+      journalRecords_ > 2 * (propertyCount_ + permissions_.size())) {
+    compact();
+  }
+}
+
+/**
+ * @brief Load a snapshot or journal, and return the amount of records in it.
+ *
+ * A journal may end in a record that was cut off by a crash while writing,
+ * which is ignored. Snapshots are only renamed into place once they were
+ * written completely, so any damage in them, and damage anywhere else in
+ * the journal, is corruption and throws.
+ */
+size_t MemoryDatabase::load(const std::string &path, bool journal)
+{
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    throw exception("Failed to open " + path + ": " + strerror(errno));
+  }
+
+  std::string data;
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    data.append(buf, n);
+  }
+  bool failed = ferror(f);
+  fclose(f);
+  if (failed) {
+    throw exception("Failed to read " + path);
+  }
+
+  size_t pos = 0;
+  size_t records = 0;
+  while (pos < data.length()) {
+    char type = data[pos];
+    size_t p = pos + 1;
+    std::vector<std::string> fields;
+    bool complete = false;
+    // whether the record was cut off, rather than damaged
+    bool torn = true;
+    while (p < data.length()) {
+      if (data[p] == '\n') {
+        complete = true;
+        break;
+      }
+      size_t colon = data.find(':', p);
+      if (colon == std::string::npos) {
+        torn = strspn(data.c_str() + p, "0123456789") == data.length() - p;
+        break;
+      }
+      char *end;
+      unsigned long long length = strtoull(data.c_str() + p, &end, 10);
+      if (end != data.c_str() + colon || data[p] < '0' || data[p] > '9') {
+        torn = false;
+        break;
+      }
+      if (length > data.length() - colon - 1) {
+        break;
+      }
+      fields.push_back(data.substr(colon + 1, length));
+      p = colon + 1 + length;
+    }
+
+    if (!complete) {
+      if (!journal || !torn) {
+        throw exception("Damaged record in " + path + " after " +
+                        std::to_string(records) + " records");
+      }
+      std::cerr << "Ignoring cut off last record of " << path << " after "
+                << records << " records." << std::endl;
+      break;
+    }
+    try {
+      apply(type, fields);
+    } catch (exception &e) {
+      throw exception("Damaged record in " + path + " after " +
+                      std::to_string(records) + " records: " + e.what());
+    }
+    pos = p + 1;
+    ++records;
+  }
+  return records;
+}
+
+/**
+ * @brief Write all data to a new snapshot, and start an empty journal.
+ *
+ * The snapshot is written next to the old one and renamed over it, so there
+ * is always a complete snapshot. Should the journal survive a crash right
+ * after, replaying it on top of the new snapshot gives the same result.
+ */
+void MemoryDatabase::compact()
+{
+  std::string data;
+  for (auto sit = properties_.begin(); sit != properties_.end(); ++sit) {
+    std::vector<std::string> scope = splitKey(sit->first, 3);
+    for (auto vit = sit->second.begin(); vit != sit->second.end(); ++vit) {
+      writeRecord(data, RecordSetProperty,
+                  {vit->first, vit->second, scope[0], scope[1], scope[2]});
+    }
+  }
+  for (auto it = permissions_.begin(); it != permissions_.end(); ++it) {
+    std::vector<std::string> key = splitKey(it->first, 4);
+    writeRecord(data, RecordSetPermission,
+                {key[3], key[0], key[1], key[2], it->second ? "1" : "0"});
+  }
+
+  std::string tmpPath = snapshotPath_ + ".tmp";
+  FILE *f = fopen(tmpPath.c_str(), "wb");
+  if (!f) {
+    throw exception("Failed to create " + tmpPath + ": " + strerror(errno));
+  }
+  bool failed = fwrite(data.data(), 1, data.length(), f) != data.length() ||
+                fflush(f) != 0 || fsync(fileno(f)) != 0;
+  failed = fclose(f) != 0 || failed;
+  if (failed || rename(tmpPath.c_str(), snapshotPath_.c_str()) != 0) {
+    std::string error = strerror(errno);
+    unlink(tmpPath.c_str());
+    throw exception("Failed to write snapshot " + snapshotPath_ + ": " + error);
+  }
+
+  // the rename must be durable before the journal is emptied, or a crash
+  // could leave the old snapshot next to an empty journal
+  size_t slash = snapshotPath_.rfind('/');
+  std::string directory = slash == std::string::npos ? "." :
+      slash == 0 ? "/" : snapshotPath_.substr(0, slash);
+  int dir = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  failed = dir < 0 || fsync(dir) != 0;
+  std::string error = failed ? strerror(errno) : "";
+  if (dir >= 0) {
+    close(dir);
+  }
+  if (failed) {
+    throw exception("Failed to sync directory " + directory + ": " + error);
+  }
+
+  // if the new journal can't be opened, the old one stays in use; replaying
+  // it on top of the new snapshot gives the same result
+  FILE *journal = fopen(journalPath_.c_str(), "wb");
+  if (!journal) {
+    throw exception("Failed to open journal " + journalPath_ + ": " +
+                    strerror(errno));
+  }
+  setvbuf(journal, NULL, _IONBF, 0);
+  if (journal_) {
+    fclose(journal_);
+  }
+  journal_ = journal;
+  journalSize_ = 0;
+  journalRecords_ = 0;
+  // the snapshot has the journaled changes that weren't written yet
+  pending_.clear();
+}
+
+/**
+ * @brief Find a property in the given scope or the most specific less
+ * specific one.
+ *
+ * Scopes are probed in the order the SQL backends sort them: by network,
+ * then receiver, then sender, each set before unset.
+ */
+const std::string *MemoryDatabase::find(const std::string &variable,
+    const std::string &network, const std::string &receiver,
+    const std::string &sender) const
+{
+  static const std::string none;
+  for (int mask = 7; mask >= 0; --mask) {
+    bool n = mask & 4, r = mask & 2, s = mask & 1;
+    if ((n && network.empty()) || (r && receiver.empty()) ||
+        (s && sender.empty())) {
+      continue;
+    }
+    auto sit = properties_.find(scopeKey(n ? network : none,
+                                         r ? receiver : none,
+                                         s ? sender : none));
+    if (sit == properties_.end()) {
+      continue;
+    }
+    auto vit = sit->second.find(variable);
+    if (vit != sit->second.end()) {
+      return &vit->second;
+    }
+  }
+  return NULL;
+}
+
+std::string MemoryDatabase::property(const std::string &variable,
+                                     const std::string &networkScope,
+                                     const std::string &receiverScope,
+                                     const std::string &senderScope)
+{
+  const std::string *value = find(variable, networkScope, receiverScope,
+                                  senderScope);
+  return value ? *value : std::string();
+}
+
+void MemoryDatabase::setProperty(const std::string &variable,
+    const std::string &value, const std::string &networkScope,
+    const std::string &receiverScope,
+    const std::string &senderScope)
+{
+  changeProperty(variable, value, networkScope, receiverScope, senderScope);
+  writeJournal();
+}
+
+void MemoryDatabase::setProperties(const std::vector<PropertyChange> &changes)
+{
+  for (auto it = changes.begin(); it != changes.end(); ++it) {
+    changeProperty(it->variable, it->value, it->network, it->receiver,
+                   it->sender);
+  }
+  writeJournal();
+}
+
+int64_t MemoryDatabase::incrementProperty(const std::string &variable,
+    int64_t delta, const std::string &networkScope,
+    const std::string &receiverScope, const std::string &senderScope)
+{
+  int64_t sum = delta;
+  auto sit = properties_.find(scopeKey(networkScope, receiverScope, senderScope));
+  if (sit != properties_.end()) {
+    auto vit = sit->second.find(variable);
+    if (vit != sit->second.end()) {
+      const std::string &current = vit->second;
+      char *end;
+      errno = 0;
+      long long value = strtoll(current.c_str(), &end, 10);
+      if (errno == 0 && !current.empty() && *end == 0) {
+        sum += value;
+      }
+    }
+  }
+
+  change(RecordSetProperty, {variable, std::to_string(sum), networkScope,
+                             receiverScope, senderScope});
+  writeJournal();
+  return sum;
+}
+
+bool MemoryDatabase::compareAndSetProperty(const std::string &variable,
+    const std::string &expected, const std::string &value,
+    const std::string &networkScope, const std::string &receiverScope,
+    const std::string &senderScope)
+{
+  const std::string *current = NULL;
+  auto sit = properties_.find(scopeKey(networkScope, receiverScope, senderScope));
+  if (sit != properties_.end()) {
+    auto vit = sit->second.find(variable);
+    if (vit != sit->second.end()) {
+      current = &vit->second;
+    }
+  }
+
+  if (expected.empty() ? current != NULL
+                       : current == NULL || *current != expected) {
+    return false;
+  }
+  if (current != NULL || !value.empty()) {
+    changeProperty(variable, value, networkScope, receiverScope, senderScope);
+    writeJournal();
+  }
+  return true;
+}
+
+std::vector<std::string> MemoryDatabase::propertyKeyPage(
+      const std::string &prefix, const std::string &after, size_t limit,
+      std::string *next, const std::string &networkScope,
+      const std::string &receiverScope, const std::string &senderScope)
+{
+  std::vector<std::string> keys;
+  if (next) {
+    next->clear();
+  }
+
+  auto sit = properties_.find(scopeKey(networkScope, receiverScope, senderScope));
+  if (sit == properties_.end()) {
+    return keys;
+  }
+
+  const Variables &variables = sit->second;
+  Variables::const_iterator it = after.empty() || after < prefix
+      ? variables.lower_bound(prefix) : variables.upper_bound(after);
+  for (; it != variables.end() &&
+         it->first.compare(0, prefix.length(), prefix) == 0; ++it) {
+    if (limit != 0 && keys.size() == limit) {
+      if (next) {
+        *next = keys.back();
+      }
+      break;
+    }
+    keys.push_back(it->first);
+  }
+  return keys;
+}
+
+bool MemoryDatabase::hasPermission(const std::string &perm_name,
+      const std::string &network, const std::string &channel,
+      const std::string &sender, bool defaultPermission) const
+{
+  auto it = permissions_.find(scopeKey(network, channel, sender) + '\0' + perm_name);
+  return it == permissions_.end() ? defaultPermission : it->second;
+}
+
+void MemoryDatabase::unsetPermission(const std::string &perm_name,
+      const std::string &network, const std::string &receiver,
+      const std::string &sender)
+{
+  if (permissions_.count(scopeKey(network, receiver, sender) + '\0' + perm_name)) {
+    change(RecordRemovePermission, {perm_name, network, receiver, sender});
+    writeJournal();
+  }
+}
+
+void MemoryDatabase::setPermission(bool permission,
+      const std::string &perm_name, const std::string &network,
+      const std::string &receiver, const std::string &sender)
+{
+  change(RecordSetPermission,
+         {perm_name, network, receiver, sender, permission ? "1" : "0"});
+  writeJournal();
+}
+
+std::vector<PermissionEntry> MemoryDatabase::permissions()
+{
+  std::vector<PermissionEntry> entries;
+  entries.reserve(permissions_.size());
+  for (auto it = permissions_.begin(); it != permissions_.end(); ++it) {
+    std::vector<std::string> key = splitKey(it->first, 4);
+    entries.push_back({key[3], key[0], key[1], key[2], it->second});
+  }
+  return entries;
+}
+
+void MemoryDatabase::flush()
+{
+  writeJournal();
+}
+
+}  // namespace db
+}  // namespace dazeus
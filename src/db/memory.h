@@ -0,0 +1,134 @@
+/**
+ * Copyright (c) 2014 Sjors Gielen, Ruben Nijveld, Aaron van Geffen
+ * See LICENSE for license.
+ */
+
+#ifndef DB_MEMORY_H_
+#define DB_MEMORY_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "database.h"
+
+namespace dazeus {
+namespace db {
+
+/**
+ * @class MemoryDatabase
+ * @brief Keeps all properties and permissions in memory.
+ *
+ * Properties are kept per scope in a hash table, and ordered by variable
+ * within a scope, so lookups are a few hash probes and key listings are
+ * ordered scans.
+ *
+ * If the database configuration has a file name, the database is persisted
+ * in it: every change is appended to a journal next to it, and once the
+ * journal has grown large compared to the data, the whole database is
+ * written to the file as a compacted snapshot and the journal is emptied.
+ * Opening the database loads the snapshot and replays the journal; a last
+ * journal record that was cut off by a crash is dropped, any other damage
+ * makes opening fail rather than lose the data after it.
+ */
+class MemoryDatabase : public Database {
+ public:
+  explicit MemoryDatabase(DatabaseConfig dbc);
+  ~MemoryDatabase();
+
+  void open();
+  std::string property(const std::string &variable,
+                       const std::string &networkScope = "",
+                       const std::string &receiverScope = "",
+                       const std::string &senderScope = "");
+  void setProperty(const std::string &variable, const std::string &value,
+                   const std::string &networkScope = "",
+                   const std::string &receiverScope = "",
+                   const std::string &senderScope = "");
+  int64_t incrementProperty(const std::string &variable, int64_t delta,
+                            const std::string &networkScope = "",
+                            const std::string &receiverScope = "",
+                            const std::string &senderScope = "");
+  bool compareAndSetProperty(const std::string &variable,
+                             const std::string &expected,
+                             const std::string &value,
+                             const std::string &networkScope = "",
+                             const std::string &receiverScope = "",
+                             const std::string &senderScope = "");
+  std::vector<std::string> propertyKeyPage(
+      const std::string &prefix, const std::string &after, size_t limit,
+      std::string *next, const std::string &networkScope = "",
+      const std::string &receiverScope = "",
+      const std::string &senderScope = "");
+  bool hasPermission(const std::string &perm_name, const std::string &network,
+                     const std::string &channel, const std::string &sender,
+                     bool defaultPermission) const;
+  void unsetPermission(const std::string &perm_name, const std::string &network,
+                       const std::string &receiver = "",
+                       const std::string &sender = "");
+  void setPermission(bool permission, const std::string &perm_name,
+                     const std::string &network,
+                     const std::string &receiver = "",
+                     const std::string &sender   = "");
+  std::vector<PermissionEntry> permissions();
+  void setProperties(const std::vector<PropertyChange> &changes);
+  void flush();
+
+ private:
+  // explicitly disable copy constructor
+  explicit MemoryDatabase(const MemoryDatabase&);
+  void operator=(const MemoryDatabase&);
+
+  // types of records in the journal and the snapshot
+  enum RecordType {
+    RecordSetProperty = 'S',
+    RecordRemoveProperty = 'D',
+    RecordSetPermission = 'P',
+    RecordRemovePermission = 'R'
+  };
+
+  typedef std::map<std::string, std::string> Variables;
+
+  static std::string scopeKey(const std::string &network,
+                              const std::string &receiver,
+                              const std::string &sender);
+  static void writeRecord(std::string &out, char type,
+                          const std::vector<std::string> &fields);
+  void apply(char type, const std::vector<std::string> &fields);
+  void change(char type, const std::vector<std::string> &fields);
+  void changeProperty(const std::string &variable, const std::string &value,
+                      const std::string &network, const std::string &receiver,
+                      const std::string &sender);
+  const std::string *find(const std::string &variable,
+                          const std::string &network,
+                          const std::string &receiver,
+                          const std::string &sender) const;
+  size_t load(const std::string &path, bool journal);
+  void writeJournal();
+  void compact();
+
+  std::string snapshotPath_;
+  std::string journalPath_;
+  FILE *journal_;
+  // bytes of complete records in the journal file
+  off_t journalSize_;
+  // whether the journal could not be repaired after a failed write
+  bool journalFailed_;
+  // records written to the journal, but not to the journal file yet
+  std::string pending_;
+  size_t journalRecords_;
+  // variables per scope key
+  std::unordered_map<std::string, Variables> properties_;
+  size_t propertyCount_;
+  // whether a permission is granted, by scope key and permission name
+  std::unordered_map<std::string, bool> permissions_;
+};
+
+}  // namespace db
+}  // namespace dazeus
+
+#endif  // DB_MEMORY_H_
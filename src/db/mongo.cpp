@@ -6,8 +6,10 @@
 #include "./mongo.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <cerrno>
 #include <cassert>
+#include <map>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -22,6 +24,126 @@
 namespace dazeus {
 namespace db {
 
+/**
+ * @brief Append the fields selecting exactly the given scope to a selector.
+ */
+static void appendExactScope(bson *selector, const std::string &networkScope,
+    const std::string &receiverScope, const std::string &senderScope)
+{
+  if(networkScope.length() > 0) {
+    bson_append_string(selector, "network", networkScope.c_str(), -1);
+  } else {
+    bson_append_null(selector, "network");
+  }
+  if(networkScope.length() > 0 && receiverScope.length() > 0) {
+    bson_append_string(selector, "receiver", receiverScope.c_str(), -1);
+  } else {
+    bson_append_null(selector, "receiver");
+  }
+  if(networkScope.length() > 0 && receiverScope.length() > 0 && senderScope.length() > 0) {
+    bson_append_string(selector, "sender", senderScope.c_str(), -1);
+  } else {
+    bson_append_null(selector, "sender");
+  }
+}
+
+/**
+ * @brief Build a selector for a property in exactly the given scope.
+ *
+ * The returned document is not finished yet, so more fields can be appended.
+ */
+static bson *exactSelector(const std::string &variable,
+    const std::string &networkScope, const std::string &receiverScope,
+    const std::string &senderScope)
+{
+  bson *selector = bson_build(
+    BSON_TYPE_STRING, "variable", variable.c_str(), -1,
+    BSON_TYPE_NONE);
+  appendExactScope(selector, networkScope, receiverScope, senderScope);
+  return selector;
+}
+
+/**
+ * @brief Retrieve the value of the single property matching a selector.
+ *
+ * Returns whether such a property exists.
+ */
+static bool findProperty(mongo_sync_connection *conn,
+    const std::string &database, const bson *selector, std::string *value)
+{
+  std::string properties = database + ".properties";
+  mongo_packet *p = mongo_sync_cmd_query(conn, properties.c_str(), 0, 0, 1, selector, NULL);
+  if(!p) {
+    // error asking, or no results, assume it's the second
+    return false;
+  }
+
+  bson *result;
+  if(!mongo_wire_reply_packet_get_nth_document(p, 1, &result)) {
+    mongo_wire_packet_free(p);
+    throw exception("Failed to retrieve data from reply");
+  }
+  bson_finish(result);
+  mongo_wire_packet_free(p);
+
+  bson_cursor *c = bson_find(result, "value");
+  const char *v;
+  if(!bson_cursor_get_string(c, &v)) {
+    bson_cursor_free(c);
+    bson_free(result);
+    throw exception("Failed to retrieve data from reply");
+  }
+  *value = v;
+  bson_cursor_free(c);
+  bson_free(result);
+  return true;
+}
+
+/**
+ * @brief Atomically update or remove the property matching a query.
+ *
+ * This runs a findAndModify command on the properties collection. Returns
+ * whether a property matched the query before it was modified; an upserted
+ * property doesn't count.
+ */
+static bool findAndModifyProperty(mongo_sync_connection *conn,
+    const std::string &database, const bson *query, const bson *update,
+    bool remove, bool upsert)
+{
+  bson *command = bson_build(
+    BSON_TYPE_STRING, "findAndModify", "properties", -1,
+    BSON_TYPE_NONE);
+  bson_append_document(command, "query", query);
+  if(remove) {
+    bson_append_boolean(command, "remove", TRUE);
+  } else {
+    bson_append_document(command, "update", update);
+    bson_append_boolean(command, "upsert", upsert);
+  }
+  bson_finish(command);
+
+  mongo_packet *p = mongo_sync_cmd_custom(conn, database.c_str(), command);
+  bson_free(command);
+  if(!p) {
+    throw exception("Failed to modify property");
+  }
+
+  bson *result;
+  if(!mongo_wire_reply_packet_get_nth_document(p, 1, &result)) {
+    mongo_wire_packet_free(p);
+    throw exception("Failed to retrieve data from reply");
+  }
+  bson_finish(result);
+  mongo_wire_packet_free(p);
+
+  // "value" holds the matched document, or null if nothing matched
+  bson_cursor *c = bson_find(result, "value");
+  bool matched = c && bson_cursor_type(c) == BSON_TYPE_DOCUMENT;
+  bson_cursor_free(c);
+  bson_free(result);
+  return matched;
+}
+
 /**
  * @brief Destructor.
  */
@@ -48,6 +170,7 @@ void MongoDatabase::open()
     BSON_TYPE_INT32, "network", 1,
     BSON_TYPE_INT32, "receiver", 1,
     BSON_TYPE_INT32, "sender", 1,
+    BSON_TYPE_INT32, "variable", 1,
     BSON_TYPE_NONE
   );
   bson_finish(index);
@@ -62,79 +185,101 @@ void MongoDatabase::open()
 }
 
 /**
- * @brief Retrieve all properties with a certain prefix.
+ * @brief Retrieve a page of the properties with a certain prefix.
  *
  * All properties whose names start with the given prefix name and that match
- * the given scope values, are returned from this method.
+ * the given scope values exactly, are returned from this method, without the
+ * prefix and the separator following it. The position to continue after is
+ * the full name of the last property returned.
  *
- * This method guarantees that if it returns a certain key, property() will
- * return the correct value of that key given that network, receiver and
- * sender scope are the same.
+ * The prefix is searched for as a range of names, so the index on scope and
+ * name can be used.
  */
-std::vector<std::string> MongoDatabase::propertyKeys(
-		const std::string &prefix, const std::string &networkScope,
+std::vector<std::string> MongoDatabase::propertyKeyPage(
+		const std::string &prefix, const std::string &after, size_t limit,
+		std::string *next, const std::string &networkScope,
 		const std::string &receiverScope, const std::string &senderScope )
 {
-  std::stringstream regexStr;
-  regexStr << "^\\Q" << prefix << "\\E";
-  std::string regex = regexStr.str();
+  std::string successor = prefixSuccessor(prefix);
+  bson *range = bson_new();
+  bson_append_string(range, "$gte", prefix.c_str(), -1);
+  if(successor.length() > 0) {
+    bson_append_string(range, "$lt", successor.c_str(), -1);
+  }
+  if(after.length() > 0) {
+    bson_append_string(range, "$gt", after.c_str(), -1);
+  }
+  bson_finish(range);
 
   bson *selector = bson_new();
-  bson_append_regex(selector, "variable", regex.c_str(), "");
-  if(networkScope.length() > 0) {
-    bson_append_string(selector, "network", networkScope.c_str(), -1);
-    if(receiverScope.length() > 0) {
-      bson_append_string(selector, "receiver", receiverScope.c_str(), -1);
-      if(senderScope.length() > 0) {
-        bson_append_string(selector, "sender", senderScope.c_str(), -1);
-      } else {
-        bson_append_null(selector, "sender");
-      }
-    } else {
-      bson_append_null(selector, "receiver");
-      bson_append_null(selector, "sender");
-    }
-  } else {
-    bson_append_null(selector, "network");
-    bson_append_null(selector, "receiver");
-    bson_append_null(selector, "sender");
-  }
+  bson_append_document(selector, "variable", range);
+  appendExactScope(selector, networkScope, receiverScope, senderScope);
   bson_finish(selector);
 
-  std::string properties = dbc_.database + ".properties";
-  mongo_packet *p = mongo_sync_cmd_query(M, properties.c_str(), 0, 0, 0, selector, NULL /* TODO: variable only? */);
+  bson *query = bson_build_full(
+    BSON_TYPE_DOCUMENT, "$orderby", TRUE,
+    bson_build(BSON_TYPE_INT32, "variable", 1, BSON_TYPE_NONE),
+    BSON_TYPE_NONE
+  );
+  bson_append_document(query, "$query", selector);
+  bson_finish(query);
 
-  bson_free(selector);
+  bson *fields = bson_build(BSON_TYPE_INT32, "variable", 1, BSON_TYPE_NONE);
+  bson_finish(fields);
 
-  if(!p) {
-    throw exception("Failed to execute query");
-  }
+  // ask for one key more, to find out whether there is a next page
+  std::string properties = dbc_.database + ".properties";
+  mongo_packet *p = mongo_sync_cmd_query(M, properties.c_str(), 0, 0,
+    limit == 0 ? 0 : limit + 1, query, fields);
 
-  mongo_sync_cursor *cursor = mongo_sync_cursor_new(M, properties.c_str(), p);
-  if(!cursor) {
-    throw exception("Failed to create cursor");
-  }
+  bson_free(fields);
+  bson_free(query);
+  bson_free(selector);
+  bson_free(range);
 
   std::vector<std::string> res;
-  while(mongo_sync_cursor_next(cursor)) {
-    bson *result = mongo_sync_cursor_get_data(cursor);
-    if(!result) {
-      mongo_sync_cursor_free(cursor);
-      throw exception("Failed to get data from cursor");
+  std::string last;
+  bool more = false;
+  if(p) {
+    mongo_sync_cursor *cursor = mongo_sync_cursor_new(M, properties.c_str(), p);
+    if(!cursor) {
+      throw exception("Failed to create cursor");
     }
 
-    bson_cursor *c = bson_find(result, "variable");
-    const char *value;
-    if(!bson_cursor_get_string(c, &value)) {
-      mongo_sync_cursor_free(cursor);
+    while(mongo_sync_cursor_next(cursor)) {
+      if(limit != 0 && res.size() == limit) {
+        more = true;
+        break;
+      }
+
+      bson *result = mongo_sync_cursor_get_data(cursor);
+      if(!result) {
+        mongo_sync_cursor_free(cursor);
+        throw exception("Failed to get data from cursor");
+      }
+
+      bson_cursor *c = bson_find(result, "variable");
+      const char *value;
+      if(!bson_cursor_get_string(c, &value)) {
+        mongo_sync_cursor_free(cursor);
+        bson_cursor_free(c);
+        bson_free(result);
+        throw exception("Failed to get string form cursor");
+      }
+
+      last = value;
+      if(last.length() > prefix.length()) {
+        res.push_back(last.substr(prefix.length() + 1));
+      }
       bson_cursor_free(c);
-      throw exception("Failed to get string form cursor");
+      bson_free(result);
     }
-
-    value += prefix.length() + 1;
-    res.push_back(value);
+    mongo_sync_cursor_free(cursor);
   }
 
+  if(next) {
+    *next = more ? last : std::string();
+  }
   return res;
 }
 
@@ -324,6 +469,239 @@ void MongoDatabase::setProperty( const std::string &variable,
   }
 }
 
+/**
+ * @brief Atomically add delta to an integer property.
+ *
+ * Values are stored as strings, so they can't be changed with $inc; instead,
+ * the property is read and conditionally replaced until no other change got
+ * in between.
+ */
+int64_t MongoDatabase::incrementProperty(const std::string &variable,
+ int64_t delta, const std::string &networkScope,
+ const std::string &receiverScope, const std::string &senderScope)
+{
+  bson *selector = exactSelector(variable, networkScope, receiverScope, senderScope);
+  bson_finish(selector);
+
+  while(1) {
+    std::string current;
+    int64_t sum = delta;
+    if(findProperty(M, dbc_.database, selector, &current)) {
+      char *end;
+      errno = 0;
+      long long value = strtoll(current.c_str(), &end, 10);
+      if(errno == 0 && !current.empty() && *end == 0) {
+        sum += value;
+      }
+    } else {
+      current.clear();
+    }
+
+    bool changed;
+    try {
+      changed = compareAndSetProperty(variable, current, std::to_string(sum),
+          networkScope, receiverScope, senderScope);
+    } catch(...) {
+      bson_free(selector);
+      throw;
+    }
+    if(changed) {
+      bson_free(selector);
+      return sum;
+    }
+  }
+}
+
+/**
+ * @brief Atomically change a property, if it has the expected value.
+ */
+bool MongoDatabase::compareAndSetProperty(const std::string &variable,
+ const std::string &expected, const std::string &value,
+ const std::string &networkScope, const std::string &receiverScope,
+ const std::string &senderScope)
+{
+  bson *query = exactSelector(variable, networkScope, receiverScope, senderScope);
+  if(expected.length() == 0 && value.length() == 0) {
+    // nothing changes, the property just must not exist
+    bson_finish(query);
+    std::string current;
+    bool exists = findProperty(M, dbc_.database, query, &current);
+    bson_free(query);
+    return !exists;
+  }
+
+  bool changed;
+  if(expected.length() == 0) {
+    // only set the value if the upsert inserts the property
+    bson_finish(query);
+    bson *update = bson_build_full(
+      BSON_TYPE_DOCUMENT, "$setOnInsert", TRUE,
+      bson_build(
+        BSON_TYPE_STRING, "value", value.c_str(), -1,
+        BSON_TYPE_NONE),
+      BSON_TYPE_NONE);
+    bson_finish(update);
+    try {
+      changed = !findAndModifyProperty(M, dbc_.database, query, update, false, true);
+    } catch(...) {
+      bson_free(query);
+      bson_free(update);
+      throw;
+    }
+    bson_free(update);
+  } else {
+    bson_append_string(query, "value", expected.c_str(), -1);
+    bson_finish(query);
+    bson *update = NULL;
+    if(value.length() > 0) {
+      update = bson_build_full(
+        BSON_TYPE_DOCUMENT, "$set", TRUE,
+        bson_build(
+          BSON_TYPE_STRING, "value", value.c_str(), -1,
+          BSON_TYPE_NONE),
+        BSON_TYPE_NONE);
+      bson_finish(update);
+    }
+    try {
+      changed = findAndModifyProperty(M, dbc_.database, query, update, update == NULL, false);
+    } catch(...) {
+      bson_free(query);
+      if(update) bson_free(update);
+      throw;
+    }
+    if(update) bson_free(update);
+  }
+  bson_free(query);
+  return changed;
+}
+
+/**
+ * @brief Build a {$in: [value, null]} document, matching a scope or any less
+ * specific one.
+ */
+static bson *inScope(const std::string &value)
+{
+  bson *in = bson_build_full(
+    BSON_TYPE_ARRAY, "$in", TRUE,
+    bson_build(BSON_TYPE_STRING, "1", value.c_str(), -1,
+               BSON_TYPE_NULL, "2", BSON_TYPE_NONE),
+    BSON_TYPE_NONE);
+  bson_finish(in);
+  return in;
+}
+
+/**
+ * @brief Retrieve several properties in a single query.
+ *
+ * All properties of the variables in the given scope or a less specific one
+ * are fetched at once; the most specific one of every variable is returned.
+ */
+std::vector<std::string> MongoDatabase::properties(
+ const std::vector<std::string> &variables, const std::string &networkScope,
+ const std::string &receiverScope, const std::string &senderScope)
+{
+  std::vector<std::string> values;
+  if(variables.empty()) {
+    return values;
+  }
+
+  bson *names = bson_new();
+  for(size_t i = 0; i < variables.size(); ++i) {
+    bson_append_string(names, std::to_string(i).c_str(), variables[i].c_str(), -1);
+  }
+  bson_finish(names);
+  bson *variable = bson_new();
+  bson_append_array(variable, "$in", names);
+  bson_finish(variable);
+
+  bson *selector = bson_new();
+  bson *network = 0, *receiver = 0, *sender = 0;
+  bson_append_document(selector, "variable", variable);
+  if(networkScope.length() > 0) {
+    network = inScope(networkScope);
+    bson_append_document(selector, "network", network);
+  } else {
+    bson_append_null(selector, "network");
+  }
+  if(networkScope.length() > 0 && receiverScope.length() > 0) {
+    receiver = inScope(receiverScope);
+    bson_append_document(selector, "receiver", receiver);
+  } else {
+    bson_append_null(selector, "receiver");
+  }
+  if(networkScope.length() > 0 && receiverScope.length() > 0 && senderScope.length() > 0) {
+    sender = inScope(senderScope);
+    bson_append_document(selector, "sender", sender);
+  } else {
+    bson_append_null(selector, "sender");
+  }
+  bson_finish(selector);
+
+  std::string properties = dbc_.database + ".properties";
+  mongo_packet *p = mongo_sync_cmd_query(M, properties.c_str(), 0, 0, 0, selector, NULL);
+
+  bson_free(selector);
+  bson_free(variable);
+  bson_free(names);
+  if(network) bson_free(network);
+  if(receiver) bson_free(receiver);
+  if(sender) bson_free(sender);
+
+  // the most specific property found so far, per variable
+  std::map<std::string, std::pair<int, std::string> > found;
+  if(p) {
+    mongo_sync_cursor *cursor = mongo_sync_cursor_new(M, properties.c_str(), p);
+    if(!cursor) {
+      throw exception("Failed to create cursor");
+    }
+
+    while(mongo_sync_cursor_next(cursor)) {
+      bson *result = mongo_sync_cursor_get_data(cursor);
+      if(!result) {
+        mongo_sync_cursor_free(cursor);
+        throw exception("Failed to get data from cursor");
+      }
+
+      const char *name, *value;
+      bson_cursor *n = bson_find(result, "variable");
+      bson_cursor *v = bson_find(result, "value");
+      if(!bson_cursor_get_string(n, &name) || !bson_cursor_get_string(v, &value)) {
+        bson_cursor_free(n);
+        bson_cursor_free(v);
+        bson_free(result);
+        mongo_sync_cursor_free(cursor);
+        throw exception("Failed to get string from cursor");
+      }
+
+      int specificity = 0;
+      const char *scopes[] = {"network", "receiver", "sender"};
+      for(int i = 0; i < 3; ++i) {
+        bson_cursor *c = bson_find(result, scopes[i]);
+        if(c && bson_cursor_type(c) == BSON_TYPE_STRING) {
+          ++specificity;
+        }
+        bson_cursor_free(c);
+      }
+
+      auto it = found.find(name);
+      if(it == found.end() || it->second.first < specificity) {
+        found[name] = std::make_pair(specificity, std::string(value));
+      }
+
+      bson_cursor_free(n);
+      bson_cursor_free(v);
+      bson_free(result);
+    }
+    mongo_sync_cursor_free(cursor);
+  }
+
+  for(auto it = variables.begin(); it != variables.end(); ++it) {
+    auto fit = found.find(*it);
+    values.push_back(fit == found.end() ? std::string() : fit->second.second);
+  }
+  return values;
+}
+
 bool MongoDatabase::hasPermission(const std::string &permission, const std::string &network,
 const std::string &channel, const std::string &sender, bool defaultPermission) const
 {
@@ -437,6 +815,67 @@ const std::string &channel, const std::string &sender)
   bson_free(selector);
 }
 
+/**
+ * @brief Read a string field of a document; missing and null fields, as
+ * used for unset scopes, are empty.
+ */
+static std::string stringField(bson *document, const char *name)
+{
+  bson_cursor *c = bson_find(document, name);
+  const char *value = NULL;
+  std::string result;
+  if(c && bson_cursor_get_string(c, &value)) {
+    result = value;
+  }
+  bson_cursor_free(c);
+  return result;
+}
+
+std::vector<PermissionEntry> MongoDatabase::permissions()
+{
+  bson *selector = bson_new();
+  bson_finish(selector);
+
+  std::string collection = dbc_.database + ".permissions";
+  mongo_packet *p = mongo_sync_cmd_query(M, collection.c_str(), 0, 0, 0, selector, NULL);
+  bson_free(selector);
+
+  std::vector<PermissionEntry> entries;
+  if(!p) {
+    // no permissions at all
+    return entries;
+  }
+
+  mongo_sync_cursor *cursor = mongo_sync_cursor_new(M, collection.c_str(), p);
+  if(!cursor) {
+    throw exception("Failed to create cursor");
+  }
+
+  while(mongo_sync_cursor_next(cursor)) {
+    bson *result = mongo_sync_cursor_get_data(cursor);
+    if(!result) {
+      mongo_sync_cursor_free(cursor);
+      throw exception("Failed to get data from cursor");
+    }
+
+    PermissionEntry entry;
+    entry.permission = stringField(result, "name");
+    entry.network = stringField(result, "network");
+    entry.receiver = stringField(result, "channel");
+    entry.sender = stringField(result, "sender");
+
+    bson_cursor *c = bson_find(result, "permission");
+    gboolean granted;
+    entry.granted = !c || !bson_cursor_get_boolean(c, &granted) || granted;
+    bson_cursor_free(c);
+    bson_free(result);
+
+    entries.push_back(entry);
+  }
+  mongo_sync_cursor_free(cursor);
+  return entries;
+}
+
 void MongoDatabase::setPermission(bool permission, const std::string &perm_name,
 const std::string &network, const std::string &channel, const std::string &sender)
 {
@@ -28,9 +28,19 @@ class MongoDatabase : public Database {
                    const std::string &networkScope = "",
                    const std::string &receiverScope = "",
                    const std::string &senderScope = "");
-  std::vector<std::string> propertyKeys(
-      const std::string &prefix,
-      const std::string &networkScope = "",
+  int64_t incrementProperty(const std::string &variable, int64_t delta,
+                            const std::string &networkScope = "",
+                            const std::string &receiverScope = "",
+                            const std::string &senderScope = "");
+  bool compareAndSetProperty(const std::string &variable,
+                             const std::string &expected,
+                             const std::string &value,
+                             const std::string &networkScope = "",
+                             const std::string &receiverScope = "",
+                             const std::string &senderScope = "");
+  std::vector<std::string> propertyKeyPage(
+      const std::string &prefix, const std::string &after, size_t limit,
+      std::string *next, const std::string &networkScope = "",
       const std::string &receiverScope = "",
       const std::string &senderScope = "");
   bool hasPermission(const std::string &perm_name, const std::string &network,
@@ -43,6 +53,12 @@ class MongoDatabase : public Database {
                      const std::string &network,
                      const std::string &receiver = "",
                      const std::string &sender   = "");
+  std::vector<PermissionEntry> permissions();
+  std::vector<std::string> properties(
+      const std::vector<std::string> &variables,
+      const std::string &networkScope = "",
+      const std::string &receiverScope = "",
+      const std::string &senderScope = "");
 
  private:
   // explicitly disable copy constructor
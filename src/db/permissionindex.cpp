@@ -0,0 +1,221 @@
+/**
+ * Copyright (c) 2014 Sjors Gielen, Ruben Nijveld, Aaron van Geffen
+ * See LICENSE for license.
+ */
+
+#include "permissionindex.h"
+#include <iostream>
+
+namespace dazeus {
+namespace db {
+
+PermissionIndexDatabase::PermissionIndexDatabase(DatabaseConfig dbc,
+                                                 Database *backend)
+    : Database(dbc), backend_(backend), rules_() {}
+
+PermissionIndexDatabase::~PermissionIndexDatabase()
+{
+  delete backend_;
+}
+
+void PermissionIndexDatabase::open()
+{
+  backend_->open();
+
+  std::vector<PermissionEntry> entries = backend_->permissions();
+  rules_.clear();
+  for (auto it = entries.begin(); it != entries.end(); ++it) {
+    index(it->permission, it->network, it->receiver, it->sender, it->granted);
+  }
+  std::cout << "Loaded " << entries.size() << " permissions into the index."
+            << std::endl;
+}
+
+/**
+ * @brief Add a stored permission to the index, or replace the one in the
+ * same scope.
+ */
+void PermissionIndexDatabase::index(const std::string &perm_name,
+    const std::string &network, const std::string &receiver,
+    const std::string &sender, bool granted)
+{
+  Rules &rules = rules_[perm_name];
+  for (auto it = rules.begin(); it != rules.end(); ++it) {
+    if (it->network == network && it->receiver == receiver &&
+        it->sender == sender) {
+      it->granted = granted;
+      return;
+    }
+  }
+  rules.push_back({network, receiver, sender, granted});
+}
+
+/**
+ * @brief Score how a scope field of a stored permission matches a check: 2
+ * exactly, 1 by wildcard, 0 if the permission doesn't restrict the field,
+ * or -1 if it doesn't match.
+ */
+static int fieldScore(const std::string &pattern, const std::string &value)
+{
+  if (pattern.empty()) {
+    return 0;
+  } else if (pattern == value) {
+    return 2;
+  } else if (pattern == "*" && !value.empty()) {
+    return 1;
+  }
+  return -1;
+}
+
+/**
+ * @brief Rank how specifically a stored permission matches a check, or -1 if
+ * it doesn't match.
+ *
+ * Permissions with a network rank above those without one; then the sender
+ * weighs most, then the channel. Only between permissions that set the same
+ * fields, exact matches rank above wildcards.
+ */
+int PermissionIndexDatabase::rank(const Rule &rule, const std::string &network,
+                                  const std::string &channel,
+                                  const std::string &sender)
+{
+  int s = fieldScore(rule.sender, sender);
+  int c = fieldScore(rule.receiver, channel);
+  int n = fieldScore(rule.network, network);
+  if (s < 0 || c < 0 || n < 0) {
+    return -1;
+  }
+  return (n > 0) << 5 | (s > 0) << 4 | (c > 0) << 3 |
+         (s == 2) << 2 | (c == 2) << 1 | (n == 2);
+}
+
+bool PermissionIndexDatabase::hasPermission(const std::string &perm_name,
+      const std::string &network, const std::string &channel,
+      const std::string &sender, bool defaultPermission) const
+{
+  auto it = rules_.find(perm_name);
+  if (it == rules_.end()) {
+    return defaultPermission;
+  }
+
+  const Rule *best = NULL;
+  int bestRank = -1;
+  for (auto rit = it->second.begin(); rit != it->second.end(); ++rit) {
+    int r = rank(*rit, network, channel, sender);
+    if (r > bestRank) {
+      best = &*rit;
+      bestRank = r;
+    }
+  }
+  return best ? best->granted : defaultPermission;
+}
+
+void PermissionIndexDatabase::unsetPermission(const std::string &perm_name,
+      const std::string &network, const std::string &receiver,
+      const std::string &sender)
+{
+  backend_->unsetPermission(perm_name, network, receiver, sender);
+
+  auto it = rules_.find(perm_name);
+  if (it == rules_.end()) {
+    return;
+  }
+  Rules &rules = it->second;
+  for (auto rit = rules.begin(); rit != rules.end(); ++rit) {
+    if (rit->network == network && rit->receiver == receiver &&
+        rit->sender == sender) {
+      rules.erase(rit);
+      break;
+    }
+  }
+  if (rules.empty()) {
+    rules_.erase(it);
+  }
+}
+
+void PermissionIndexDatabase::setPermission(bool permission,
+      const std::string &perm_name, const std::string &network,
+      const std::string &receiver, const std::string &sender)
+{
+  backend_->setPermission(permission, perm_name, network, receiver, sender);
+  index(perm_name, network, receiver, sender, permission);
+}
+
+std::vector<PermissionEntry> PermissionIndexDatabase::permissions()
+{
+  std::vector<PermissionEntry> entries;
+  for (auto it = rules_.begin(); it != rules_.end(); ++it) {
+    for (auto rit = it->second.begin(); rit != it->second.end(); ++rit) {
+      entries.push_back({it->first, rit->network, rit->receiver, rit->sender,
+                         rit->granted});
+    }
+  }
+  return entries;
+}
+
+std::string PermissionIndexDatabase::property(const std::string &variable,
+                                              const std::string &networkScope,
+                                              const std::string &receiverScope,
+                                              const std::string &senderScope)
+{
+  return backend_->property(variable, networkScope, receiverScope,
+                            senderScope);
+}
+
+std::vector<std::string> PermissionIndexDatabase::properties(
+    const std::vector<std::string> &variables,
+    const std::string &networkScope, const std::string &receiverScope,
+    const std::string &senderScope)
+{
+  return backend_->properties(variables, networkScope, receiverScope,
+                              senderScope);
+}
+
+void PermissionIndexDatabase::setProperty(const std::string &variable,
+    const std::string &value, const std::string &networkScope,
+    const std::string &receiverScope, const std::string &senderScope)
+{
+  backend_->setProperty(variable, value, networkScope, receiverScope,
+                        senderScope);
+}
+
+void PermissionIndexDatabase::setProperties(
+    const std::vector<PropertyChange> &changes)
+{
+  backend_->setProperties(changes);
+}
+
+int64_t PermissionIndexDatabase::incrementProperty(const std::string &variable,
+    int64_t delta, const std::string &networkScope,
+    const std::string &receiverScope, const std::string &senderScope)
+{
+  return backend_->incrementProperty(variable, delta, networkScope,
+                                     receiverScope, senderScope);
+}
+
+bool PermissionIndexDatabase::compareAndSetProperty(
+    const std::string &variable, const std::string &expected,
+    const std::string &value, const std::string &networkScope,
+    const std::string &receiverScope, const std::string &senderScope)
+{
+  return backend_->compareAndSetProperty(variable, expected, value,
+                                         networkScope, receiverScope,
+                                         senderScope);
+}
+
+std::vector<std::string> PermissionIndexDatabase::propertyKeyPage(
+    const std::string &prefix, const std::string &after, size_t limit,
+    std::string *next, const std::string &networkScope,
+    const std::string &receiverScope, const std::string &senderScope)
+{
+  return backend_->propertyKeyPage(prefix, after, limit, next, networkScope,
+                                   receiverScope, senderScope);
+}
+
+void PermissionIndexDatabase::flush()
+{
+  backend_->flush();
+}
+
+}  // namespace db
+}  // namespace dazeus
@@ -0,0 +1,113 @@
+/**
+ * Copyright (c) 2014 Sjors Gielen, Ruben Nijveld, Aaron van Geffen
+ * See LICENSE for license.
+ */
+
+#ifndef DB_PERMISSIONINDEX_H_
+#define DB_PERMISSIONINDEX_H_
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "database.h"
+
+namespace dazeus {
+namespace db {
+
+/**
+ * @class PermissionIndexDatabase
+ * @brief Answers permission checks from an index of all permissions of
+ * another database, kept in memory.
+ *
+ * The index is loaded when the database is opened, and permission changes
+ * are written through to the wrapped database and the index alike, so
+ * checking a permission never needs a query.
+ *
+ * A check falls back from the most specific scope to the least specific
+ * one: the sender in the channel, the sender anywhere on the network, the
+ * channel, and then the network. Permissions set without a network apply
+ * to all networks, and are only used if none of those match; among them,
+ * the same order holds. A network, channel or sender of "*" in a stored
+ * permission matches any one; within a level, exact matches take precedence
+ * over wildcards. The most specific matching permission decides.
+ *
+ * Everything else is passed on to the wrapped database.
+ */
+class PermissionIndexDatabase : public Database {
+ public:
+  PermissionIndexDatabase(DatabaseConfig dbc, Database *backend);
+  ~PermissionIndexDatabase();
+
+  void open();
+  std::string property(const std::string &variable,
+                       const std::string &networkScope = "",
+                       const std::string &receiverScope = "",
+                       const std::string &senderScope = "");
+  void setProperty(const std::string &variable, const std::string &value,
+                   const std::string &networkScope = "",
+                   const std::string &receiverScope = "",
+                   const std::string &senderScope = "");
+  int64_t incrementProperty(const std::string &variable, int64_t delta,
+                            const std::string &networkScope = "",
+                            const std::string &receiverScope = "",
+                            const std::string &senderScope = "");
+  bool compareAndSetProperty(const std::string &variable,
+                             const std::string &expected,
+                             const std::string &value,
+                             const std::string &networkScope = "",
+                             const std::string &receiverScope = "",
+                             const std::string &senderScope = "");
+  std::vector<std::string> propertyKeyPage(
+      const std::string &prefix, const std::string &after, size_t limit,
+      std::string *next, const std::string &networkScope = "",
+      const std::string &receiverScope = "",
+      const std::string &senderScope = "");
+  bool hasPermission(const std::string &perm_name, const std::string &network,
+                     const std::string &channel, const std::string &sender,
+                     bool defaultPermission) const;
+  void unsetPermission(const std::string &perm_name, const std::string &network,
+                       const std::string &receiver = "",
+                       const std::string &sender = "");
+  void setPermission(bool permission, const std::string &perm_name,
+                     const std::string &network,
+                     const std::string &receiver = "",
+                     const std::string &sender   = "");
+  std::vector<PermissionEntry> permissions();
+  void setProperties(const std::vector<PropertyChange> &changes);
+  std::vector<std::string> properties(
+      const std::vector<std::string> &variables,
+      const std::string &networkScope = "",
+      const std::string &receiverScope = "",
+      const std::string &senderScope = "");
+  void flush();
+
+ private:
+  // explicitly disable copy constructor
+  explicit PermissionIndexDatabase(const PermissionIndexDatabase&);
+  void operator=(const PermissionIndexDatabase&);
+
+  struct Rule {
+    std::string network;
+    std::string receiver;
+    std::string sender;
+    bool granted;
+  };
+  typedef std::vector<Rule> Rules;
+
+  static int rank(const Rule &rule, const std::string &network,
+                  const std::string &channel, const std::string &sender);
+  void index(const std::string &perm_name, const std::string &network,
+             const std::string &receiver, const std::string &sender,
+             bool granted);
+
+  Database *backend_;
+  // the stored permissions, by permission name
+  std::unordered_map<std::string, Rules> rules_;
+};
+
+}  // namespace db
+}  // namespace dazeus
+
+#endif  // DB_PERMISSIONINDEX_H_
@@ -6,15 +6,21 @@
 #include "../config.h"
 #include "postgres.h"
 #include <pqxx/pqxx>
+#include <algorithm>
 #include <iostream>
+#include <map>
+
+// idle time after which a connection is checked before it is used again
+#define POSTGRES_IDLE_CHECK std::chrono::seconds(30)
 
 namespace dazeus {
 namespace db {
 
 PostgreSQLDatabase::~PostgreSQLDatabase()
 {
-	if (conn_) {
-		conn_->disconnect();
+	for (auto it = idle_.begin(); it != idle_.end(); ++it) {
+		it->conn->disconnect();
+		delete it->conn;
 	}
 }
 
@@ -49,12 +55,13 @@ void PostgreSQLDatabase::open()
 
 	// Other options
 	connection_string << dbc_.options;
+	connectionString_ = connection_string.str();
 
 	// Connect the lot!
     try {
-        conn_ = new pqxx::connection(connection_string.str());
-        bootstrapDB();
-        upgradeDB();
+        transact<pqxx::work>([this](pqxx::work &w) {
+            upgradeDB(w);
+        });
 	}
 	catch (pqxx::pqxx_exception& e) {
 		fprintf(stderr, "Error: %s", e.base().what());
@@ -62,22 +69,160 @@ void PostgreSQLDatabase::open()
 	}
 }
 
-void PostgreSQLDatabase::bootstrapDB()
+/**
+ * @brief Take a connection from the pool.
+ *
+ * Idle connections are reused, most recently used first; one that was idle
+ * for a while is checked first, and dropped if it doesn't respond. If none
+ * are idle, a new connection is opened, unless the pool is full; then this
+ * waits until another thread releases one.
+ */
+pqxx::connection *PostgreSQLDatabase::acquire() const
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true) {
+		while (!idle_.empty()) {
+			IdleConnection idle = idle_.back();
+			idle_.pop_back();
+			if (std::chrono::steady_clock::now() - idle.since < POSTGRES_IDLE_CHECK) {
+				return idle.conn;
+			}
+
+			// don't hold up other threads while checking the connection
+			lock.unlock();
+			bool healthy = idle.conn->is_open();
+			if (healthy) {
+				try {
+					pqxx::nontransaction n(*idle.conn);
+					n.exec("SELECT 1");
+				} catch (pqxx::failure &) {
+					healthy = false;
+				}
+			}
+			if (healthy) {
+				return idle.conn;
+			}
+			fprintf(stderr, "Dropping broken PostgreSQL connection\n");
+			delete idle.conn;
+			lock.lock();
+			--open_;
+			available_.notify_one();
+		}
+
+		if (open_ < std::max<uint32_t>(dbc_.connections, 1)) {
+			++open_;
+			lock.unlock();
+			pqxx::connection *conn = 0;
+			try {
+				conn = new pqxx::connection(connectionString_);
+				bootstrapDB(conn);
+			} catch (...) {
+				delete conn;
+				lock.lock();
+				--open_;
+				available_.notify_one();
+				throw;
+			}
+			return conn;
+		}
+
+		available_.wait(lock);
+	}
+}
+
+/**
+ * @brief Return a connection to the pool, or close it if it is broken.
+ */
+void PostgreSQLDatabase::release(pqxx::connection *conn, bool healthy) const
+{
+	if (!healthy) {
+		delete conn;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (healthy) {
+		IdleConnection idle = { conn, std::chrono::steady_clock::now() };
+		idle_.push_back(idle);
+	} else {
+		--open_;
+	}
+	available_.notify_one();
+}
+
+/**
+ * @brief Run a function in a transaction on a pooled connection.
+ *
+ * The function is given the transaction, and has to commit it if needed. If
+ * the connection turns out to be broken, it is closed and the function is
+ * run once more on another connection; a transaction that broke before
+ * committing was rolled back, so this is safe.
+ */
+template <typename Transaction, typename Function>
+void PostgreSQLDatabase::transact(Function f) const
+{
+	for (int attempt = 0; ; ++attempt) {
+		pqxx::connection *conn = acquire();
+		try {
+			Transaction t(*conn);
+			f(t);
+		} catch (pqxx::broken_connection &e) {
+			release(conn, false);
+			if (attempt > 0) {
+				throw;
+			}
+			fprintf(stderr, "PostgreSQL connection broke, retrying: %s\n", e.what());
+			continue;
+		} catch (...) {
+			release(conn, conn->is_open());
+			throw;
+		}
+		release(conn, true);
+		return;
+	}
+}
+
+/**
+ * @brief Build a query that selects the given columns from the properties in
+ * a scope and every less specific scope, ranked by specificity.
+ *
+ * Each scope is a UNION ALL branch on the exact primary key, so a lookup is
+ * at most one index probe per scope; branches for empty scope fields get a
+ * constant false filter and are not executed.
+ */
+static std::string scopeProbes(const std::string &columns,
+                               const std::string &keyCondition,
+                               const std::vector<std::string> &scope)
+{
+	static const char *fields[] = {"network", "receiver", "sender"};
+	std::string query;
+	for (int mask = 7; mask >= 0; --mask) {
+		query += mask == 7 ? "SELECT " : " UNION ALL SELECT ";
+		query += std::to_string(7 - mask) + " AS rank, " + columns +
+		         " FROM dazeus_properties WHERE " + keyCondition;
+		for (int i = 0; i < 3; ++i) {
+			if (mask & (4 >> i)) {
+				query += std::string(" AND ") + fields[i] + " = " + scope[i] +
+				         " AND " + scope[i] + " <> ''";
+			} else {
+				query += std::string(" AND ") + fields[i] + " = ''";
+			}
+		}
+	}
+	return query;
+}
+
+void PostgreSQLDatabase::bootstrapDB(pqxx::connection *conn) const
 {
 	// start by preparing all queries we might eventually need
-	conn_->prepare("find_table", "SELECT * FROM pg_catalog.pg_tables WHERE tablename = $1");
-	conn_->prepare("find_property",
-			"SELECT * FROM dazeus_properties WHERE key = $1 "
-			"AND (network = $2 OR network = '') "
-			"AND (receiver = $3 OR receiver = '') "
-			"AND (sender = $4 OR sender = '') "
-			"ORDER BY network DESC, receiver DESC, sender DESC "
-			"LIMIT 1"
+	conn->prepare("find_table", "SELECT * FROM pg_catalog.pg_tables WHERE tablename = $1");
+	conn->prepare("find_property",
+			scopeProbes("value", "key = $1", {"$2", "$3", "$4"}) +
+			" ORDER BY rank LIMIT 1"
 		);
-	conn_->prepare("remove_property", "DELETE FROM dazeus_properties WHERE key = $1 AND network = $2 AND receiver = $3 AND sender = $4");
+	conn->prepare("remove_property", "DELETE FROM dazeus_properties WHERE key = $1 AND network = $2 AND receiver = $3 AND sender = $4");
 
 	// this is an update-or-insert-query
-	conn_->prepare("update_property",
+	conn->prepare("update_property",
 			"WITH "
 				"new_values(key, value, network, receiver, sender) AS (VALUES ($1, $2, $3, $4, $5)), "
 				"upsert AS ( "
@@ -88,7 +233,7 @@ void PostgreSQLDatabase::bootstrapDB()
 					"RETURNING p.* "
 				") "
 			"INSERT INTO dazeus_properties(key, value, network, receiver, sender) "
-			"SELECT key, value, network, sender, receiver "
+			"SELECT key, value, network, receiver, sender "
 			"FROM new_values AS n "
 			"WHERE NOT EXISTS ( "
 				"SELECT 1 FROM upsert AS up "
@@ -96,31 +241,64 @@ void PostgreSQLDatabase::bootstrapDB()
 			")"
     );
 
-	// get a list of keys starting with the given string
-    conn_->prepare("properties",
+	// atomic operations on a property in exactly the given scope; these rely
+	// on the primary key of dazeus_properties, which is why they need at
+	// least version 6 of the schema
+	conn->prepare("increment_property",
+			"INSERT INTO dazeus_properties(key, value, network, receiver, sender) "
+			"VALUES ($1, $2, $3, $4, $5) "
+			"ON CONFLICT (key, network, receiver, sender) DO UPDATE "
+			"SET value = ((CASE WHEN dazeus_properties.value ~ '^-?[0-9]+$' "
+				"THEN dazeus_properties.value::bigint ELSE 0 END) + $2::bigint)::text "
+			"RETURNING value"
+	);
+	conn->prepare("insert_property_if_absent",
+			"INSERT INTO dazeus_properties(key, value, network, receiver, sender) "
+			"VALUES ($1, $2, $3, $4, $5) "
+			"ON CONFLICT (key, network, receiver, sender) DO NOTHING"
+	);
+	conn->prepare("update_property_if",
+			"UPDATE dazeus_properties SET value = $2 "
+			"WHERE key = $1 AND network = $3 AND receiver = $4 AND sender = $5 AND value = $6"
+	);
+	conn->prepare("remove_property_if",
+			"DELETE FROM dazeus_properties "
+			"WHERE key = $1 AND network = $2 AND receiver = $3 AND sender = $4 AND value = $5"
+	);
+	conn->prepare("property_exists",
+			"SELECT 1 FROM dazeus_properties "
+			"WHERE key = $1 AND network = $2 AND receiver = $3 AND sender = $4"
+	);
+
+	// get a page of keys starting with the given string; this is a range scan
+	// on the scope and key index, which compares keys bytewise
+    conn->prepare("property_keys",
 				"SELECT key FROM dazeus_properties "
-				"WHERE SUBSTRING(key FROM 1 FOR CHAR_LENGTH($1)) = $1 "
-				"AND network = $2 AND receiver = $3 AND sender = $4"
+				"WHERE network = $2 AND receiver = $3 AND sender = $4 "
+				"AND key COLLATE \"C\" >= $1 AND key COLLATE \"C\" > $5 "
+				"AND key COLLATE \"C\" < $7 "
+				"ORDER BY key COLLATE \"C\" LIMIT $6"
+			);
+	// for prefixes without a successor, such as the empty one
+    conn->prepare("property_keys_unbounded",
+				"SELECT key FROM dazeus_properties "
+				"WHERE network = $2 AND receiver = $3 AND sender = $4 "
+				"AND key COLLATE \"C\" >= $1 AND key COLLATE \"C\" > $5 "
+				"ORDER BY key COLLATE \"C\" LIMIT $6"
 			);
 
-	// create permission, but only if it doesn't already exist
-	conn_->prepare("add_permission",
-			"WITH new_values(permission, network, receiver, sender) AS (VALUES ($1, $2, $3, $4)) "
-			"INSERT INTO dazeus_permissions(permission, network, receiver, sender) "
-			"SELECT permission, network, receiver, sender "
-			"FROM new_values AS n "
-			"WHERE NOT EXISTS ( "
-				"SELECT 1 FROM dazeus_permissions dp "
-				"WHERE dp.permission = n.permission AND dp.network = n.network AND dp.receiver = n.receiver AND dp.sender = n.sender "
-			")"
+	conn->prepare("add_permission",
+			"INSERT INTO dazeus_permissions(permission, network, receiver, sender, granted) "
+			"VALUES ($1, $2, $3, $4, $5) "
+			"ON CONFLICT (permission, network, receiver, sender) DO UPDATE "
+			"SET granted = EXCLUDED.granted"
 	);
-	conn_->prepare("remove_permission", "DELETE FROM dazeus_permissions WHERE permission = $1 AND network = $2 AND receiver = $3 AND sender = $4");
-	conn_->prepare("has_permission", "SELECT * FROM dazeus_permissions WHERE permission = $1 AND network = $2 AND receiver = $3 AND sender= $4");
+	conn->prepare("remove_permission", "DELETE FROM dazeus_permissions WHERE permission = $1 AND network = $2 AND receiver = $3 AND sender = $4");
+	conn->prepare("has_permission", "SELECT granted FROM dazeus_permissions WHERE permission = $1 AND network = $2 AND receiver = $3 AND sender= $4");
 }
 
-void PostgreSQLDatabase::upgradeDB()
+void PostgreSQLDatabase::upgradeDB(pqxx::transaction_base &w)
 {
-	pqxx::work w(*conn_);
 	pqxx::result r = w.prepared("find_table")("dazeus_properties").exec();
 
     int db_version = 0;
@@ -167,6 +345,23 @@ void PostgreSQLDatabase::upgradeDB()
 		"BEFORE UPDATE ON dazeus_permissions "
 		"FOR EACH ROW "
 		"EXECUTE PROCEDURE dazeus_update_timestamp_column() "
+		,
+		// a property is identified by its key and scope, not by its value;
+		// keep only the most recently updated one of any duplicates
+		"DELETE FROM dazeus_properties a USING dazeus_properties b "
+		"WHERE a.key = b.key AND a.network = b.network "
+		"AND a.receiver = b.receiver AND a.sender = b.sender "
+		"AND (a.updated, a.ctid) < (b.updated, b.ctid); "
+		"ALTER TABLE dazeus_properties "
+		"DROP CONSTRAINT dazeus_properties_pk, "
+		"ADD CONSTRAINT dazeus_properties_pk PRIMARY KEY(key, network, receiver, sender) "
+		,
+		"CREATE INDEX dazeus_properties_scope_key "
+		"ON dazeus_properties(network, receiver, sender, key COLLATE \"C\") "
+		,
+		// permissions used to be granted by merely existing
+		"ALTER TABLE dazeus_permissions "
+		"ADD COLUMN granted BOOLEAN NOT NULL DEFAULT TRUE "
 	};
 
     static int current_db_version = std::end(upgrades) - std::begin(upgrades);
@@ -186,14 +381,14 @@ std::string PostgreSQLDatabase::property(const std::string &variable,
 			const std::string &receiverScope,
 			const std::string &senderScope)
 {
-  // TODO: handle errors
-  pqxx::work w(*conn_);
-  pqxx::result r = w.prepared("find_property")(variable)(networkScope)(receiverScope)(senderScope).exec();
-  if (!r.empty()) {
-    return r[0]["value"].as<std::string>();
-  }
-  // TODO: what should we do if there is no result for us?
-	return "";
+  std::string value;
+  transact<pqxx::read_transaction>([&](pqxx::read_transaction &w) {
+    pqxx::result r = w.prepared("find_property")(variable)(networkScope)(receiverScope)(senderScope).exec();
+    if (!r.empty()) {
+      value = r[0]["value"].as<std::string>();
+    }
+  });
+  return value;
 }
 
 void PostgreSQLDatabase::setProperty(const std::string &variable,
@@ -201,29 +396,153 @@ void PostgreSQLDatabase::setProperty(const std::string &variable,
 			const std::string &receiverScope,
 			const std::string &senderScope)
 {
-  // TODO: handle errors
-  pqxx::work w(*conn_);
-  if (value == "") {
-    w.prepared("remove_property")(variable)(networkScope)(receiverScope)(senderScope).exec();
-  } else {
-    w.prepared("update_property")(variable)(value)(networkScope)(receiverScope)(senderScope).exec();
+  transact<pqxx::work>([&](pqxx::work &w) {
+    if (value == "") {
+      w.prepared("remove_property")(variable)(networkScope)(receiverScope)(senderScope).exec();
+    } else {
+      w.prepared("update_property")(variable)(value)(networkScope)(receiverScope)(senderScope).exec();
+    }
+    w.commit();
+  });
+}
+
+/**
+ * @brief Look up all properties with a single query.
+ */
+std::vector<std::string> PostgreSQLDatabase::properties(
+			const std::vector<std::string> &variables,
+			const std::string &networkScope,
+			const std::string &receiverScope,
+			const std::string &senderScope)
+{
+  std::vector<std::string> values;
+  if (variables.empty()) {
+    return values;
+  }
+
+  std::map<std::string, std::string> found;
+  transact<pqxx::read_transaction>([&](pqxx::read_transaction &w) {
+    std::string keys;
+    for (auto it = variables.begin(); it != variables.end(); ++it) {
+      keys += (it == variables.begin() ? "" : ", ") + w.quote(*it);
+    }
+
+    // DISTINCT ON keeps the first, most specific, property of every key
+    pqxx::result r = w.exec(
+        "SELECT DISTINCT ON (key) key, value FROM (" +
+        scopeProbes("key, value", "key IN (" + keys + ")",
+                    {w.quote(networkScope), w.quote(receiverScope),
+                     w.quote(senderScope)}) +
+        ") AS probes ORDER BY key, rank");
+
+    found.clear();
+    for (auto&& x : r) {
+      found[x["key"].as<std::string>()] = x["value"].as<std::string>();
+    }
+  });
+
+  for (auto it = variables.begin(); it != variables.end(); ++it) {
+    auto fit = found.find(*it);
+    values.push_back(fit == found.end() ? std::string() : fit->second);
   }
-  w.commit();
+  return values;
 }
 
-std::vector<std::string> PostgreSQLDatabase::propertyKeys(const std::string &prefix,
+/**
+ * @brief Apply all changes in a single transaction.
+ */
+void PostgreSQLDatabase::setProperties(const std::vector<PropertyChange> &changes)
+{
+  transact<pqxx::work>([&](pqxx::work &w) {
+    for (auto it = changes.begin(); it != changes.end(); ++it) {
+      if (it->value == "") {
+        w.prepared("remove_property")(it->variable)(it->network)(it->receiver)(it->sender).exec();
+      } else {
+        w.prepared("update_property")(it->variable)(it->value)(it->network)(it->receiver)(it->sender).exec();
+      }
+    }
+    w.commit();
+  });
+}
+
+int64_t PostgreSQLDatabase::incrementProperty(const std::string &variable,
+			int64_t delta, const std::string &networkScope,
+			const std::string &receiverScope,
+			const std::string &senderScope)
+{
+  int64_t value = 0;
+  transact<pqxx::work>([&](pqxx::work &w) {
+    pqxx::result r = w.prepared("increment_property")(variable)(delta)(networkScope)(receiverScope)(senderScope).exec();
+    w.commit();
+    value = r[0]["value"].as<int64_t>();
+  });
+  return value;
+}
+
+bool PostgreSQLDatabase::compareAndSetProperty(const std::string &variable,
+			const std::string &expected, const std::string &value,
 			const std::string &networkScope,
 			const std::string &receiverScope,
 			const std::string &senderScope)
 {
-    pqxx::work w(*conn_);
-    pqxx::result r = w.prepared("properties")(prefix)(networkScope)(receiverScope)(senderScope).exec();
+  bool changed = false;
+  if (expected == "" && value == "") {
+    // nothing changes, the property just must not exist
+    transact<pqxx::read_transaction>([&](pqxx::read_transaction &w) {
+      pqxx::result r = w.prepared("property_exists")(variable)(networkScope)(receiverScope)(senderScope).exec();
+      changed = r.empty();
+    });
+    return changed;
+  }
+
+  transact<pqxx::work>([&](pqxx::work &w) {
+    pqxx::result r;
+    if (expected == "") {
+      r = w.prepared("insert_property_if_absent")(variable)(value)(networkScope)(receiverScope)(senderScope).exec();
+    } else if (value == "") {
+      r = w.prepared("remove_property_if")(variable)(networkScope)(receiverScope)(senderScope)(expected).exec();
+    } else {
+      r = w.prepared("update_property_if")(variable)(value)(networkScope)(receiverScope)(senderScope)(expected).exec();
+    }
+    w.commit();
+    changed = r.affected_rows() > 0;
+  });
+  return changed;
+}
+
+std::vector<std::string> PostgreSQLDatabase::propertyKeyPage(
+			const std::string &prefix, const std::string &after, size_t limit,
+			std::string *next, const std::string &networkScope,
+			const std::string &receiverScope,
+			const std::string &senderScope)
+{
+    std::string successor = prefixSuccessor(prefix);
+    pqxx::result r;
+    transact<pqxx::read_transaction>([&](pqxx::read_transaction &w) {
+        // ask for one key more, to find out whether there is a next page; a
+        // NULL limit means no limit
+        if (successor.empty()) {
+            r = w.prepared("property_keys_unbounded")(prefix)(networkScope)(receiverScope)(senderScope)
+                (after)(limit + 1, limit != 0).exec();
+        } else {
+            r = w.prepared("property_keys")(prefix)(networkScope)(receiverScope)(senderScope)
+                (after)(limit + 1, limit != 0)(successor).exec();
+        }
+    });
 
     // Return a vector of all the property keys matching the criteria.
     std::vector<std::string> keys = std::vector<std::string>();
+    bool more = false;
     for (auto&& x : r) {
+        if (limit != 0 && keys.size() == limit) {
+            more = true;
+            break;
+        }
         keys.push_back(x["key"].as<std::string>());
     }
+    if (next) {
+        *next = more ? keys.back() : std::string();
+    }
     return keys;
 }
 
@@ -231,27 +550,53 @@ bool PostgreSQLDatabase::hasPermission(const std::string &perm_name,
 			const std::string &network, const std::string &channel,
 			const std::string &sender, bool defaultPermission) const
 {
-	pqxx::work w(*conn_);
-    pqxx::result r = w.prepared("ḥas_permission")(perm_name)(network)(channel)(sender).exec();
-    return r.empty() ? defaultPermission : true;
+    bool granted = defaultPermission;
+    transact<pqxx::read_transaction>([&](pqxx::read_transaction &w) {
+        pqxx::result r = w.prepared("has_permission")(perm_name)(network)(channel)(sender).exec();
+        granted = r.empty() ? defaultPermission : r[0]["granted"].as<bool>();
+    });
+    return granted;
 }
 
 void PostgreSQLDatabase::unsetPermission(const std::string &perm_name,
 			const std::string &network, const std::string &receiver,
 			const std::string &sender)
 {
-    pqxx::work w(*conn_);
-    pqxx::result r = w.prepared("remove_permission")(perm_name)(network)(receiver)(sender).exec();
-    w.commit();
+    transact<pqxx::work>([&](pqxx::work &w) {
+        w.prepared("remove_permission")(perm_name)(network)(receiver)(sender).exec();
+        w.commit();
+    });
 }
 
-void PostgreSQLDatabase::setPermission(bool /* TODO: permission */, const std::string &perm_name,
+void PostgreSQLDatabase::setPermission(bool permission, const std::string &perm_name,
 			const std::string &network, const std::string &receiver,
 			const std::string &sender)
 {
-    pqxx::work w(*conn_);
-    pqxx::result r = w.prepared("add_permission")(perm_name)(network)(receiver)(sender).exec();
-    w.commit();
+    transact<pqxx::work>([&](pqxx::work &w) {
+        w.prepared("add_permission")(perm_name)(network)(receiver)(sender)(permission).exec();
+        w.commit();
+    });
+}
+
+std::vector<PermissionEntry> PostgreSQLDatabase::permissions()
+{
+    std::vector<PermissionEntry> entries;
+    transact<pqxx::read_transaction>([&](pqxx::read_transaction &w) {
+        pqxx::result r = w.exec(
+            "SELECT permission, network, receiver, sender, granted "
+            "FROM dazeus_permissions");
+        entries.clear();
+        for (auto&& x : r) {
+            PermissionEntry entry;
+            entry.permission = x["permission"].as<std::string>();
+            entry.network = x["network"].as<std::string>();
+            entry.receiver = x["receiver"].as<std::string>();
+            entry.sender = x["sender"].as<std::string>();
+            entry.granted = x["granted"].as<bool>();
+            entries.push_back(entry);
+        }
+    });
+    return entries;
 }
 
 }  // namespace db
@@ -7,18 +7,36 @@
 #define DB_POSTGRES_H_
 
 #include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include <pqxx/connection.hxx>
 #include "database.h"
 
+namespace pqxx {
+class transaction_base;
+}
+
 namespace dazeus {
 namespace db {
 
+/**
+ * @class PostgreSQLDatabase
+ * @brief Stores properties and permissions in PostgreSQL.
+ *
+ * Queries run on a bounded pool of connections, which are opened when
+ * needed, up to the configured amount. Each connection has its own prepared
+ * statements. A connection that was idle for a while is checked before it
+ * is used again, and a query that fails because its connection broke is
+ * retried once on a new one. Lookups run in read-only transactions.
+ */
 class PostgreSQLDatabase : public Database {
  public:
-  explicit PostgreSQLDatabase(DatabaseConfig dbc) : Database(dbc) {}
+  explicit PostgreSQLDatabase(DatabaseConfig dbc)
+      : Database(dbc), open_(0) {}
   ~PostgreSQLDatabase();
 
   void open();
@@ -30,9 +48,19 @@ class PostgreSQLDatabase : public Database {
                    const std::string &networkScope = "",
                    const std::string &receiverScope = "",
                    const std::string &senderScope = "");
-  std::vector<std::string> propertyKeys(
-      const std::string &prefix,
-      const std::string &networkScope = "",
+  int64_t incrementProperty(const std::string &variable, int64_t delta,
+                            const std::string &networkScope = "",
+                            const std::string &receiverScope = "",
+                            const std::string &senderScope = "");
+  bool compareAndSetProperty(const std::string &variable,
+                             const std::string &expected,
+                             const std::string &value,
+                             const std::string &networkScope = "",
+                             const std::string &receiverScope = "",
+                             const std::string &senderScope = "");
+  std::vector<std::string> propertyKeyPage(
+      const std::string &prefix, const std::string &after, size_t limit,
+      std::string *next, const std::string &networkScope = "",
       const std::string &receiverScope = "",
       const std::string &senderScope = "");
   bool hasPermission(const std::string &perm_name, const std::string &network,
@@ -45,21 +73,38 @@ class PostgreSQLDatabase : public Database {
                      const std::string &network,
                      const std::string &receiver = "",
                      const std::string &sender   = "");
+  std::vector<PermissionEntry> permissions();
+  void setProperties(const std::vector<PropertyChange> &changes);
+  std::vector<std::string> properties(
+      const std::vector<std::string> &variables,
+      const std::string &networkScope = "",
+      const std::string &receiverScope = "",
+      const std::string &senderScope = "");
 
  private:
   // explicitly disable copy constructor
   explicit PostgreSQLDatabase(const PostgreSQLDatabase&);
   void operator=(const PostgreSQLDatabase&);
 
-  void bootstrapDB();
-  void upgradeDB();
+  struct IdleConnection {
+    pqxx::connection *conn;
+    std::chrono::steady_clock::time_point since;
+  };
+
+  void bootstrapDB(pqxx::connection *conn) const;
+  void upgradeDB(pqxx::transaction_base &w);
+  pqxx::connection *acquire() const;
+  void release(pqxx::connection *conn, bool healthy) const;
+  template <typename Transaction, typename Function>
+  void transact(Function f) const;
 
-  pqxx::connection *conn_;
-  std::string hostName_;
-  std::string databaseName_;
-  uint16_t port_;
-  std::string username_;
-  std::string password_;
+  std::string connectionString_;
+  mutable std::mutex mutex_;
+  mutable std::condition_variable available_;
+  // most recently used connections last
+  mutable std::vector<IdleConnection> idle_;
+  // amount of open connections, idle or in use
+  mutable size_t open_;
 };
 
 }  // namespace db
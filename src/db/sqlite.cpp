@@ -7,7 +7,11 @@
 #include "sqlite.h"
 #include <sqlite3.h>
 #include <stdio.h>
+#include <ctype.h>
+#include <algorithm>
 #include <iostream>
+#include <map>
+#include <unordered_map>
 
 namespace dazeus {
 namespace db {
@@ -21,7 +25,13 @@ SQLiteDatabase::~SQLiteDatabase()
     sqlite3_finalize(find_property);
     sqlite3_finalize(remove_property);
     sqlite3_finalize(update_property);
-    sqlite3_finalize(properties);
+    sqlite3_finalize(property_keys);
+    sqlite3_finalize(property_keys_unbounded);
+    sqlite3_finalize(increment_property);
+    sqlite3_finalize(insert_property_if_absent);
+    sqlite3_finalize(update_property_if);
+    sqlite3_finalize(remove_property_if);
+    sqlite3_finalize(property_exists);
     sqlite3_finalize(add_permission);
     sqlite3_finalize(remove_permission);
     sqlite3_finalize(has_permission);
@@ -40,10 +50,135 @@ void SQLiteDatabase::open()
                  sqlite3_errmsg(conn_);
     throw exception(error);
   }
+  configure();
   upgradeDB();
   bootstrapDB();
 }
 
+/**
+ * @brief Split options like "journal_mode=wal synchronous=normal" into names
+ * and values.
+ *
+ * Options are separated by whitespace, commas or semicolons; names and
+ * values are case insensitive.
+ */
+static std::map<std::string, std::string> parseOptions(const std::string &options)
+{
+  std::map<std::string, std::string> result;
+  size_t pos = 0;
+  while (pos < options.length()) {
+    size_t end = options.find_first_of(" \t,;", pos);
+    if (end == std::string::npos) {
+      end = options.length();
+    }
+    std::string option = options.substr(pos, end - pos);
+    pos = end + 1;
+    if (option.empty()) {
+      continue;
+    }
+
+    std::transform(option.begin(), option.end(), option.begin(), ::tolower);
+    size_t equals = option.find('=');
+    if (equals == std::string::npos || equals == 0) {
+      throw exception("Invalid SQLite option '" + option +
+                      "', expected name=value");
+    }
+    result[option.substr(0, equals)] = option.substr(equals + 1);
+  }
+  return result;
+}
+
+static bool isInteger(const std::string &value, bool allowNegative)
+{
+  size_t start = allowNegative && value.length() > 1 && value[0] == '-' ? 1 : 0;
+  return value.length() > start &&
+         value.find_first_not_of("0123456789", start) == std::string::npos;
+}
+
+/**
+ * @brief Run a pragma statement, and return the first column of its result.
+ */
+std::string SQLiteDatabase::pragma(const std::string &statement) const
+{
+  sqlite3_stmt *stmt;
+  tryPrepare("PRAGMA " + statement, &stmt);
+  std::string value;
+  try {
+    if (tryStep(stmt) == SQLITE_ROW && sqlite3_column_text(stmt, 0)) {
+      value = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+    }
+  } catch (...) {
+    sqlite3_finalize(stmt);
+    throw;
+  }
+  sqlite3_finalize(stmt);
+  return value;
+}
+
+/**
+ * @brief Apply the tunables given in the options of the database config,
+ * and report the resulting profile.
+ *
+ * Supported options are journal_mode (e.g. wal), synchronous (off, normal,
+ * full or extra), mmap_size and cache_size (as in their pragmas),
+ * busy_timeout in milliseconds, and checkpoint: the amount of pages the
+ * write-ahead log may grow to before it is checkpointed. Options that aren't
+ * given keep the defaults of SQLite.
+ */
+void SQLiteDatabase::configure()
+{
+  std::map<std::string, std::string> options = parseOptions(dbc_.options);
+  for (auto it = options.begin(); it != options.end(); ++it) {
+    const std::string &name = it->first;
+    const std::string &value = it->second;
+
+    if (name == "journal_mode") {
+      static const char *modes[] = {"delete", "truncate", "persist", "memory",
+                                    "wal", "off"};
+      if (std::find(std::begin(modes), std::end(modes), value) == std::end(modes)) {
+        throw exception("Invalid value for SQLite option journal_mode: " + value);
+      }
+      // the journal mode can't always be changed, e.g. for in-memory databases
+      std::string mode = pragma("journal_mode = " + value);
+      if (mode != value) {
+        throw exception("Could not set SQLite journal_mode to " + value +
+                        ", it is " + mode);
+      }
+    } else if (name == "synchronous") {
+      static const char *levels[] = {"off", "normal", "full", "extra"};
+      if (std::find(std::begin(levels), std::end(levels), value) == std::end(levels)) {
+        throw exception("Invalid value for SQLite option synchronous: " + value);
+      }
+      pragma("synchronous = " + value);
+    } else if (name == "mmap_size" || name == "busy_timeout" ||
+               name == "checkpoint") {
+      if (!isInteger(value, false)) {
+        throw exception("Invalid value for SQLite option " + name + ": " + value);
+      }
+      pragma((name == "checkpoint" ? "wal_autocheckpoint" : name) + " = " + value);
+    } else if (name == "cache_size") {
+      if (!isInteger(value, true)) {
+        throw exception("Invalid value for SQLite option cache_size: " + value);
+      }
+      pragma("cache_size = " + value);
+    } else {
+      throw exception("Unknown SQLite option: " + name);
+    }
+  }
+
+  static const char *levels[] = {"off", "normal", "full", "extra"};
+  std::string synchronous = pragma("synchronous");
+  if (isInteger(synchronous, false) && std::stoi(synchronous) < 4) {
+    synchronous = levels[std::stoi(synchronous)];
+  }
+  std::cout << "SQLite profile: journal_mode=" << pragma("journal_mode")
+            << " synchronous=" << synchronous
+            << " mmap_size=" << pragma("mmap_size")
+            << " cache_size=" << pragma("cache_size")
+            << " busy_timeout=" << pragma("busy_timeout")
+            << " checkpoint=" << pragma("wal_autocheckpoint") << std::endl;
+}
+
 /**
  * @brief Try to create a prepared statement on the SQLite3 connection.
  */
@@ -74,19 +209,63 @@ void SQLiteDatabase::tryBind(sqlite3_stmt *target, int param,
   }
 }
 
+/**
+ * @brief Step a prepared statement, expecting a row or the end of the results.
+ *
+ * On errors, the statement is reset and an exception is thrown.
+ */
+int SQLiteDatabase::tryStep(sqlite3_stmt *target) const
+{
+  int errc = sqlite3_step(target);
+  if (errc != SQLITE_ROW && errc != SQLITE_DONE) {
+    std::string msg = "Got an error while executing an SQL query (code " +
+                      std::to_string(errc) + "): " + sqlite3_errmsg(conn_);
+    sqlite3_reset(target);
+    throw exception(msg);
+  }
+  return errc;
+}
+
+/**
+ * @brief Build a query that selects the given columns from the properties in
+ * a scope and every less specific scope, ranked by specificity.
+ *
+ * Every scope is a separate branch of a UNION ALL that matches the primary
+ * key exactly, so each is a single index probe. Branches for scope fields
+ * that are empty have a constant false condition, and are skipped without a
+ * lookup; the ranks are in the order of network, receiver and sender, each
+ * set before unset, as the scopes used to be sorted.
+ */
+static std::string scopeProbes(const std::string &columns,
+                               const std::string &keyCondition,
+                               const std::vector<std::string> &scope)
+{
+  static const char *fields[] = {"network", "receiver", "sender"};
+  std::string query;
+  for (int mask = 7; mask >= 0; --mask) {
+    query += mask == 7 ? "SELECT " : " UNION ALL SELECT ";
+    query += std::to_string(7 - mask) + " AS rank, " + columns +
+             " FROM dazeus_properties WHERE " + keyCondition;
+    for (int i = 0; i < 3; ++i) {
+      if (mask & (4 >> i)) {
+        query += std::string(" AND ") + fields[i] + " = " + scope[i] +
+                 " AND " + scope[i] + " <> ''";
+      } else {
+        query += std::string(" AND ") + fields[i] + " = ''";
+      }
+    }
+  }
+  return query;
+}
+
 /**
  * @brief Prepare all SQL statements used by the database layer
  */
 void SQLiteDatabase::bootstrapDB()
 {
   tryPrepare(
-      "SELECT value FROM dazeus_properties "
-      "WHERE key = ?1 "
-      "  AND (network = ?2 OR network = '') "
-      "  AND (receiver = ?3 OR receiver = '') "
-      "  AND (sender = ?4 OR sender = '') "
-      "ORDER BY network DESC, receiver DESC, sender DESC "
-      "LIMIT 1",
+      scopeProbes("value", "key = ?1", {"?2", "?3", "?4"}) +
+      " ORDER BY rank LIMIT 1",
       &find_property);
 
   tryPrepare(
@@ -101,16 +280,63 @@ void SQLiteDatabase::bootstrapDB()
       "VALUES (?1, ?2, ?3, ?4, ?5) ",
       &update_property);
 
+  // prefix searches are range scans on the scope and key index; a negative
+  // limit means no limit
+  tryPrepare(
+      "SELECT key FROM dazeus_properties "
+      "WHERE network = ?2 AND receiver = ?3 AND sender = ?4 "
+      "  AND key >= ?1 AND key > ?5 AND key < ?7 "
+      "ORDER BY key LIMIT ?6",
+      &property_keys);
+
+  // for prefixes without a successor, such as the empty one
   tryPrepare(
       "SELECT key FROM dazeus_properties "
-      "WHERE SUBSTR(key, 1, LENGTH(?1)) = ?1 "
+      "WHERE network = ?2 AND receiver = ?3 AND sender = ?4 "
+      "  AND key >= ?1 AND key > ?5 "
+      "ORDER BY key LIMIT ?6",
+      &property_keys_unbounded);
+
+  tryPrepare(
+      "INSERT INTO dazeus_properties "
+      "(key, value, network, receiver, sender) "
+      "VALUES (?1, CAST(?2 AS INTEGER), ?3, ?4, ?5) "
+      "ON CONFLICT (key, network, receiver, sender) DO UPDATE "
+      "SET value = CAST(value AS INTEGER) + CAST(?2 AS INTEGER), "
+      "    updated = CURRENT_TIMESTAMP "
+      "RETURNING value",
+      &increment_property);
+
+  tryPrepare(
+      "INSERT INTO dazeus_properties "
+      "(key, value, network, receiver, sender) "
+      "VALUES (?1, ?2, ?3, ?4, ?5) "
+      "ON CONFLICT (key, network, receiver, sender) DO NOTHING",
+      &insert_property_if_absent);
+
+  tryPrepare(
+      "UPDATE dazeus_properties "
+      "SET value = ?2, updated = CURRENT_TIMESTAMP "
+      "WHERE key = ?1 "
+      "  AND network = ?3 AND receiver = ?4 AND sender = ?5 AND value = ?6",
+      &update_property_if);
+
+  tryPrepare(
+      "DELETE FROM dazeus_properties "
+      "WHERE key = ?1 "
+      "  AND network = ?2 AND receiver = ?3 AND sender = ?4 AND value = ?5",
+      &remove_property_if);
+
+  tryPrepare(
+      "SELECT 1 FROM dazeus_properties "
+      "WHERE key = ?1 "
       "  AND network = ?2 AND receiver = ?3 AND sender = ?4",
-      &properties);
+      &property_exists);
 
   tryPrepare(
       "INSERT OR REPLACE INTO dazeus_permissions "
-      "(permission, network, receiver, sender) "
-      "VALUES (?1, ?2, ?3, ?4) ",
+      "(permission, network, receiver, sender, granted) "
+      "VALUES (?1, ?2, ?3, ?4, ?5) ",
       &add_permission);
 
   tryPrepare(
@@ -120,7 +346,7 @@ void SQLiteDatabase::bootstrapDB()
       &remove_permission);
 
   tryPrepare(
-      "SELECT * FROM dazeus_permissions "
+      "SELECT granted FROM dazeus_permissions "
       "WHERE permission = ?1 "
       "  AND network = ?2 AND receiver = ?3 AND sender = ?4",
       &has_permission);
@@ -184,6 +410,13 @@ void SQLiteDatabase::upgradeDB()
       "updated TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP, "
             "PRIMARY KEY(permission, network, receiver, sender) "
         ")"
+    ,
+    "CREATE INDEX dazeus_properties_scope_key "
+      "ON dazeus_properties(network, receiver, sender, key)"
+    ,
+    // permissions used to be granted by merely existing
+    "ALTER TABLE dazeus_permissions "
+      "ADD COLUMN granted INTEGER NOT NULL DEFAULT 1"
   };
 
   // run any outstanding updates
@@ -226,7 +459,7 @@ std::string SQLiteDatabase::property(const std::string &variable,
   int errc = sqlite3_step(find_property);
 
   if (errc == SQLITE_ROW) {
-    std::string value = reinterpret_cast<const char *>(sqlite3_column_text(find_property, 0));
+    std::string value = reinterpret_cast<const char *>(sqlite3_column_text(find_property, 1));
     sqlite3_reset(find_property);
     return value;
   } else if (errc == SQLITE_DONE) {
@@ -265,36 +498,199 @@ void SQLiteDatabase::setProperty(const std::string &variable,
   sqlite3_reset(stmt);
 }
 
-std::vector<std::string> SQLiteDatabase::propertyKeys(const std::string &prefix,
-      const std::string &networkScope,
-      const std::string &receiverScope,
-      const std::string &senderScope)
+/**
+ * @brief Look up the properties with a single query per chunk of variables.
+ *
+ * The chunks are kept below the lowest limit on bound parameters that SQLite
+ * has had by default.
+ */
+std::vector<std::string> SQLiteDatabase::properties(
+    const std::vector<std::string> &variables,
+    const std::string &networkScope, const std::string &receiverScope,
+    const std::string &senderScope)
 {
-  // Return a vector of all the property keys matching the criteria.
-  std::vector<std::string> keys = std::vector<std::string>();
+  const size_t chunkSize = 500;
+  std::unordered_map<std::string, std::string> found;
+
+  for (size_t first = 0; first < variables.size(); first += chunkSize) {
+    size_t count = std::min(chunkSize, variables.size() - first);
 
-  tryBind(properties, 1, prefix);
-  tryBind(properties, 2, networkScope);
-  tryBind(properties, 3, receiverScope);
-  tryBind(properties, 4, senderScope);
+    std::string keys = "key IN (";
+    for (size_t i = 0; i < count; ++i) {
+      keys += i == 0 ? "?" : ", ?";
+      keys += std::to_string(i + 4);
+    }
+    keys += ")";
+
+    // rows come in order of specificity, so the first one per key wins
+    std::string query = scopeProbes("key, value", keys, {"?1", "?2", "?3"}) +
+                        " ORDER BY key, rank";
+
+    sqlite3_stmt *stmt;
+    tryPrepare(query, &stmt);
+    try {
+      tryBind(stmt, 1, networkScope);
+      tryBind(stmt, 2, receiverScope);
+      tryBind(stmt, 3, senderScope);
+      for (size_t i = 0; i < count; ++i) {
+        tryBind(stmt, i + 4, variables[first + i]);
+      }
+
+      while (tryStep(stmt) == SQLITE_ROW) {
+        found.emplace(
+            reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1)),
+            reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2)));
+      }
+    } catch (...) {
+      sqlite3_finalize(stmt);
+      throw;
+    }
+    sqlite3_finalize(stmt);
+  }
+
+  std::vector<std::string> values;
+  values.reserve(variables.size());
+  for (auto it = variables.begin(); it != variables.end(); ++it) {
+    auto fit = found.find(*it);
+    values.push_back(fit == found.end() ? std::string() : fit->second);
+  }
+  return values;
+}
 
-  while (true) {
-    int errc = sqlite3_step(properties);
+/**
+ * @brief Apply all changes in a single transaction.
+ */
+void SQLiteDatabase::setProperties(const std::vector<PropertyChange> &changes)
+{
+  char *error = NULL;
+  if (sqlite3_exec(conn_, "BEGIN", NULL, NULL, &error) != SQLITE_OK) {
+    std::string msg = std::string("Could not start transaction: ") + error;
+    sqlite3_free(error);
+    throw exception(msg);
+  }
 
-    if (errc == SQLITE_ROW) {
-      std::string value = reinterpret_cast<const char *>(sqlite3_column_text(properties, 0));
-      keys.push_back(value);
-    } else if (errc == SQLITE_DONE) {
-      sqlite3_reset(properties);
+  try {
+    for (auto it = changes.begin(); it != changes.end(); ++it) {
+      setProperty(it->variable, it->value, it->network, it->receiver,
+                  it->sender);
+    }
+  } catch (exception &e) {
+    sqlite3_exec(conn_, "ROLLBACK", NULL, NULL, NULL);
+    throw;
+  }
+
+  if (sqlite3_exec(conn_, "COMMIT", NULL, NULL, &error) != SQLITE_OK) {
+    std::string msg = std::string("Could not commit transaction: ") + error;
+    sqlite3_free(error);
+    sqlite3_exec(conn_, "ROLLBACK", NULL, NULL, NULL);
+    throw exception(msg);
+  }
+}
+
+int64_t SQLiteDatabase::incrementProperty(const std::string &variable,
+    int64_t delta, const std::string &networkScope,
+    const std::string &receiverScope, const std::string &senderScope)
+{
+  tryBind(increment_property, 1, variable);
+  tryBind(increment_property, 2, std::to_string(delta));
+  tryBind(increment_property, 3, networkScope);
+  tryBind(increment_property, 4, receiverScope);
+  tryBind(increment_property, 5, senderScope);
+
+  if (tryStep(increment_property) != SQLITE_ROW) {
+    sqlite3_reset(increment_property);
+    throw exception("Incrementing a property returned no value");
+  }
+  int64_t value = sqlite3_column_int64(increment_property, 0);
+  // finish the statement, so the change is committed
+  tryStep(increment_property);
+  sqlite3_reset(increment_property);
+  return value;
+}
+
+bool SQLiteDatabase::compareAndSetProperty(const std::string &variable,
+    const std::string &expected, const std::string &value,
+    const std::string &networkScope, const std::string &receiverScope,
+    const std::string &senderScope)
+{
+  sqlite3_stmt *stmt;
+  if (expected.empty() && value.empty()) {
+    // nothing changes, the property just must not exist
+    tryBind(property_exists, 1, variable);
+    tryBind(property_exists, 2, networkScope);
+    tryBind(property_exists, 3, receiverScope);
+    tryBind(property_exists, 4, senderScope);
+    bool exists = tryStep(property_exists) == SQLITE_ROW;
+    sqlite3_reset(property_exists);
+    return !exists;
+  } else if (expected.empty()) {
+    stmt = insert_property_if_absent;
+    tryBind(stmt, 1, variable);
+    tryBind(stmt, 2, value);
+    tryBind(stmt, 3, networkScope);
+    tryBind(stmt, 4, receiverScope);
+    tryBind(stmt, 5, senderScope);
+  } else if (value.empty()) {
+    stmt = remove_property_if;
+    tryBind(stmt, 1, variable);
+    tryBind(stmt, 2, networkScope);
+    tryBind(stmt, 3, receiverScope);
+    tryBind(stmt, 4, senderScope);
+    tryBind(stmt, 5, expected);
+  } else {
+    stmt = update_property_if;
+    tryBind(stmt, 1, variable);
+    tryBind(stmt, 2, value);
+    tryBind(stmt, 3, networkScope);
+    tryBind(stmt, 4, receiverScope);
+    tryBind(stmt, 5, senderScope);
+    tryBind(stmt, 6, expected);
+  }
+
+  tryStep(stmt);
+  sqlite3_reset(stmt);
+  return sqlite3_changes(conn_) > 0;
+}
+
+std::vector<std::string> SQLiteDatabase::propertyKeyPage(
+      const std::string &prefix, const std::string &after, size_t limit,
+      std::string *next, const std::string &networkScope,
+      const std::string &receiverScope, const std::string &senderScope)
+{
+  std::string successor = prefixSuccessor(prefix);
+  sqlite3_stmt *stmt = successor.empty() ? property_keys_unbounded
+                                         : property_keys;
+
+  tryBind(stmt, 1, prefix);
+  tryBind(stmt, 2, networkScope);
+  tryBind(stmt, 3, receiverScope);
+  tryBind(stmt, 4, senderScope);
+  tryBind(stmt, 5, after);
+  if (!successor.empty()) {
+    tryBind(stmt, 7, successor);
+  }
+  // ask for one key more, to find out whether there is a next page
+  int result = sqlite3_bind_int64(stmt, 6, limit == 0 ? -1 : (int64_t)limit + 1);
+  if (result != SQLITE_OK) {
+    throw exception("Failed to bind limit to query with error: " +
+                    std::string(sqlite3_errmsg(conn_)));
+  }
+
+  // Return a vector of all the property keys matching the criteria.
+  std::vector<std::string> keys;
+  bool more = false;
+  while (tryStep(stmt) == SQLITE_ROW) {
+    if (limit != 0 && keys.size() == limit) {
+      more = true;
       break;
-    } else {
-      std::string msg = "Got an error while executing an SQL query (code " +
-                        std::to_string(errc) + "): " + sqlite3_errmsg(conn_);
-      sqlite3_reset(properties);
-      throw exception(msg);
     }
+    keys.push_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)));
   }
+  sqlite3_reset(stmt);
 
+  if (next) {
+    *next = more ? keys.back() : std::string();
+  }
   return keys;
 }
 
@@ -310,8 +706,9 @@ bool SQLiteDatabase::hasPermission(const std::string &perm_name,
   int errc = sqlite3_step(has_permission);
 
   if (errc == SQLITE_ROW) {
+    bool granted = sqlite3_column_int(has_permission, 0) != 0;
     sqlite3_reset(has_permission);
-    return true;
+    return granted;
   } else if (errc == SQLITE_DONE) {
     sqlite3_reset(has_permission);
     return defaultPermission;
@@ -343,7 +740,7 @@ void SQLiteDatabase::unsetPermission(const std::string &perm_name,
   sqlite3_reset(remove_permission);
 }
 
-void SQLiteDatabase::setPermission(bool /* TODO: permission */, const std::string &perm_name,
+void SQLiteDatabase::setPermission(bool permission, const std::string &perm_name,
       const std::string &network, const std::string &receiver,
       const std::string &sender)
 {
@@ -351,6 +748,7 @@ void SQLiteDatabase::setPermission(bool /* TODO: permission */, const std::strin
   tryBind(add_permission, 2, network);
   tryBind(add_permission, 3, receiver);
   tryBind(add_permission, 4, sender);
+  tryBind(add_permission, 5, permission ? "1" : "0");
   int errc = sqlite3_step(add_permission);
 
   if (errc != SQLITE_OK && errc != SQLITE_DONE) {
@@ -363,5 +761,29 @@ void SQLiteDatabase::setPermission(bool /* TODO: permission */, const std::strin
   sqlite3_reset(add_permission);
 }
 
+std::vector<PermissionEntry> SQLiteDatabase::permissions()
+{
+  std::vector<PermissionEntry> entries;
+  sqlite3_stmt *stmt;
+  tryPrepare("SELECT permission, network, receiver, sender, granted "
+             "FROM dazeus_permissions", &stmt);
+  try {
+    while (tryStep(stmt) == SQLITE_ROW) {
+      PermissionEntry entry;
+      entry.permission = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+      entry.network = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
+      entry.receiver = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2));
+      entry.sender = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 3));
+      entry.granted = sqlite3_column_int(stmt, 4) != 0;
+      entries.push_back(entry);
+    }
+  } catch (...) {
+    sqlite3_finalize(stmt);
+    throw;
+  }
+  sqlite3_finalize(stmt);
+  return entries;
+}
+
 }  // namespace db
 }  // namespace dazeus
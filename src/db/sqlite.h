@@ -19,7 +19,14 @@ namespace db {
 
 class SQLiteDatabase : public Database {
  public:
-  explicit SQLiteDatabase(DatabaseConfig dbc) : Database(dbc) {}
+  explicit SQLiteDatabase(DatabaseConfig dbc)
+      : Database(dbc), conn_(NULL), find_property(NULL),
+        remove_property(NULL), update_property(NULL), property_keys(NULL),
+        property_keys_unbounded(NULL), increment_property(NULL),
+        insert_property_if_absent(NULL), update_property_if(NULL),
+        remove_property_if(NULL), property_exists(NULL),
+        add_permission(NULL), remove_permission(NULL),
+        has_permission(NULL) {}
   ~SQLiteDatabase();
 
   void open();
@@ -31,9 +38,19 @@ class SQLiteDatabase : public Database {
                    const std::string &networkScope = "",
                    const std::string &receiverScope = "",
                    const std::string &senderScope = "");
-  std::vector<std::string> propertyKeys(
-      const std::string &prefix,
-      const std::string &networkScope = "",
+  int64_t incrementProperty(const std::string &variable, int64_t delta,
+                            const std::string &networkScope = "",
+                            const std::string &receiverScope = "",
+                            const std::string &senderScope = "");
+  bool compareAndSetProperty(const std::string &variable,
+                             const std::string &expected,
+                             const std::string &value,
+                             const std::string &networkScope = "",
+                             const std::string &receiverScope = "",
+                             const std::string &senderScope = "");
+  std::vector<std::string> propertyKeyPage(
+      const std::string &prefix, const std::string &after, size_t limit,
+      std::string *next, const std::string &networkScope = "",
       const std::string &receiverScope = "",
       const std::string &senderScope = "");
   bool hasPermission(const std::string &perm_name, const std::string &network,
@@ -46,22 +63,38 @@ class SQLiteDatabase : public Database {
                      const std::string &network,
                      const std::string &receiver = "",
                      const std::string &sender   = "");
+  std::vector<PermissionEntry> permissions();
+  void setProperties(const std::vector<PropertyChange> &changes);
+  std::vector<std::string> properties(
+      const std::vector<std::string> &variables,
+      const std::string &networkScope = "",
+      const std::string &receiverScope = "",
+      const std::string &senderScope = "");
 private:
   // explicitly disable copy constructor
   explicit SQLiteDatabase(const SQLiteDatabase&);
   void operator=(const SQLiteDatabase&);
 
+  void configure();
   void bootstrapDB();
   void upgradeDB();
+  std::string pragma(const std::string &statement) const;
 
   void tryPrepare(const std::string &stmt, sqlite3_stmt **target) const;
   void tryBind(sqlite3_stmt *target, int param, const std::string &value) const;
+  int tryStep(sqlite3_stmt *target) const;
 
   sqlite3 *conn_;
   sqlite3_stmt *find_property;
   sqlite3_stmt *remove_property;
   sqlite3_stmt *update_property;
-  sqlite3_stmt *properties;
+  sqlite3_stmt *property_keys;
+  sqlite3_stmt *property_keys_unbounded;
+  sqlite3_stmt *increment_property;
+  sqlite3_stmt *insert_property_if_absent;
+  sqlite3_stmt *update_property_if;
+  sqlite3_stmt *remove_property_if;
+  sqlite3_stmt *property_exists;
   sqlite3_stmt *add_permission;
   sqlite3_stmt *remove_permission;
   sqlite3_stmt *has_permission;
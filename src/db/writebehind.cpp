@@ -0,0 +1,292 @@
+/**
+ * Copyright (c) 2014 Sjors Gielen, Ruben Nijveld, Aaron van Geffen
+ * See LICENSE for license.
+ */
+
+#include "writebehind.h"
+#include <algorithm>
+#include <iostream>
+
+// times a batch that can't be written at all is kept for the next flush,
+// before its writes are dropped
+#define WRITEBEHIND_MAX_RETRIES 10
+// amount of write batches that may be held back while the database can't
+// be written to; further writes are refused
+#define WRITEBEHIND_MAX_BATCHES 4
+
+namespace dazeus {
+namespace db {
+
+WriteBehindDatabase::WriteBehindDatabase(DatabaseConfig dbc, Database *backend)
+    : Database(dbc), backend_(backend), pending_(), index_(), variables_(),
+      failedFlushes_(0) {}
+
+WriteBehindDatabase::~WriteBehindDatabase()
+{
+  try {
+    flush();
+  } catch (std::exception &e) {
+    std::cerr << "Lost " << pending_.size() << " property writes: "
+              << e.what() << std::endl;
+  }
+  delete backend_;
+}
+
+void WriteBehindDatabase::open()
+{
+  backend_->open();
+}
+
+std::string WriteBehindDatabase::changeKey(const PropertyChange &change)
+{
+  std::string key;
+  key.append(change.variable).append(1, '\0').append(change.network)
+     .append(1, '\0').append(change.receiver).append(1, '\0')
+     .append(change.sender);
+  return key;
+}
+
+/**
+ * @brief Add a write to the held back writes, replacing an earlier one.
+ */
+void WriteBehindDatabase::hold(const PropertyChange &change)
+{
+  std::string key = changeKey(change);
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    pending_[it->second].value = change.value;
+    return;
+  }
+
+  index_[key] = pending_.size();
+  ++variables_[change.variable];
+  pending_.push_back(change);
+}
+
+/**
+ * @brief Write all held back writes to the database.
+ *
+ * The writes are written in one batch. If that fails, they are written one
+ * at a time, so a write the database refuses can't hold back the others:
+ * it is dropped, and its error is thrown once the others are written.
+ *
+ * If none of them can be written, the database is assumed to be
+ * unavailable, and they stay held back for the next flush. They are
+ * dropped as well after WRITEBEHIND_MAX_RETRIES flushes in a row failed.
+ */
+void WriteBehindDatabase::flush()
+{
+  write(NULL);
+}
+
+/**
+ * @brief Flush, as flush() does, and add the keys of dropped writes to
+ * dropped if it is given.
+ */
+void WriteBehindDatabase::write(std::unordered_set<std::string> *dropped)
+{
+  if (pending_.empty()) {
+    return;
+  }
+
+  try {
+    backend_->setProperties(pending_);
+    failedFlushes_ = 0;
+    clear();
+    return;
+  } catch (std::exception &) {
+    // find out which of them fail
+  }
+
+  std::vector<PropertyChange> failed;
+  std::string error;
+  for (auto it = pending_.begin(); it != pending_.end(); ++it) {
+    try {
+      backend_->setProperty(it->variable, it->value, it->network,
+                            it->receiver, it->sender);
+    } catch (std::exception &e) {
+      failed.push_back(*it);
+      error = e.what();
+    }
+  }
+
+  if (failed.size() == pending_.size() &&
+      ++failedFlushes_ < WRITEBEHIND_MAX_RETRIES) {
+    throw exception("Failed to write " + std::to_string(pending_.size()) +
+                    " held back property writes, will retry: " + error);
+  }
+
+  failedFlushes_ = 0;
+  clear();
+  if (failed.empty()) {
+    return;
+  }
+  if (dropped) {
+    for (auto it = failed.begin(); it != failed.end(); ++it) {
+      dropped->insert(changeKey(*it));
+    }
+  }
+  throw exception("Dropped " + std::to_string(failed.size()) +
+                  " property writes: " + error);
+}
+
+void WriteBehindDatabase::clear()
+{
+  pending_.clear();
+  index_.clear();
+  variables_.clear();
+}
+
+/**
+ * @brief Flush before a lookup that could see held back writes.
+ *
+ * The lookup only fails if writes are still held back; dropped writes are
+ * reported, but the lookup can go ahead without them.
+ */
+void WriteBehindDatabase::flushForLookup()
+{
+  try {
+    flush();
+  } catch (std::exception &e) {
+    if (!pending_.empty()) {
+      throw;
+    }
+    std::cerr << e.what() << std::endl;
+  }
+}
+
+std::string WriteBehindDatabase::property(const std::string &variable,
+                                          const std::string &networkScope,
+                                          const std::string &receiverScope,
+                                          const std::string &senderScope)
+{
+  if (variables_.count(variable)) {
+    flushForLookup();
+  }
+  return backend_->property(variable, networkScope, receiverScope,
+                            senderScope);
+}
+
+std::vector<std::string> WriteBehindDatabase::properties(
+    const std::vector<std::string> &variables,
+    const std::string &networkScope, const std::string &receiverScope,
+    const std::string &senderScope)
+{
+  for (auto it = variables.begin(); it != variables.end(); ++it) {
+    if (variables_.count(*it)) {
+      flushForLookup();
+      break;
+    }
+  }
+  return backend_->properties(variables, networkScope, receiverScope,
+                              senderScope);
+}
+
+void WriteBehindDatabase::setProperty(const std::string &variable,
+    const std::string &value, const std::string &networkScope,
+    const std::string &receiverScope,
+    const std::string &senderScope)
+{
+  PropertyChange change;
+  change.variable = variable;
+  change.value = value;
+  change.network = networkScope;
+  change.receiver = receiverScope;
+  change.sender = senderScope;
+
+  // While the database can't be written to, flushing is left to the next
+  // flush() call, and a limited amount of writes is held back until then.
+  if (failedFlushes_ > 0) {
+    size_t limit = WRITEBEHIND_MAX_BATCHES *
+                   std::max<size_t>(dbc_.write_batch, 1);
+    if (pending_.size() >= limit && index_.count(changeKey(change)) == 0) {
+      throw exception("Too many property writes held back while the "
+                      "database can't be written to");
+    }
+    hold(change);
+    return;
+  }
+
+  hold(change);
+  if (pending_.size() >= dbc_.write_batch) {
+    std::unordered_set<std::string> dropped;
+    try {
+      write(&dropped);
+    } catch (exception &e) {
+      // this write only failed if it was dropped; otherwise it was written,
+      // or is still held back for the next flush
+      if (dropped.count(changeKey(change))) {
+        throw;
+      }
+      std::cerr << e.what() << std::endl;
+    }
+  }
+}
+
+int64_t WriteBehindDatabase::incrementProperty(const std::string &variable,
+    int64_t delta, const std::string &networkScope,
+    const std::string &receiverScope, const std::string &senderScope)
+{
+  if (variables_.count(variable)) {
+    flushForLookup();
+  }
+  return backend_->incrementProperty(variable, delta, networkScope,
+                                     receiverScope, senderScope);
+}
+
+bool WriteBehindDatabase::compareAndSetProperty(const std::string &variable,
+    const std::string &expected, const std::string &value,
+    const std::string &networkScope, const std::string &receiverScope,
+    const std::string &senderScope)
+{
+  if (variables_.count(variable)) {
+    flushForLookup();
+  }
+  return backend_->compareAndSetProperty(variable, expected, value,
+      networkScope, receiverScope, senderScope);
+}
+
+std::vector<std::string> WriteBehindDatabase::propertyKeyPage(
+      const std::string &prefix, const std::string &after, size_t limit,
+      std::string *next, const std::string &networkScope,
+      const std::string &receiverScope, const std::string &senderScope)
+{
+  for (auto it = variables_.begin(); it != variables_.end(); ++it) {
+    if (it->first.compare(0, prefix.length(), prefix) == 0) {
+      flushForLookup();
+      break;
+    }
+  }
+  return backend_->propertyKeyPage(prefix, after, limit, next, networkScope,
+                                   receiverScope, senderScope);
+}
+
+bool WriteBehindDatabase::hasPermission(const std::string &perm_name,
+      const std::string &network, const std::string &channel,
+      const std::string &sender, bool defaultPermission) const
+{
+  return backend_->hasPermission(perm_name, network, channel, sender,
+                                 defaultPermission);
+}
+
+void WriteBehindDatabase::unsetPermission(const std::string &perm_name,
+      const std::string &network, const std::string &receiver,
+      const std::string &sender)
+{
+  backend_->unsetPermission(perm_name, network, receiver, sender);
+}
+
+void WriteBehindDatabase::setPermission(bool permission, const std::string &perm_name,
+      const std::string &network, const std::string &receiver,
+      const std::string &sender)
+{
+  backend_->setPermission(permission, perm_name, network, receiver, sender);
+}
+
+std::vector<PermissionEntry> WriteBehindDatabase::permissions()
+{
+  return backend_->permissions();
+}
+
+}  // namespace db
+}  // namespace dazeus
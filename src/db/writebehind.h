@@ -0,0 +1,109 @@
+/**
+ * Copyright (c) 2014 Sjors Gielen, Ruben Nijveld, Aaron van Geffen
+ * See LICENSE for license.
+ */
+
+#ifndef DB_WRITEBEHIND_H_
+#define DB_WRITEBEHIND_H_
+
+#include <stddef.h>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "database.h"
+
+namespace dazeus {
+namespace db {
+
+/**
+ * @class WriteBehindDatabase
+ * @brief Holds back property writes to another database, and writes them
+ * together.
+ *
+ * Property writes are collected in memory, where a write replaces any held
+ * back write of the same property in the same scope. They are written to
+ * the wrapped database in one go when flush() is called, or when the write
+ * batch size of the database configuration is reached. Calling flush() when
+ * the write window has passed is up to the user of the database; the
+ * destructor flushes as well. Writes the database refuses are dropped, so
+ * they can't hold back the others; writes that fail because the database
+ * is unavailable are held back for a few more flushes.
+ *
+ * Lookups and atomic changes of a variable with held back writes, and key
+ * listings that could include one, flush first, so the held back writes are
+ * always visible.
+ */
+class WriteBehindDatabase : public Database {
+ public:
+  WriteBehindDatabase(DatabaseConfig dbc, Database *backend);
+  ~WriteBehindDatabase();
+
+  void open();
+  std::string property(const std::string &variable,
+                       const std::string &networkScope = "",
+                       const std::string &receiverScope = "",
+                       const std::string &senderScope = "");
+  void setProperty(const std::string &variable, const std::string &value,
+                   const std::string &networkScope = "",
+                   const std::string &receiverScope = "",
+                   const std::string &senderScope = "");
+  int64_t incrementProperty(const std::string &variable, int64_t delta,
+                            const std::string &networkScope = "",
+                            const std::string &receiverScope = "",
+                            const std::string &senderScope = "");
+  bool compareAndSetProperty(const std::string &variable,
+                             const std::string &expected,
+                             const std::string &value,
+                             const std::string &networkScope = "",
+                             const std::string &receiverScope = "",
+                             const std::string &senderScope = "");
+  std::vector<std::string> propertyKeyPage(
+      const std::string &prefix, const std::string &after, size_t limit,
+      std::string *next, const std::string &networkScope = "",
+      const std::string &receiverScope = "",
+      const std::string &senderScope = "");
+  bool hasPermission(const std::string &perm_name, const std::string &network,
+                     const std::string &channel, const std::string &sender,
+                     bool defaultPermission) const;
+  void unsetPermission(const std::string &perm_name, const std::string &network,
+                       const std::string &receiver = "",
+                       const std::string &sender = "");
+  void setPermission(bool permission, const std::string &perm_name,
+                     const std::string &network,
+                     const std::string &receiver = "",
+                     const std::string &sender   = "");
+  std::vector<PermissionEntry> permissions();
+  std::vector<std::string> properties(
+      const std::vector<std::string> &variables,
+      const std::string &networkScope = "",
+      const std::string &receiverScope = "",
+      const std::string &senderScope = "");
+  void flush();
+
+ private:
+  // explicitly disable copy constructor
+  explicit WriteBehindDatabase(const WriteBehindDatabase&);
+  void operator=(const WriteBehindDatabase&);
+
+  static std::string changeKey(const PropertyChange &change);
+  void hold(const PropertyChange &change);
+  void write(std::unordered_set<std::string> *dropped);
+  void clear();
+  void flushForLookup();
+
+  Database *backend_;
+  std::vector<PropertyChange> pending_;
+  // position of every held back property in pending_
+  std::unordered_map<std::string, size_t> index_;
+  // amount of held back writes per variable
+  std::unordered_map<std::string, size_t> variables_;
+  // flushes in a row that could write none of the held back writes
+  unsigned failedFlushes_;
+};
+
+}  // namespace db
+}  // namespace dazeus
+
+#endif  // DB_WRITEBEHIND_H_
@@ -0,0 +1,47 @@
+/**
+ * Copyright (c) Sjors Gielen, 2014
+ * See LICENSE for license.
+ */
+
+#include "events.h"
+#include "namehash.h"
+#include <assert.h>
+#include <string.h>
+#include <strings.h>
+
+#define DAZEUS_EVENT_NAME(name) #name,
+static const char *event_names[] = {
+	DAZEUS_EVENTS(DAZEUS_EVENT_NAME)
+};
+#undef DAZEUS_EVENT_NAME
+
+static_assert(sizeof(event_names) / sizeof(event_names[0]) == dazeus::EVENT_COUNT,
+	"every event needs a name");
+
+/**
+ * @brief Returns the event with the given (case-insensitive) name, or
+ * EVENT_INVALID if there is no such event.
+ */
+dazeus::EventId dazeus::eventFromName(const char *name, size_t length) {
+	EventId event;
+	// The hash is perfect for the known events: the compiler rejects
+	// duplicate case labels.
+#define DAZEUS_EVENT_CASE(ev) case nameHash(#ev): event = EVENT_##ev; break;
+	switch(nameHash(name, length)) {
+	DAZEUS_EVENTS(DAZEUS_EVENT_CASE)
+	default: return EVENT_INVALID;
+	}
+#undef DAZEUS_EVENT_CASE
+
+	// Unknown names may share their hash with a known event
+	const char *known = event_names[event];
+	if(strlen(known) != length || strncasecmp(known, name, length) != 0) {
+		return EVENT_INVALID;
+	}
+	return event;
+}
+
+const char *dazeus::eventName(EventId event) {
+	assert(event >= 0 && event < EVENT_COUNT);
+	return event_names[event];
+}
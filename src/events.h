@@ -0,0 +1,39 @@
+/**
+ * Copyright (c) Sjors Gielen, 2014
+ * See LICENSE for license.
+ */
+
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stddef.h>
+#include <string>
+
+namespace dazeus {
+
+// All events DaZeus knows about: the events sent to plugins, followed by the
+// alternative names libdazeus-irc uses for some of them.
+#define DAZEUS_EVENTS(X) \
+  X(CONNECT) X(DISCONNECT) X(JOIN) X(PART) X(QUIT) X(NICK) X(MODE) \
+  X(TOPIC) X(INVITE) X(KICK) X(PRIVMSG) X(NOTICE) X(CTCP) X(CTCP_REP) \
+  X(ACTION) X(NUMERIC) X(UNKNOWN) X(WHOIS) X(NAMES) X(PRIVMSG_ME) \
+  X(NOTICE_ME) X(CTCP_ME) X(CTCP_REP_ME) X(ACTION_ME) X(PONG) X(COMMAND) \
+  X(UMODE) X(CTCP_REQ) X(CTCP_ACTION)
+
+#define DAZEUS_EVENT_ENUM(name) EVENT_##name,
+enum EventId {
+  EVENT_INVALID = -1,
+  DAZEUS_EVENTS(DAZEUS_EVENT_ENUM)
+  EVENT_COUNT
+};
+#undef DAZEUS_EVENT_ENUM
+
+EventId     eventFromName(const char *name, size_t length);
+inline EventId eventFromName(const std::string &name) {
+  return eventFromName(name.c_str(), name.length());
+}
+const char *eventName(EventId event);
+
+}
+
+#endif
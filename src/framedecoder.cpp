@@ -0,0 +1,172 @@
+/**
+ * Copyright (c) Sjors Gielen, 2014
+ * See LICENSE for license.
+ */
+
+#include "framedecoder.h"
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+
+// room for a size prefix and the bytes between frames, on top of a frame of
+// the largest size
+#define FRAME_PREFIX_ROOM 64
+
+dazeus::FrameDecoder::FrameDecoder(size_t initialCapacity)
+: buffer_(initialCapacity > 0 ? initialCapacity : 1)
+, head_(0)
+, size_(0)
+, frameSize_(0)
+, prefix_(0)
+, havePrefix_(false)
+{
+}
+
+/**
+ * @brief Grow the buffer to at least the given capacity.
+ *
+ * Buffered data is moved to the front of the new buffer.
+ */
+void dazeus::FrameDecoder::grow(size_t minimumCapacity) {
+	size_t capacity = buffer_.size() * 2;
+	while(capacity < minimumCapacity) {
+		capacity *= 2;
+	}
+
+	std::vector<char> buffer(capacity);
+	size_t first = std::min(size_, buffer_.size() - head_);
+	memcpy(&buffer[0], &buffer_[head_], first);
+	memcpy(&buffer[first], &buffer_[0], size_ - first);
+	buffer_.swap(buffer);
+	head_ = 0;
+}
+
+/**
+ * @brief Move the buffered data to the front of the buffer.
+ */
+void dazeus::FrameDecoder::linearize() {
+	std::rotate(buffer_.begin(), buffer_.begin() + head_, buffer_.end());
+	head_ = 0;
+}
+
+/**
+ * @brief Read all available data from a non-blocking descriptor.
+ *
+ * Data is read directly into the free space of the buffer, which is grown
+ * as long as the descriptor keeps filling it. Reading stops once more than
+ * a frame of the largest size is buffered, so a plugin can't keep us
+ * reading; the frames must be taken out with nextFrame(), after which the
+ * rest can be read.
+ */
+dazeus::FrameDecoder::ReadResult dazeus::FrameDecoder::readFrom(int fd) {
+	while(1) {
+		size_t limit = MaxFrameSize + FRAME_PREFIX_ROOM;
+		if(size_ >= limit) {
+			return ReadOk;
+		}
+		if(size_ == buffer_.size()) {
+			grow(buffer_.size() + 1);
+		}
+
+		size_t capacity = buffer_.size();
+		size_t tail = (head_ + size_) % capacity;
+		size_t space = std::min(capacity, limit) - size_;
+
+		struct iovec iov[2];
+		int iovcnt = 1;
+		iov[0].iov_base = &buffer_[tail];
+		if(tail >= head_) {
+			// free space wraps around the end of the buffer
+			iov[0].iov_len = capacity - tail;
+			if(head_ > 0) {
+				iov[1].iov_base = &buffer_[0];
+				iov[1].iov_len = head_;
+				iovcnt = 2;
+			}
+		} else {
+			iov[0].iov_len = head_ - tail;
+		}
+		// don't read past the limit
+		if(iov[0].iov_len >= space) {
+			iov[0].iov_len = space;
+			iovcnt = 1;
+		} else if(iovcnt == 2) {
+			iov[1].iov_len = std::min(iov[1].iov_len, space - iov[0].iov_len);
+		}
+
+		ssize_t r = readv(fd, iov, iovcnt);
+		if(r == 0) {
+			return ReadEof;
+		} else if(r < 0) {
+			if(errno == EINTR) {
+				continue;
+			} else if(errno == EWOULDBLOCK || errno == EAGAIN) {
+				return ReadOk;
+			}
+			return ReadError;
+		}
+
+		size_ += r;
+		if((size_t)r < space) {
+			// the descriptor had less to offer than we had room for
+			return ReadOk;
+		}
+	}
+}
+
+/**
+ * @brief Cut the next complete frame from the buffer.
+ *
+ * If a frame is available, data and length are set to the JSON part of it.
+ * The frame stays valid until the next call to readFrom() or nextFrame().
+ */
+dazeus::FrameDecoder::FrameResult dazeus::FrameDecoder::nextFrame(const char **data, size_t *length) {
+	size_t capacity = buffer_.size();
+
+	while(frameSize_ == 0) {
+		if(size_ == 0) {
+			head_ = 0;
+			return FrameNeeded;
+		}
+
+		char c = buffer_[head_];
+		if(c == '{') {
+			// the opening brace is the first byte of the frame
+			if(!havePrefix_ || prefix_ == 0) {
+				return FrameInvalid;
+			}
+			frameSize_ = prefix_;
+			prefix_ = 0;
+			havePrefix_ = false;
+			break;
+		} else if(c >= '0' && c <= '9') {
+			prefix_ = prefix_ * 10 + (c - '0');
+			if(prefix_ > MaxFrameSize) {
+				return FrameInvalid;
+			}
+			havePrefix_ = true;
+		}
+		// other bytes outside of a frame, such as newlines, are ignored
+
+		head_ = (head_ + 1) % capacity;
+		--size_;
+	}
+
+	if(size_ < frameSize_) {
+		// readFrom() grows the buffer as the rest of the frame comes in
+		return FrameNeeded;
+	}
+
+	if(head_ + frameSize_ > capacity) {
+		linearize();
+	}
+
+	*data = &buffer_[head_];
+	*length = frameSize_;
+	head_ = (head_ + frameSize_) % capacity;
+	size_ -= frameSize_;
+	frameSize_ = 0;
+	return FrameReady;
+}
@@ -0,0 +1,70 @@
+/**
+ * Copyright (c) Sjors Gielen, 2014
+ * See LICENSE for license.
+ */
+
+#ifndef FRAMEDECODER_H
+#define FRAMEDECODER_H
+
+#include <stddef.h>
+#include <vector>
+
+namespace dazeus {
+
+/**
+ * @class FrameDecoder
+ * @brief Incremental decoder for the framing of the plugin protocol.
+ *
+ * Incoming data is read straight into the free space of a growable ring
+ * buffer. Frames, which look like <tt>[size in ASCII][JSON data of given
+ * size]</tt>, are cut from it without copying: the size prefix is parsed in
+ * place as bytes come in, and a complete frame is returned as a pointer into
+ * the buffer. Only when a frame wraps around the end of the buffer, the
+ * buffered data is moved to the front to make it contiguous; this happens at
+ * most once per buffer length of data, so decoding is linear in the amount
+ * of data received.
+ *
+ * The buffer only grows as data comes in, never for the size a prefix
+ * claims; frames larger than MaxFrameSize are rejected as invalid.
+ */
+class FrameDecoder
+{
+  public:
+    enum ReadResult {
+      ReadOk,      // everything available has been read
+      ReadEof,     // the other side closed the connection
+      ReadError    // reading failed, errno is set
+    };
+
+    enum FrameResult {
+      FrameReady,  // a frame was returned
+      FrameNeeded, // more data is needed for the next frame
+      FrameInvalid // the data is not a valid frame
+    };
+
+    // largest frame a plugin may send
+    static const size_t MaxFrameSize = 16 * 1024 * 1024;
+
+    FrameDecoder(size_t initialCapacity = 4096);
+
+    ReadResult  readFrom(int fd);
+    FrameResult nextFrame(const char **data, size_t *length);
+    size_t      buffered() const { return size_; }
+
+  private:
+    void grow(size_t minimumCapacity);
+    void linearize();
+
+    std::vector<char> buffer_;
+    size_t head_;
+    size_t size_;
+    // size of the frame being waited for, or 0 while parsing its size
+    size_t frameSize_;
+    // size digits parsed so far
+    size_t prefix_;
+    bool   havePrefix_;
+};
+
+}
+
+#endif
@@ -9,6 +9,14 @@ JSON::JSON(std::string j, size_t f) {
 	}
 }
 
+JSON::JSON(const char *data, size_t length, size_t f) {
+	json_error_t error;
+	json = json_loadb(data, length, f, &error);
+	if(!json) {
+		throw std::runtime_error("Failed to load JSON: " + std::string(error.text));
+	}
+}
+
 JSON::JSON(json_t *t) : json(t) {}
 
 JSON::JSON(JSON const &o) : json(nullptr) {
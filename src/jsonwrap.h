@@ -5,6 +5,7 @@
 
 struct JSON {
 	JSON(std::string j, size_t f);
+	JSON(const char *data, size_t length, size_t f);
 	JSON(json_t *t);
 	JSON();
 
@@ -11,34 +11,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <signal.h>
-#include <assert.h>
 
 void usage(char*);
 
-dazeus::DaZeus *d = NULL;
-
-void sigchild_handler(int sig);
-void sigchild_handler(int sig) {
-	assert(sig == SIGCHLD);
-	assert(d != NULL);
-	d->sigchild();
-
-	if(signal(sig, sigchild_handler) == SIG_ERR) {
-		perror("Failed to install SIGCHLD handler");
-	}
-}
-
-void sighup_handler(int sig);
-void sighup_handler(int sig) {
-	assert(sig == SIGHUP);
-	assert(d != NULL);
-	d->reloadConfig();
-
-	if(signal(sig, sighup_handler) == SIG_ERR) {
-		perror("Failed to install SIGHUP handler");
-	}
-}
-
 int main(int argc, char *argv[])
 {
 	fprintf(stderr, "DaZeus version: %s\n", DAZEUS_VERSION);
@@ -71,18 +46,12 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if(signal(SIGCHLD, sigchild_handler) == SIG_ERR) {
-		perror("Failed to install SIGCHLD handler");
-	}
-	if(signal(SIGHUP, sighup_handler) == SIG_ERR) {
-		perror("Failed to install SIGHUP handler");
-	}
-
 	if(signal(SIGPIPE, SIG_IGN)) {
 		perror("Failed to set SIGPIPE ignore");
 	}
 
-	d = new dazeus::DaZeus(configfile);
+	// SIGCHLD and SIGHUP are handled by DaZeus from its event loop
+	dazeus::DaZeus *d = new dazeus::DaZeus(configfile);
 	d->run();
 	delete d;
 	return 0;
@@ -0,0 +1,39 @@
+/**
+ * Copyright (c) Sjors Gielen, 2014
+ * See LICENSE for license.
+ */
+
+#ifndef NAMEHASH_H
+#define NAMEHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace dazeus {
+
+/**
+ * @brief Case-insensitive FNV-1a hash of a name.
+ *
+ * Because it can be evaluated at compile time, it can be used in case labels;
+ * the compiler then rejects the switch if two names would collide.
+ */
+constexpr uint32_t nameHash(const char *name, size_t length) {
+  uint32_t hash = 2166136261u;
+  for(size_t i = 0; i < length; ++i) {
+    char c = name[i];
+    if(c >= 'a' && c <= 'z') {
+      c -= 'a' - 'A';
+    }
+    hash = (hash ^ (uint8_t)c) * 16777619u;
+  }
+  return hash;
+}
+
+template <size_t N>
+constexpr uint32_t nameHash(const char (&name)[N]) {
+  return nameHash(name, N - 1);
+}
+
+}
+
+#endif
@@ -0,0 +1,116 @@
+/**
+ * Copyright (c) Sjors Gielen, 2014
+ * See LICENSE for license.
+ */
+
+#include "networkwatch.h"
+#include "network.h"
+#include <sys/select.h>
+
+// seconds between checks of the connection and ping timeouts of a network
+#define NETWORK_TIMEOUT_INTERVAL 10
+
+dazeus::NetworkWatch::NetworkWatch(Reactor *reactor, Network *network)
+: reactor_(reactor)
+, network_(network)
+, fd_(-1)
+, events_(0)
+, serial_(0)
+, timer_(0)
+{
+	reactor_->addSource(this);
+}
+
+dazeus::NetworkWatch::~NetworkWatch() {
+	unregister();
+	reactor_->cancelTimer(timer_);
+	reactor_->removeSource(this);
+}
+
+void dazeus::NetworkWatch::unregister() {
+	if(fd_ >= 0 && reactor_->isRegistered(fd_, serial_)) {
+		reactor_->remove(fd_);
+	}
+	fd_ = -1;
+	events_ = 0;
+	serial_ = 0;
+}
+
+void dazeus::NetworkWatch::prepare() {
+	if(!network_->activeServer()) {
+		unregister();
+		return;
+	}
+
+	if(timer_ == 0) {
+		timer_ = reactor_->addTimer(Reactor::Clock::now() + std::chrono::seconds(NETWORK_TIMEOUT_INTERVAL),
+			[this]() { checkTimeouts(); });
+	}
+
+	fd_set in_set, out_set;
+	FD_ZERO(&in_set);
+	FD_ZERO(&out_set);
+	int fd = -1;
+	network_->addDescriptors(&in_set, &out_set, &fd);
+	if(fd < 0) {
+		// not connected (yet)
+		unregister();
+		return;
+	}
+
+	uint32_t events = 0;
+	if(FD_ISSET(fd, &in_set)) {
+		events |= EPOLLIN;
+	}
+	if(FD_ISSET(fd, &out_set)) {
+		events |= EPOLLOUT;
+	}
+
+	if(fd != fd_ || !reactor_->isRegistered(fd_, serial_)) {
+		unregister();
+		serial_ = reactor_->add(fd, events, [this](uint32_t ready) {
+			this->ready(ready);
+		});
+		if(serial_ != 0) {
+			fd_ = fd;
+			events_ = events;
+		}
+	} else if(events != events_) {
+		reactor_->modify(fd_, events);
+		events_ = events;
+	}
+}
+
+void dazeus::NetworkWatch::ready(uint32_t events) {
+	if(!network_->activeServer()) {
+		return;
+	}
+
+	// Errors and hangups are noticed by the Network when it tries to use
+	// the descriptor for whatever it was waiting for.
+	bool failed = (events & (EPOLLERR | EPOLLHUP)) != 0;
+	fd_set in_set, out_set;
+	FD_ZERO(&in_set);
+	FD_ZERO(&out_set);
+	if((events & EPOLLIN) || (failed && (events_ & EPOLLIN))) {
+		FD_SET(fd_, &in_set);
+	}
+	if((events & EPOLLOUT) || (failed && (events_ & EPOLLOUT))) {
+		FD_SET(fd_, &out_set);
+	}
+	if(failed && events_ == 0) {
+		FD_SET(fd_, &in_set);
+	}
+	network_->processDescriptors(&in_set, &out_set);
+}
+
+/**
+ * @brief Let the Network check its timeouts; the timer is set again by
+ * prepare() as long as the Network has a server.
+ */
+void dazeus::NetworkWatch::checkTimeouts() {
+	timer_ = 0;
+	if(network_->activeServer()) {
+		network_->checkTimeouts();
+	}
+}
@@ -0,0 +1,57 @@
+/**
+ * Copyright (c) Sjors Gielen, 2014
+ * See LICENSE for license.
+ */
+
+#ifndef NETWORKWATCH_H
+#define NETWORKWATCH_H
+
+#include <stdint.h>
+#include "reactor.h"
+
+namespace dazeus {
+
+class Network;
+
+/**
+ * @class NetworkWatch
+ * @brief Registers the descriptors of an IRC Network with the Reactor.
+ *
+ * libdazeus-irc only exposes its connection through select()-style descriptor
+ * sets, and the events it is interested in change as its output buffer fills
+ * and drains. Before every wait, this class asks the Network which events it
+ * wants and updates its registration if they changed; when the descriptor is
+ * ready, the Network processes it as if select() had returned it.
+ *
+ * The Network keeps its own connection and ping deadlines, and doesn't say
+ * when the next one is; while it has a server, a timer lets it check them
+ * every NETWORK_TIMEOUT_INTERVAL seconds.
+ */
+class NetworkWatch : public Reactor::Source
+{
+  public:
+          NetworkWatch(Reactor *reactor, Network *network);
+         ~NetworkWatch();
+
+    void  prepare();
+
+  private:
+    // explicitly disable copy constructor
+    NetworkWatch(const NetworkWatch&);
+    void operator=(const NetworkWatch&);
+
+    void  ready(uint32_t events);
+    void  unregister();
+    void  checkTimeouts();
+
+    Reactor *reactor_;
+    Network *network_;
+    int      fd_;
+    uint32_t events_;
+    unsigned serial_;
+    unsigned timer_;
+};
+
+}
+
+#endif
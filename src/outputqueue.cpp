@@ -0,0 +1,71 @@
+/**
+ * Copyright (c) Sjors Gielen, 2014
+ * See LICENSE for license.
+ */
+
+#include "outputqueue.h"
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+
+// maximum amount of frames written in one writev() call
+#define OUTPUTQUEUE_MAX_IOV 64
+
+/**
+ * @brief Encode a JSON value into a protocol frame.
+ */
+dazeus::OutputQueue::Frame dazeus::OutputQueue::encode(json_t *json) {
+	char *raw_json = json_dumps(json, 0);
+	size_t length = strlen(raw_json);
+	std::string size = std::to_string(length);
+
+	std::string *frame = new std::string();
+	frame->reserve(size.length() + length + 1);
+	frame->append(size);
+	frame->append(raw_json, length);
+	frame->append(1, '\n');
+	free(raw_json);
+	return Frame(frame);
+}
+
+/**
+ * @brief Write as many queued frames to a non-blocking descriptor as it
+ * accepts.
+ */
+dazeus::OutputQueue::FlushResult dazeus::OutputQueue::flushTo(int fd) {
+	while(!frames_.empty()) {
+		struct iovec iov[OUTPUTQUEUE_MAX_IOV];
+		int iovcnt = 0;
+		for(auto it = frames_.begin(); it != frames_.end() && iovcnt < OUTPUTQUEUE_MAX_IOV; ++it) {
+			size_t skip = iovcnt == 0 ? offset_ : 0;
+			iov[iovcnt].iov_base = const_cast<char*>((*it)->data() + skip);
+			iov[iovcnt].iov_len = (*it)->length() - skip;
+			++iovcnt;
+		}
+
+		ssize_t written = writev(fd, iov, iovcnt);
+		if(written < 0) {
+			if(errno == EINTR) {
+				continue;
+			} else if(errno == EWOULDBLOCK || errno == EAGAIN) {
+				return FlushBlocked;
+			}
+			return FlushError;
+		}
+
+		size_t left = written;
+		while(left > 0) {
+			size_t remaining = frames_.front()->length() - offset_;
+			if(left < remaining) {
+				offset_ += left;
+				break;
+			}
+			left -= remaining;
+			frames_.pop_front();
+			offset_ = 0;
+		}
+	}
+	return FlushDone;
+}
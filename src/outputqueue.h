@@ -0,0 +1,52 @@
+/**
+ * Copyright (c) Sjors Gielen, 2014
+ * See LICENSE for license.
+ */
+
+#ifndef OUTPUTQUEUE_H
+#define OUTPUTQUEUE_H
+
+#include <stddef.h>
+#include <deque>
+#include <memory>
+#include <string>
+#include <jansson.h>
+
+namespace dazeus {
+
+/**
+ * @class OutputQueue
+ * @brief Queue of encoded frames waiting to be written to a plugin socket.
+ *
+ * Frames are immutable and reference-counted, so an event that goes to many
+ * plugins is encoded once and shared by the queues of all of them. Queued
+ * frames are written with as few writev() calls as possible.
+ */
+class OutputQueue
+{
+  public:
+    typedef std::shared_ptr<const std::string> Frame;
+
+    enum FlushResult {
+      FlushDone,    // the queue is empty
+      FlushBlocked, // the socket doesn't accept more data right now
+      FlushError    // writing failed, errno is set
+    };
+
+    OutputQueue() : frames_(), offset_(0) {}
+
+    static Frame encode(json_t *json);
+
+    void        push(const Frame &frame) { frames_.push_back(frame); }
+    bool        empty() const { return frames_.empty(); }
+    FlushResult flushTo(int fd);
+
+  private:
+    std::deque<Frame> frames_;
+    // bytes of the first frame that were already written
+    size_t offset_;
+};
+
+}
+
+#endif
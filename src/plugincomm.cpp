@@ -9,7 +9,6 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/uio.h>
-#include <sys/select.h>
 #include <netinet/ip.h>
 #include <netdb.h>
 #include <string.h>
@@ -21,7 +20,6 @@
 #include <errno.h>
 #include <time.h>
 #include <ctype.h>
-#include <poll.h>
 #include <limits.h>
 
 #include <string>
@@ -44,115 +42,54 @@ static std::string realpath(std::string path) {
 
 #define NOTBLOCKING(x) fcntl(x, F_SETFL, fcntl(x, F_GETFL) | O_NONBLOCK)
 
-dazeus::PluginComm::PluginComm(db::Database *d, ConfigReaderPtr c, DaZeus *bot)
+dazeus::PluginComm::PluginComm(db::Database *d, ConfigReaderPtr c, DaZeus *bot, Reactor *reactor)
 : NetworkListener()
 , tcpServers_()
 , localServers_()
-, commandQueue_()
 , sockets_()
-, database_(d)
+, subscriptions_()
+, commands_()
+, whois_()
+, whoisTimer_(0)
+, whoisDeadline_()
 , config_(c)
 , dazeus_(bot)
+, reactor_(reactor)
+, actions_()
+, parser_()
+, worker_(reactor, d)
 {
+	registerActions();
+	worker_.setFlushInterval(std::chrono::milliseconds(config_->getDatabaseConfig().write_window));
 }
 
 dazeus::PluginComm::~PluginComm() {
+	reactor_->cancelTimer(whoisTimer_);
 	std::map<int,SocketInfo>::iterator it;
 	for(it = sockets_.begin(); it != sockets_.end(); ++it) {
+		reactor_->remove(it->first);
 		close(it->first);
 	}
 	std::vector<int>::iterator it2;
 	for(it2 = tcpServers_.begin(); it2 != tcpServers_.end(); ++it2) {
+		reactor_->remove(*it2);
 		close(*it2);
 	}
 	for(it2 = localServers_.begin(); it2 != localServers_.end(); ++it2) {
+		reactor_->remove(*it2);
 		close(*it2);
 	}
 }
 
-void dazeus::PluginComm::run(int timeout_sec) {
-	fd_set sockets, out_sockets;
-	int highest = 0;
-	struct timeval timeout;
-	FD_ZERO(&sockets);
-	FD_ZERO(&out_sockets);
-	std::vector<int>::iterator it;
-	for(it = tcpServers_.begin(); it != tcpServers_.end(); ++it) {
-		if(*it > highest)
-			highest = *it;
-		FD_SET(*it, &sockets);
-	}
-	for(it = localServers_.begin(); it != localServers_.end(); ++it) {
-		if(*it > highest)
-			highest = *it;
-		FD_SET(*it, &sockets);
-	}
-	std::map<int,SocketInfo>::iterator it2;
-	for(it2 = sockets_.begin(); it2 != sockets_.end(); ++it2) {
-		if(it2->first > highest)
-			highest = it2->first;
-		FD_SET(it2->first, &sockets);
-		if(!it2->second.writebuffer.empty()) {
-			FD_SET(it2->first, &out_sockets);
-		}
-	}
-	// and add the IRC descriptors
-	for(auto nit = dazeus_->networks().begin(); nit != dazeus_->networks().end(); ++nit) {
-		if(nit->second->activeServer()) {
-			int ircmaxfd = 0;
-			nit->second->addDescriptors(&sockets, &out_sockets, &ircmaxfd);
-			if(ircmaxfd > highest)
-				highest = ircmaxfd;
-		}
-	}
-	timeout.tv_sec = timeout_sec;
-	timeout.tv_usec = 0;
-	int socks = select(highest + 1, &sockets, &out_sockets, NULL, &timeout);
-	if(socks < 0) {
-		if(errno != EINTR) {
-			fprintf(stderr, "select() failed: %s\n", strerror(errno));
-		}
-
-		if(errno == EBADF) {
-			// hopefully it was a regular plugin socket that went bad
-			// then poll() will notice it
-			poll();
-		}
-		return;
-	}
-	else if(socks == 0) {
-		// No sockets fired, just check for network timeouts
-		for(auto nit = dazeus_->networks().begin(); nit != dazeus_->networks().end(); ++nit) {
-			if(nit->second->activeServer()) {
-				nit->second->checkTimeouts();
-			}
-		}
-		return;
-	}
-	for(it = tcpServers_.begin(); it != tcpServers_.end(); ++it) {
-		if(FD_ISSET(*it, &sockets)) {
-			newTcpConnection();
-			break;
-		}
-	}
-	for(it = localServers_.begin(); it != localServers_.end(); ++it) {
-		if(FD_ISSET(*it, &sockets)) {
-			newLocalConnection();
-			break;
-		}
-	}
-	for(it2 = sockets_.begin(); it2 != sockets_.end(); ++it2) {
-		if(FD_ISSET(it2->first, &sockets) || FD_ISSET(it2->first, &out_sockets)) {
-			poll();
-			break;
-		}
-	}
-	for(auto nit = dazeus_->networks().begin(); nit != dazeus_->networks().end(); ++nit) {
-		if(nit->second->activeServer()) {
-			nit->second->processDescriptors(&sockets, &out_sockets);
-			nit->second->checkTimeouts();
-		}
-	}
+/**
+ * @brief Change the database requests are handled on.
+ *
+ * Requests that are being handled finish on the old database first, and
+ * any writes it holds back are written.
+ */
+void dazeus::PluginComm::setDatabase(db::Database *database) {
+	worker_.setDatabase(database);
+	worker_.setFlushInterval(std::chrono::milliseconds(config_->getDatabaseConfig().write_window));
 }
 
 void dazeus::PluginComm::init() {
@@ -185,6 +122,9 @@ void dazeus::PluginComm::init() {
 			// make sure the socket path is an absolute path
 			sc.path = realpath(sc.path);
 			localServers_.push_back(server);
+			reactor_->add(server, EPOLLIN, [this](uint32_t) {
+				newLocalConnection();
+			});
 		} else if(sc.type == "tcp") {
 			std::string portStr;
 			{
@@ -233,6 +173,9 @@ void dazeus::PluginComm::init() {
 			}
 
 			tcpServers_.push_back(server);
+			reactor_->add(server, EPOLLIN, [this](uint32_t) {
+				newTcpConnection();
+			});
 		} else {
 			fprintf(stderr, "(PluginComm) Skipping socket: unknown type >%s<\n", sc.type.c_str());
 		}
@@ -249,9 +192,7 @@ void dazeus::PluginComm::newTcpConnection() {
 					fprintf(stderr, "Error on listening socket: %s\n", strerror(errno));
 				break;
 			}
-			NOTBLOCKING(sock);
-			sockets_[sock] = SocketInfo("tcp");
-			assert(!sockets_[sock].didHandshake());
+			addSocket(sock, "tcp");
 		}
 	}
 }
@@ -266,202 +207,215 @@ void dazeus::PluginComm::newLocalConnection() {
 					fprintf(stderr, "Error on listening socket: %s\n", strerror(errno));
 				break;
 			}
-			NOTBLOCKING(sock);
-			sockets_[sock] = SocketInfo("unix");
-			assert(!sockets_[sock].didHandshake());
+			addSocket(sock, "unix");
 		}
 	}
 }
 
-void dazeus::PluginComm::poll() {
-	std::vector<int> toRemove;
-	std::map<int,SocketInfo>::iterator it;
-	for(it = sockets_.begin(); it != sockets_.end(); ++it) {
-		int dev = it->first;
-		SocketInfo info = it->second;
-
-		// check if it's in error state
-		struct pollfd fds[1];
-		fds[0].fd = dev;
-		fds[0].events = fds[0].revents = 0;
-		if(::poll(fds, 1, 0) == -1) {
-			perror("Failed to check socket error state");
-			close(dev);
-			toRemove.push_back(dev);
-			continue;
-		} else if(fds[0].revents & POLLERR || fds[0].revents & POLLHUP) {
-			close(dev);
-			toRemove.push_back(dev);
-			continue;
+void dazeus::PluginComm::addSocket(int sock, std::string type) {
+	NOTBLOCKING(sock);
+	sockets_[sock] = SocketInfo(type, sock, &subscriptions_);
+	assert(!sockets_[sock].didHandshake());
+	sockets_[sock].serial = reactor_->add(sock, EPOLLIN, [this, sock](uint32_t events) {
+		socketReady(sock, events);
+	});
+}
+
+/**
+ * @brief Only watch a plugin socket for writability while it has output.
+ */
+void dazeus::PluginComm::updateInterest(int sock, const SocketInfo &info) {
+	reactor_->modify(sock, info.output.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT);
+}
+
+/**
+ * @brief Handle readiness of a single plugin socket.
+ *
+ * Reads everything that is available, handles all complete requests in it,
+ * and writes as much of the pending output as the socket accepts.
+ */
+void dazeus::PluginComm::socketReady(int dev, uint32_t events) {
+	auto it = sockets_.find(dev);
+	if(it == sockets_.end()) {
+		return;
+	}
+	SocketInfo &info = it->second;
+
+	if(events & EPOLLERR) {
+		closeSocket(dev);
+		return;
+	}
+
+	if(events & (EPOLLIN | EPOLLHUP)) {
+		FrameDecoder::ReadResult result = info.decoder.readFrom(dev);
+		if(result == FrameDecoder::ReadError) {
+			fprintf(stderr, "Socket error: %s\n", strerror(errno));
+			closeSocket(dev);
+			return;
 		}
 
-		bool appended = false;
-		while(1) {
-			char *readahead = (char*)malloc(512);
-			ssize_t r = read(dev, readahead, 512);
-			if(r == 0) {
-				// end-of-file
-				close(dev);
-				toRemove.push_back(dev);
-				break;
-			} else if(r < 0) {
-				if(errno != EWOULDBLOCK) {
-					fprintf(stderr, "Socket error: %s\n", strerror(errno));
-					close(dev);
-					toRemove.push_back(dev);
-				}
-				free(readahead);
-				break;
+		// handle as much commands as we can
+		const char *packet;
+		size_t length;
+		FrameDecoder::FrameResult frame;
+		while((frame = info.decoder.nextFrame(&packet, &length)) == FrameDecoder::FrameReady) {
+			// responses are sent in the order of their requests
+			uint64_t slot = info.reserveResponse();
+			JSON output(json_object());
+			bool deferred = false;
+			try {
+				JSON input(packet, length, 0);
+				deferred = handle(input, output, info, slot);
+			} catch(std::exception &e) {
+				output.object_set_new("success", json_false());
+				output.object_set_new("error", json_string(e.what()));
 			}
-			appended = true;
-			info.readahead.append(readahead, r);
-			free(readahead);
-		}
-		if(appended) {
-			// try reading as much commands as we can
-			bool parsedPacket;
-			do {
-				parsedPacket = false;
-				if(info.waitingSize == 0) {
-					std::stringstream s;
-					std::string waitingSize;
-					unsigned int j;
-					for(j = 0; j < info.readahead.size(); ++j) {
-						if(isdigit(info.readahead[j])) {
-							s << info.readahead[j];
-						} else if(info.readahead[j] == '{') {
-							int waitingSize;
-							s >> waitingSize;
-							assert(s);
-							info.waitingSize = waitingSize;
-							break;
-						}
-					}
-					// remove everything to j from the readahead buffer
-					if(info.waitingSize != 0)
-						info.readahead = info.readahead.substr(j);
-				}
-				if(info.waitingSize != 0) {
-					if((signed)info.readahead.length() >= info.waitingSize) {
-						std::string packet = info.readahead.substr(0, info.waitingSize);
-						info.readahead = info.readahead.substr(info.waitingSize);
-						JSON input(packet, 0);
-						JSON output(json_object());
-						try {
-							handle(input, output, info);
-						} catch(std::exception &e) {
-							output.object_set_new("success", json_false());
-							output.object_set_new("error", json_string(e.what()));
-						}
-
-						std::string jsonMsg = output.toString();
-						std::stringstream mstr;
-						mstr << jsonMsg.length();
-						mstr << jsonMsg;
-						mstr << "\n";
-						info.writebuffer += mstr.str();
-
-						info.waitingSize = 0;
-						parsedPacket = true;
-					}
-				}
-			} while(parsedPacket);
-		}
 
-		while(!info.writebuffer.empty()) {
-			size_t length = info.writebuffer.length();
-			ssize_t written = write(dev, info.writebuffer.c_str(), length);
-			if(written < 0) {
-				if(errno != EWOULDBLOCK) {
-					fprintf(stderr, "Socket error: %s\n", strerror(errno));
-					close(dev);
-					toRemove.push_back(dev);
-				}
-				break;
-			} else {
-				info.writebuffer = info.writebuffer.substr(written, length - written);
+			if(!deferred) {
+				info.completeResponse(slot, OutputQueue::encode(output.get_json()));
 			}
 		}
-		it->second = info;
+		if(frame == FrameDecoder::FrameInvalid) {
+			fprintf(stderr, "Plugin sent data that is not a valid frame, disconnecting\n");
+			closeSocket(dev);
+			return;
+		}
+		if(result == FrameDecoder::ReadEof) {
+			closeSocket(dev);
+			return;
+		}
 	}
-	std::vector<int>::iterator toRemoveIt;
-	for(toRemoveIt = toRemove.begin(); toRemoveIt != toRemove.end(); ++toRemoveIt) {
-		sockets_.erase(*toRemoveIt);
+
+	if(info.output.flushTo(dev) == OutputQueue::FlushError) {
+		fprintf(stderr, "Socket error: %s\n", strerror(errno));
+		closeSocket(dev);
+		return;
 	}
+	updateInterest(dev, info);
 }
 
-void dazeus::PluginComm::dispatch(const std::string &event, const std::vector<std::string> &parameters) {
-	std::map<int,SocketInfo>::iterator it;
-	for(it = sockets_.begin(); it != sockets_.end(); ++it) {
-		SocketInfo &info = it->second;
-		if(info.isSubscribed(event)) {
-			info.dispatch(event, parameters);
-		}
+void dazeus::PluginComm::closeSocket(int dev) {
+	auto it = sockets_.find(dev);
+	if(it != sockets_.end()) {
+		it->second.unsubscribeAll();
+		commands_.unsubscribeAll(dev);
 	}
+	reactor_->remove(dev);
+	close(dev);
+	sockets_.erase(dev);
 }
 
-void dazeus::PluginComm::flushCommandQueue(const std::string &nick, bool identified) {
-	std::vector<Command*>::iterator cit;
-	for(cit = commandQueue_.begin(); cit != commandQueue_.end(); ++cit) {
-		Command *cmd = *cit;
-		// If there is at least one plugin that does sender checking,
-		// and the sender is not already known as identified, a whois
-		// check is necessary to send it to those plugins.
-		// If the whois check was done and it failed (nick is set and
-		// identified is false), send it to all other relevant plugins
-		// anyway.
-		// Check if we have all needed information
-		bool whoisRequired = false;
-		std::map<int,SocketInfo>::iterator it;
-		for(it = sockets_.begin(); it != sockets_.end(); ++it) {
-			SocketInfo &info = it->second;
-			if(info.commandMightNeedWhois(cmd->command)
-			&& !cmd->network.isIdentified(cmd->origin)) {
-				whoisRequired = true;
-			}
-		}
+/**
+ * @brief Encode an event into a frame that can be sent to any plugin.
+ */
+dazeus::OutputQueue::Frame dazeus::PluginComm::eventFrame(EventId event, const std::vector<std::string> &parameters) {
+	json_t *params = json_array();
+	std::vector<std::string>::const_iterator it;
+	for(it = parameters.begin(); it != parameters.end(); ++it) {
+		json_array_append_new(params, json_string(it->c_str()));
+	}
 
-		// If the whois check was not done yet, do it now, handle this
-		// command when the identified command comes in
-		if(whoisRequired && nick != cmd->origin) {
-			if(!cmd->whoisSent) {
-				cmd->network.sendWhois(cmd->origin);
-				cmd->whoisSent = true;
-			}
-			continue;
-		}
+	JSON n(json_object());
+	n.object_set_new("event", json_string(eventName(event)));
+	n.object_set_new("params", params);
+	return OutputQueue::encode(n.get_json());
+}
 
-		// We either don't require whois for this command, or the
-		// whois status of the sender is known at this point (either
-		// saved in the network, or in the 'identified' variable).
-		assert(!whoisRequired || cmd->network.isIdentified(cmd->origin)
-		       || nick == cmd->origin);
-
-		std::vector<std::string> parameters;
-		parameters.push_back(cmd->network.networkName());
-		parameters.push_back(cmd->origin);
-		parameters.push_back(cmd->channel);
-		parameters.push_back(cmd->command);
-		parameters.push_back(cmd->fullArgs);
-		for(std::vector<std::string>::const_iterator itt = cmd->args.begin(); itt != cmd->args.end(); ++itt) {
-			parameters.push_back(*itt);
-		}
+void dazeus::PluginComm::dispatch(EventId event, const std::vector<std::string> &parameters) {
+	const std::vector<int> &subscribers = subscriptions_.subscribers(event);
+	if(subscribers.empty()) {
+		return;
+	}
 
-		for(it = sockets_.begin(); it != sockets_.end(); ++it) {
-			SocketInfo &info = it->second;
-			if(!info.isSubscribedToCommand(cmd->command, cmd->channel, cmd->origin,
-				cmd->network.isIdentified(cmd->origin) || identified, cmd->network)) {
-				continue;
-			}
+	// The event is only encoded once, and shared between all subscribers
+	OutputQueue::Frame frame = eventFrame(event, parameters);
+	for(auto sit = subscribers.begin(); sit != subscribers.end(); ++sit) {
+		auto it = sockets_.find(*sit);
+		assert(it != sockets_.end());
+		it->second.output.push(frame);
+		updateInterest(it->first, it->second);
+	}
+}
 
-			// Receiver, sender, network matched; dispatch command to this plugin
-			info.dispatch("COMMAND", parameters);
-		}
+/**
+ * @brief Dispatch a command, or wait until it can be dispatched.
+ *
+ * If there is at least one plugin that does sender checking, and the sender
+ * is not already known as identified, the identification of the sender must
+ * be known to send it to those plugins. The command then waits in the whois
+ * table, together with other commands of the same sender. If the
+ * identification fails or times out, the command is still sent to all other
+ * relevant plugins.
+ */
+void dazeus::PluginComm::commandReceived(const Command &cmd) {
+	if(!commands_.mightNeedWhois(cmd.command) || cmd.network.isIdentified(cmd.origin)) {
+		dispatchCommand(cmd, false);
+		return;
+	}
 
-		cit = commandQueue_.erase(cit);
-		cit--;
-		delete cmd;
+	WhoisTable::Status status = whois_.lookup(cmd.network, cmd.origin);
+	if(status != WhoisTable::Unknown) {
+		dispatchCommand(cmd, status == WhoisTable::Identified);
+		return;
 	}
+
+	whois_.wait(cmd.network, cmd.origin, [this, cmd](bool identified) {
+		dispatchCommand(cmd, identified);
+	});
+	scheduleWhoisExpiry();
+}
+
+void dazeus::PluginComm::dispatchCommand(const Command &cmd, bool identified) {
+	std::vector<int> recipients = commands_.recipients(cmd.command, cmd.channel,
+		cmd.origin, cmd.network.isIdentified(cmd.origin) || identified, cmd.network);
+	if(recipients.empty()) {
+		return;
+	}
+
+	std::vector<std::string> parameters;
+	parameters.push_back(cmd.network.networkName());
+	parameters.push_back(cmd.origin);
+	parameters.push_back(cmd.channel);
+	parameters.push_back(cmd.command);
+	parameters.push_back(cmd.fullArgs);
+	for(std::vector<std::string>::const_iterator itt = cmd.args.begin(); itt != cmd.args.end(); ++itt) {
+		parameters.push_back(*itt);
+	}
+
+	// Receiver, sender, network matched; dispatch command to these plugins
+	OutputQueue::Frame frame = eventFrame(EVENT_COMMAND, parameters);
+	for(auto rit = recipients.begin(); rit != recipients.end(); ++rit) {
+		auto it = sockets_.find(*rit);
+		assert(it != sockets_.end());
+		it->second.output.push(frame);
+		updateInterest(it->first, it->second);
+	}
+}
+
+/**
+ * @brief Make sure the whois table is expired when its next entry is due.
+ */
+void dazeus::PluginComm::scheduleWhoisExpiry() {
+	Reactor::Clock::time_point next = whois_.nextExpiry();
+	if(whoisTimer_ != 0 && whoisDeadline_ <= next) {
+		// expiring earlier does no harm; the timer is set again then
+		return;
+	}
+	reactor_->cancelTimer(whoisTimer_);
+	whoisTimer_ = 0;
+	if(next != Reactor::Clock::time_point::max()) {
+		whoisDeadline_ = next;
+		whoisTimer_ = reactor_->addTimer(next, [this]() { expireWhois(); });
+	}
+}
+
+/**
+ * @brief Release commands whose sender could not be identified in time.
+ */
+void dazeus::PluginComm::expireWhois() {
+	whoisTimer_ = 0;
+	whois_.expire();
+	scheduleWhoisExpiry();
 }
 
 void dazeus::PluginComm::messageReceived( const std::string &origin, const std::string &message,
@@ -469,68 +423,22 @@ void dazeus::PluginComm::messageReceived( const std::string &origin, const std::
 	assert(n != 0);
 
 	const GlobalConfig &c = config_->getGlobalConfig();
-
-	std::string payload;
-	if( startsWith(message, n->nick() + ":", true)
-	 || startsWith(message, n->nick() + ",", true)) {
-		payload = trim(message.substr(n->nick().length() + 1));
-	} else if(startsWith(message, c.highlight, true)) {
-		payload = trim(message.substr(c.highlight.length()));
-	}
-
-	if(payload.length() != 0) {
-		// parse arguments from this string
-		bool inQuoteArg = false;
-		bool hadQuotesThisArg = false;
-		bool inEscape = false;
-		bool hasCommand = false;
-		std::vector<std::string> args;
-		std::string stringBuilder;
-		std::string fullArgs;
-		// loop through characters
-		for(unsigned i = 0; i < payload.length(); ++i) {
-			if(hasCommand)
-				fullArgs += payload.at(i);
-			if(inEscape) {
-				inEscape = false;
-				stringBuilder += payload.at(i);
-			} else if(payload.at(i) == '\\') {
-				inEscape = true;
-			} else if(!inQuoteArg && payload.at(i) == ' ') {
-				// finish this word, unless it's empty and we had no quotes (i.e. multiple spaces between args)
-				if(stringBuilder.length() != 0 || hadQuotesThisArg) {
-					args.push_back(stringBuilder);
-				}
-				stringBuilder.clear();
-				hasCommand = true;
-				hadQuotesThisArg = false;
-			} else if(payload.at(i) == '"') {
-				inQuoteArg = !inQuoteArg;
-				hadQuotesThisArg = true;
-			} else {
-				stringBuilder += payload.at(i);
-			}
-		}
-		if(stringBuilder.length() != 0 || hadQuotesThisArg)
-			args.push_back(stringBuilder);
-
-		if(args.size() > 0) {
-			const std::string command = args.front();
-			args.erase(args.begin());
-
-			Command *cmd = new Command(*n);
-			cmd->origin = origin;
-			cmd->channel = receiver;
-			cmd->command = command;
-			cmd->fullArgs = trim(fullArgs);
-			cmd->args = args;
-			commandQueue_.push_back(cmd);
-			flushCommandQueue();
-		}
+	const std::string nick = n->nick();
+
+	std::string_view payload = CommandParser::payload(message, nick, c.highlight);
+	if(payload.length() != 0 && parser_.parse(payload)) {
+		Command cmd(*n);
+		cmd.origin = origin;
+		cmd.channel = receiver;
+		cmd.command = std::string(parser_.command());
+		cmd.fullArgs = std::string(parser_.fullArgs());
+		const std::vector<std::string_view> &args = parser_.args();
+		cmd.args.assign(args.begin(), args.end());
+		commandReceived(cmd);
 	}
 	std::vector<std::string> args;
 	args << n->networkName() << origin << receiver << message << (n->isIdentified(origin) ? "true" : "false");
-	dispatch("PRIVMSG", args);
+	dispatch(EVENT_PRIVMSG, args);
 }
 
 void dazeus::PluginComm::ircEvent(const std::string &event, const std::string &origin, const std::vector<std::string> &params, Network *n) {
@@ -538,474 +446,764 @@ void dazeus::PluginComm::ircEvent(const std::string &event, const std::string &o
 	std::vector<std::string> args;
 	args << n->networkName();
 #define MIN(a) if(params.size() < a) { fprintf(stderr, "Too few parameters for event %s (%lu)\n", event.c_str(), params.size()); return; }
-	if(event == "PRIVMSG") {
+	EventId id = eventFromName(event);
+	switch(id) {
+	case EVENT_PRIVMSG:
 		MIN(2);
 		messageReceived(origin, params[1], params[0], n);
-	} else if(event == "NOTICE") {
+		break;
+	case EVENT_NOTICE:
 		MIN(2);
 		args << origin << params[0] << params[1] << (n->isIdentified(origin) ? "true" : "false");
-		dispatch("NOTICE", args);
-	} else if(event == "MODE" || event == "UMODE") {
+		dispatch(EVENT_NOTICE, args);
+		break;
+	case EVENT_MODE:
+	case EVENT_UMODE:
 		MIN(1);
 		args << origin << params;
-		dispatch("MODE", args);
-	} else if(event == "NICK") {
+		dispatch(EVENT_MODE, args);
+		break;
+	case EVENT_NICK:
 		MIN(1);
 		args << origin << params[0];
-		dispatch("NICK", args);
-	} else if(event == "JOIN") {
+		dispatch(EVENT_NICK, args);
+		whois_.forget(*n, origin);
+		whois_.forget(*n, params[0]);
+		break;
+	case EVENT_JOIN:
 		MIN(1);
 		args << origin << params[0];
-		dispatch("JOIN", args);
-	} else if(event == "PART") {
+		dispatch(EVENT_JOIN, args);
+		break;
+	case EVENT_PART: {
 		MIN(1);
 		std::string message;
 		if(params.size() == 2)
 			message = params[1];
 		args << origin << params[0] << message;
-		dispatch("PART", args);
-	} else if(event == "KICK") {
+		dispatch(EVENT_PART, args);
+		break;
+	}
+	case EVENT_KICK: {
 		MIN(2);
 		std::string nick = params[1];
 		std::string message;
 		if(params.size() == 3)
 			message = params[2];
 		args << origin << params[0] << nick << message;
-		dispatch("KICK", args);
-	} else if(event == "INVITE") {
+		dispatch(EVENT_KICK, args);
+		break;
+	}
+	case EVENT_INVITE: {
 		MIN(2);
 		std::string channel  = params[1];
 		args << origin << channel;
-		dispatch("INVITE", args);
-	} else if(event == "QUIT") {
+		dispatch(EVENT_INVITE, args);
+		break;
+	}
+	case EVENT_QUIT: {
 		std::string message;
 		if(params.size() == 1)
 			message = params[0];
 		args << origin << message;
-		dispatch("QUIT", args);
-	} else if(event == "TOPIC") {
+		dispatch(EVENT_QUIT, args);
+		whois_.forget(*n, origin);
+		break;
+	}
+	case EVENT_TOPIC: {
 		MIN(1);
 		std::string topic;
 		if(params.size() > 1)
 			topic = params[1];
 		args << origin << params[0] << topic;
-		dispatch("TOPIC", args);
-	} else if(event == "CONNECT") {
-		dispatch("CONNECT", args);
-	} else if(event == "DISCONNECT") {
-		dispatch("DISCONNECT", args);
-	} else if(event == "CTCP_REQ" || event == "CTCP") {
+		dispatch(EVENT_TOPIC, args);
+		break;
+	}
+	case EVENT_CONNECT:
+		dispatch(EVENT_CONNECT, args);
+		break;
+	case EVENT_DISCONNECT:
+		dispatch(EVENT_DISCONNECT, args);
+		whois_.forgetNetwork(*n);
+		break;
+	case EVENT_CTCP_REQ:
+	case EVENT_CTCP: {
 		MIN(1);
 		// TODO: libircclient does not seem to tell us where the ctcp
 		// request was sent (user or channel), so just assume it was
 		// sent to our nick
 		std::string to = n->nick();
 		args << origin << to << params[0];
-		dispatch("CTCP", args);
-	} else if(event == "CTCP_REP") {
+		dispatch(EVENT_CTCP, args);
+		break;
+	}
+	case EVENT_CTCP_REP: {
 		MIN(1);
 		// TODO: see above
 		std::string to = n->nick();
 		args << origin << to << params[0];
-		dispatch("CTCP_REP", args);
-	} else if(event == "CTCP_ACTION" || event == "ACTION") {
+		dispatch(EVENT_CTCP_REP, args);
+		break;
+	}
+	case EVENT_CTCP_ACTION:
+	case EVENT_ACTION: {
 		MIN(1);
 		std::string message;
 		if(params.size() >= 2)
 			message = params[1];
 		args << origin << params[0] << message;
-		dispatch("ACTION", args);
-	} else if(event == "WHOIS") {
+		dispatch(EVENT_ACTION, args);
+		break;
+	}
+	case EVENT_WHOIS:
 		MIN(2);
 		args << origin << params[0] << params[1];
-		dispatch("WHOIS", args);
-		flushCommandQueue(params[0], params[1] == "true");
-	} else if(event == "NAMES") {
+		dispatch(EVENT_WHOIS, args);
+		whois_.resolved(*n, params[0], params[1] == "true");
+		break;
+	case EVENT_NAMES:
 		MIN(2);
 		args << origin << params;
-		dispatch("NAMES", args);
-	} else if(event == "NUMERIC") {
+		dispatch(EVENT_NAMES, args);
+		break;
+	case EVENT_NUMERIC:
 		MIN(1);
 		args << origin << params[0] << params;
-		dispatch("NUMERIC", args);
-	} else if(event == "ACTION_ME" || event == "CTCP_ME" || event == "CTCP_REP_ME" || event == "PRIVMSG_ME" || event == "NOTICE_ME") {
+		dispatch(EVENT_NUMERIC, args);
+		break;
+	case EVENT_ACTION_ME:
+	case EVENT_CTCP_ME:
+	case EVENT_CTCP_REP_ME:
+	case EVENT_PRIVMSG_ME:
+	case EVENT_NOTICE_ME:
 		MIN(2);
 		args << origin << params;
-		dispatch(event, args);
-	} else if(event == "PONG") {
+		dispatch(id, args);
+		break;
+	case EVENT_PONG:
 		args << origin << params;
-		dispatch(event, args);
-	} else {
+		dispatch(EVENT_PONG, args);
+		break;
+	default:
 		fprintf(stderr, "Unknown event: \"%s\" \"%s\" \"%s\"\n", Network::toString(n).c_str(), event.c_str(), origin.c_str());
 		args << origin << params[0] << event << params;
-		dispatch("UNKNOWN", args);
+		dispatch(EVENT_UNKNOWN, args);
+		break;
 	}
 #undef MIN
 }
 
-void dazeus::PluginComm::handle(JSON &input, JSON &output, SocketInfo &info) {
-	auto &networks = dazeus_->networks();
+/**
+ * @brief Register a handler for a request action.
+ *
+ * Handlers registered for an action that is already known replace the
+ * existing handler.
+ */
+void dazeus::PluginComm::registerAction(const std::string &action, ActionHandler handler) {
+	actions_.add(action, handler);
+}
 
-	std::vector<std::string> params;
-	std::vector<std::string> scope;
-	std::string action;
+void dazeus::PluginComm::registerActions() {
+	using namespace std::placeholders;
+	// REQUESTS WITHOUT A NETWORK
+	registerAction("networks", std::bind(&PluginComm::handleNetworks, this, _1));
+	registerAction("handshake", std::bind(&PluginComm::handleHandshake, this, _1));
+	registerAction("reload", std::bind(&PluginComm::handleReload, this, _1));
+	// REQUESTS ON A NETWORK
+	const char *networkActions[] = {"channels", "whois", "join", "part", "nick"};
+	for(const char *action : networkActions) {
+		registerAction(action, std::bind(&PluginComm::handleNetworkRequest, this, _1));
+	}
+	// REQUESTS ON A CHANNEL
+	const char *channelActions[] = {"message", "notice", "action", "ctcp", "ctcp_rep", "names"};
+	for(const char *action : channelActions) {
+		registerAction(action, std::bind(&PluginComm::handleChannelRequest, this, _1));
+	}
+	// REQUESTS ON DAZEUS ITSELF
+	registerAction("subscribe", std::bind(&PluginComm::handleSubscribe, this, _1));
+	registerAction("unsubscribe", std::bind(&PluginComm::handleUnsubscribe, this, _1));
+	registerAction("command", std::bind(&PluginComm::handleCommand, this, _1));
+	registerAction("property", std::bind(&PluginComm::handleProperty, this, _1));
+	registerAction("config", std::bind(&PluginComm::handleConfig, this, _1));
+	registerAction("permission", std::bind(&PluginComm::handlePermission, this, _1));
+}
 
-	json_t *jParams = input.object_get("params");
-	if(jParams) {
-		if(!json_is_array(jParams)) {
-			throw std::runtime_error("Parameters are of the wrong type");
-		}
+static json_t *json_view(std::string_view s) {
+	return json_stringn(s.data(), s.length());
+}
 
-		for(unsigned i = 0; i < json_array_size(jParams); ++i) {
-			json_t *v = json_array_get(jParams, i);
-			std::stringstream value;
-			switch(json_typeof(v)) {
-			case JSON_STRING: value << json_string_value(v); break;
-			case JSON_INTEGER: value << json_integer_value(v); break;
-			case JSON_REAL: value << json_real_value(v); break;
-			case JSON_TRUE: value << "true"; break;
-			case JSON_FALSE: value << "false"; break;
-			default:
-				throw std::runtime_error("Parameter " + std::to_string(i) + " is of an unsupported type");
-			}
-			params.push_back(value.str());
-		}
+/**
+ * @brief Read the network, receiver and sender from the scope of a request.
+ *
+ * Returns the amount of scope elements given.
+ */
+static size_t requestScope(json_t *input, std::string &network, std::string &receiver, std::string &sender) {
+	json_t *jScope = json_object_get(input, "scope");
+	if(!jScope) {
+		return 0;
+	} else if(!json_is_array(jScope)) {
+		fprintf(stderr, "Got scope, but of the wrong type, ignoring\n");
+		return 0;
 	}
 
-	json_t *jScope = input.object_get("scope");
-	if(jScope) {
-		if(!json_is_array(jScope)) {
-			fprintf(stderr, "Got scope, but of the wrong type, ignoring\n");
-		} else {
-			for(unsigned int i = 0; i < json_array_size(jScope); ++i) {
-				json_t *v = json_array_get(jScope, i);
-				scope.push_back(json_is_string(v) ? json_string_value(v) : "");
-			}
+	std::string *fields[] = {&network, &receiver, &sender};
+	size_t size = json_array_size(jScope);
+	for(size_t i = 0; i < size && i < 3; ++i) {
+		json_t *v = json_array_get(jScope, i);
+		if(json_is_string(v)) {
+			fields[i]->assign(json_string_value(v), json_string_length(v));
 		}
 	}
+	return size;
+}
 
+bool dazeus::PluginComm::handle(JSON &input, JSON &output, SocketInfo &info, uint64_t slot) {
 	json_t *jAction = input.object_get("get");
 	if(!jAction)
 		jAction = input.object_get("do");
+
+	std::string_view action;
 	if(jAction) {
 		if(!json_is_string(jAction)) {
 			throw std::runtime_error("Action is of the wrong type");
 		}
+		action = std::string_view(json_string_value(jAction), json_string_length(jAction));
+	}
 
-		action = json_string_value(jAction);
+	const ActionHandler *handler = actions_.find(action);
+	if(!handler) {
+		throw std::runtime_error("Did not understand request");
 	}
 
-	json_t *response = output.get_json();
-	// REQUEST WITHOUT A NETWORK
-	if(action == "networks") {
-		json_object_set_new(response, "got", json_string("networks"));
-		json_object_set_new(response, "success", json_true());
-		json_t *nets = json_array();
-		for(auto nit = networks.begin(); nit != networks.end(); ++nit) {
-			json_array_append_new(nets, json_string(nit->first.c_str()));
-		}
-		json_object_set_new(response, "networks", nets);
-	} else if(action == "handshake") {
-		json_object_set_new(response, "did", json_string("handshake"));
-		if(info.didHandshake()) {
-			throw std::runtime_error("Already did handshake");
-		} else if(params.size() < 4) {
-			throw std::runtime_error("Missing parameters for handshake");
-		} else if(params[2] != "1") {
-			throw std::runtime_error("Protocol version must be '1'");
-		}
+	Request request = {action, RequestParams(input.object_get("params")),
+		input.get_json(), output.get_json(), info, slot, false};
+	(*handler)(request);
+	return request.deferred;
+}
 
-		json_object_set_new(response, "success", json_true());
-		info.plugin_name = params[0];
-		info.plugin_version = params[1];
-		std::stringstream version(params[2]);
-		version >> info.protocol_version;
-		info.config_group = params[3];
-		std::cout << "Plugin handshake: " << info.plugin_name << " v"
-			  << info.plugin_version << " (protocol version "
-			  << info.protocol_version << ", config group "
-			  << info.config_group << ")" << std::endl;
-	} else if(action == "reload") {
-		json_object_set_new(response, "did", json_string("reload"));
-		json_object_set_new(response, "success", json_true());
-		dazeus_->reloadConfig();
-		std::cout << "Reloaded configuration per plugin request." << std::endl;
-	// REQUESTS ON A NETWORK
-	} else if(action == "channels" || action == "whois" || action == "join" || action == "part"
-	       || action == "nick") {
-		if(action == "channels" || action == "nick") {
-			json_object_set_new(response, "got", json_string(action.c_str()));
-		} else {
-			json_object_set_new(response, "did", json_string(action.c_str()));
-		}
-		std::string network = "";
-		if(params.size() > 0) {
-			network = params[0];
-		}
-		auto nit = networks.find(network);
-		if(nit == networks.end()) {
-			throw std::runtime_error("Not on that network");
+/**
+ * @brief Finish a request by running a query on the database worker.
+ *
+ * The query runs on the worker thread; afterwards, respond fills in the
+ * response on the reactor thread, and the response is sent in the place of
+ * the request. If the query throws, an error response is sent instead. A
+ * handler must not throw after deferring its request.
+ */
+void dazeus::PluginComm::deferToDatabase(Request &r, Query query, Responder respond) {
+	struct Deferred {
+		int sock;
+		unsigned serial;
+		uint64_t slot;
+		JSON response;
+		Responder respond;
+		bool failed;
+		std::string error;
+	};
+
+	// Only the reactor thread touches the response
+	auto deferred = std::make_shared<Deferred>();
+	deferred->sock = r.info.sock;
+	deferred->serial = r.info.serial;
+	deferred->slot = r.slot;
+	deferred->response = JSON(json_incref(r.response));
+	deferred->respond = respond;
+	deferred->failed = false;
+	r.deferred = true;
+
+	worker_.submit([this, query, deferred](db::Database *database) -> DatabaseWorker::Completion {
+		try {
+			if(!database) {
+				throw std::runtime_error("Database is not available");
+			}
+			query(database);
+		} catch(std::exception &e) {
+			deferred->failed = true;
+			deferred->error = e.what();
 		}
 
-		json_object_set_new(response, "network", json_string(network.c_str()));
-
-		Network *net = nit->second;
-		if(action == "channels") {
-			json_object_set_new(response, "success", json_true());
-			json_t *chans = json_array();
-			const std::vector<std::string> &channels = net->joinedChannels();
-			for(unsigned i = 0; i < channels.size(); ++i) {
-				json_array_append_new(chans, json_string(channels[i].c_str()));
-			}
-			json_object_set_new(response, "channels", chans);
-		} else if(action == "whois" || action == "join" || action == "part") {
-			if(params.size() < 2) {
-				throw std::runtime_error("Missing parameters");
+		return [this, deferred]() {
+			json_t *response = deferred->response.get_json();
+			if(deferred->failed) {
+				json_object_set_new(response, "success", json_false());
+				json_object_set_new(response, "error", json_string(deferred->error.c_str()));
+			} else {
+				deferred->respond(response);
 			}
 
-			json_object_set_new(response, "success", json_true());
-			if(action == "whois") {
-				net->sendWhois(params[1]);
-			} else if(action == "join") {
-				net->joinChannel(params[1]);
-			} else if(action == "part") {
-				net->leaveChannel(params[1]);
+			// The plugin may have disconnected in the mean time
+			auto it = sockets_.find(deferred->sock);
+			if(it == sockets_.end() || it->second.serial != deferred->serial) {
+				return;
 			}
-		} else if(action == "nick") {
-			json_object_set_new(response, "success", json_true());
-			json_object_set_new(response, "nick", json_string(net->nick().c_str()));
-		}
-	// REQUESTS ON A CHANNEL
-	} else if(action == "message" || action == "notice" || action == "action" || action == "ctcp" || action == "ctcp_rep" || action == "names") {
-		json_object_set_new(response, "did", json_string(action.c_str()));
-		if(params.size() < 2 || (action != "names" && params.size() < 3)) {
-			throw std::runtime_error("Wrong parameter size for message");
+			it->second.completeResponse(deferred->slot, OutputQueue::encode(response));
+			updateInterest(it->first, it->second);
+		};
+	});
+}
+
+void dazeus::PluginComm::handleNetworks(Request &r) {
+	auto &networks = dazeus_->networks();
+	json_object_set_new(r.response, "got", json_string("networks"));
+	json_object_set_new(r.response, "success", json_true());
+	json_t *nets = json_array();
+	for(auto nit = networks.begin(); nit != networks.end(); ++nit) {
+		json_array_append_new(nets, json_string(nit->first.c_str()));
+	}
+	json_object_set_new(r.response, "networks", nets);
+}
+
+void dazeus::PluginComm::handleHandshake(Request &r) {
+	SocketInfo &info = r.info;
+	json_object_set_new(r.response, "did", json_string("handshake"));
+	if(info.didHandshake()) {
+		throw std::runtime_error("Already did handshake");
+	} else if(r.params.size() < 4) {
+		throw std::runtime_error("Missing parameters for handshake");
+	} else if(r.params[2] != "1") {
+		throw std::runtime_error("Protocol version must be '1'");
+	}
+
+	json_object_set_new(r.response, "success", json_true());
+	info.plugin_name = r.params.str(0);
+	info.plugin_version = r.params.str(1);
+	info.protocol_version = 1;
+	info.config_group = r.params.str(3);
+	std::cout << "Plugin handshake: " << info.plugin_name << " v"
+		  << info.plugin_version << " (protocol version "
+		  << info.protocol_version << ", config group "
+		  << info.config_group << ")" << std::endl;
+}
+
+void dazeus::PluginComm::handleReload(Request &r) {
+	json_object_set_new(r.response, "did", json_string("reload"));
+	json_object_set_new(r.response, "success", json_true());
+	dazeus_->reloadConfig();
+	std::cout << "Reloaded configuration per plugin request." << std::endl;
+}
+
+void dazeus::PluginComm::handleNetworkRequest(Request &r) {
+	auto &networks = dazeus_->networks();
+	const std::string_view action = r.action;
+	if(action == "channels" || action == "nick") {
+		json_object_set_new(r.response, "got", json_view(action));
+	} else {
+		json_object_set_new(r.response, "did", json_view(action));
+	}
+	std::string network = "";
+	if(r.params.size() > 0) {
+		network = r.params.str(0);
+	}
+	auto nit = networks.find(network);
+	if(nit == networks.end()) {
+		throw std::runtime_error("Not on that network");
+	}
+
+	json_object_set_new(r.response, "network", json_string(network.c_str()));
+
+	Network *net = nit->second;
+	if(action == "channels") {
+		json_object_set_new(r.response, "success", json_true());
+		json_t *chans = json_array();
+		const std::vector<std::string> &channels = net->joinedChannels();
+		for(unsigned i = 0; i < channels.size(); ++i) {
+			json_array_append_new(chans, json_string(channels[i].c_str()));
 		}
-		std::string network = params[0];
-		std::string receiver = params[1];
-		std::string message;
-		if(action != "names") {
-			message = params[2];
+		json_object_set_new(r.response, "channels", chans);
+	} else if(action == "nick") {
+		json_object_set_new(r.response, "success", json_true());
+		json_object_set_new(r.response, "nick", json_string(net->nick().c_str()));
+	} else {
+		if(r.params.size() < 2) {
+			throw std::runtime_error("Missing parameters");
 		}
-		json_object_set_new(response, "network", json_string(network.c_str()));
-		if(action == "names") {
-			json_object_set_new(response, "channel", json_string(receiver.c_str()));
+
+		json_object_set_new(r.response, "success", json_true());
+		if(action == "whois") {
+			net->sendWhois(r.params.str(1));
+		} else if(action == "join") {
+			net->joinChannel(r.params.str(1));
 		} else {
-			json_object_set_new(response, "receiver", json_string(receiver.c_str()));
-			json_object_set_new(response, "message", json_string(message.c_str()));
+			net->leaveChannel(r.params.str(1));
 		}
+	}
+}
 
-		for(auto nit = networks.begin(); nit != networks.end(); ++nit) {
-			Network *n = nit->second;
-			if(n->networkName() == network) {
-				if(receiver.substr(0, 1) != "#" || contains_ci(n->joinedChannels(), strToLower(receiver))) {
-					json_object_set_new(response, "success", json_true());
-					if(action == "names") {
-						n->names(receiver);
-					} else if(action == "message") {
-						n->say(receiver, message);
-					} else if(action == "notice") {
-						n->notice(receiver, message);
-					} else if(action == "ctcp") {
-						n->ctcp(receiver, message);
-					} else if(action == "ctcp_rep") {
-						n->ctcpReply(receiver, message);
-					} else {
-						n->action(receiver, message);
-					}
+void dazeus::PluginComm::handleChannelRequest(Request &r) {
+	auto &networks = dazeus_->networks();
+	const std::string_view action = r.action;
+	bool names = action == "names";
+	json_object_set_new(r.response, "did", json_view(action));
+	if(r.params.size() < 2 || (!names && r.params.size() < 3)) {
+		throw std::runtime_error("Wrong parameter size for message");
+	}
+	std::string network = r.params.str(0);
+	std::string receiver = r.params.str(1);
+	std::string message;
+	if(!names) {
+		message = r.params.str(2);
+	}
+	json_object_set_new(r.response, "network", json_string(network.c_str()));
+	if(names) {
+		json_object_set_new(r.response, "channel", json_string(receiver.c_str()));
+	} else {
+		json_object_set_new(r.response, "receiver", json_string(receiver.c_str()));
+		json_object_set_new(r.response, "message", json_string(message.c_str()));
+	}
+
+	for(auto nit = networks.begin(); nit != networks.end(); ++nit) {
+		Network *n = nit->second;
+		if(n->networkName() == network) {
+			if(receiver.substr(0, 1) != "#" || contains_ci(n->joinedChannels(), strToLower(receiver))) {
+				json_object_set_new(r.response, "success", json_true());
+				if(names) {
+					n->names(receiver);
+				} else if(action == "message") {
+					n->say(receiver, message);
+				} else if(action == "notice") {
+					n->notice(receiver, message);
+				} else if(action == "ctcp") {
+					n->ctcp(receiver, message);
+				} else if(action == "ctcp_rep") {
+					n->ctcpReply(receiver, message);
 				} else {
-					fprintf(stderr, "Request for communication to network %s receiver %s, but not in that channel, dropping\n",
-						network.c_str(), receiver.c_str());
-					throw std::runtime_error("Not in that channel");
+					n->action(receiver, message);
 				}
-				return;
+			} else {
+				fprintf(stderr, "Request for communication to network %s receiver %s, but not in that channel, dropping\n",
+					network.c_str(), receiver.c_str());
+				throw std::runtime_error("Not in that channel");
 			}
+			return;
 		}
+	}
 
-		fprintf(stderr, "Request for communication to network %s, but that network isn't joined, dropping\n", network.c_str());
-		throw std::runtime_error("Not on that network");
-	// REQUESTS ON DAZEUS ITSELF
-	} else if(action == "subscribe") {
-		json_object_set_new(response, "did", json_string("subscribe"));
-		json_object_set_new(response, "success", json_true());
-		int added = 0;
-		std::vector<std::string>::const_iterator pit;
-		for(pit = params.begin(); pit != params.end(); ++pit) {
-			if(info.subscribe(*pit))
-				++added;
-		}
-		json_object_set_new(response, "added", json_integer(added));
-	} else if(action == "unsubscribe") {
-		json_object_set_new(response, "did", json_string("unsubscribe"));
-		json_object_set_new(response, "success", json_true());
-		int removed = 0;
-		std::vector<std::string>::const_iterator pit;
-		for(pit = params.begin(); pit != params.end(); ++pit) {
-			if(info.unsubscribe(*pit))
-				++removed;
+	fprintf(stderr, "Request for communication to network %s, but that network isn't joined, dropping\n", network.c_str());
+	throw std::runtime_error("Not on that network");
+}
+
+void dazeus::PluginComm::handleSubscribe(Request &r) {
+	json_object_set_new(r.response, "did", json_string("subscribe"));
+	json_object_set_new(r.response, "success", json_true());
+	int added = 0;
+	for(size_t i = 0; i < r.params.size(); ++i) {
+		if(r.info.subscribe(r.params.str(i)))
+			++added;
+	}
+	json_object_set_new(r.response, "added", json_integer(added));
+}
+
+void dazeus::PluginComm::handleUnsubscribe(Request &r) {
+	json_object_set_new(r.response, "did", json_string("unsubscribe"));
+	json_object_set_new(r.response, "success", json_true());
+	int removed = 0;
+	for(size_t i = 0; i < r.params.size(); ++i) {
+		if(r.info.unsubscribe(r.params.str(i)))
+			++removed;
+	}
+	json_object_set_new(r.response, "removed", json_integer(removed));
+}
+
+void dazeus::PluginComm::handleCommand(Request &r) {
+	auto &networks = dazeus_->networks();
+	json_object_set_new(r.response, "did", json_string("command"));
+	// {"do":"command", "params":["cmdname"]}
+	// {"do":"command", "params":["cmdname", "network"]}
+	// {"do":"command", "params":["cmdname", "network", true, "sender"]}
+	// {"do":"command", "params":["cmdname", "network", false, "receiver"]}
+	if(r.params.size() == 0) {
+		throw std::runtime_error("Missing parameters");
+	}
+	std::string commandName = r.params.str(0);
+	int sock = r.info.sock;
+
+	if(r.params.size() == 1) {
+		// Add it as a global command
+		commands_.subscribe(commandName, sock);
+	} else if(r.params.size() == 2 || r.params.size() == 4) {
+		auto nit = networks.find(r.params.str(1));
+		if(nit == networks.end()) {
+			throw std::runtime_error("Not on that network");
+		} else if(r.params.size() == 2) {
+			// Network requirement
+			commands_.subscribe(commandName, sock, nit->second);
+		} else {
+			// Network and sender/receiver requirement
+			bool isSender = r.params[2] == "true";
+			commands_.subscribe(commandName, sock, nit->second, r.params.str(3), isSender);
 		}
-		json_object_set_new(response, "removed", json_integer(removed));
-	} else if(action == "command") {
-		json_object_set_new(response, "did", json_string("command"));
-		// {"do":"command", "params":["cmdname"]}
-		// {"do":"command", "params":["cmdname", "network"]}
-		// {"do":"command", "params":["cmdname", "network", true, "sender"]}
-		// {"do":"command", "params":["cmdname", "network", false, "receiver"]}
-		if(params.size() == 0) {
-			throw std::runtime_error("Missing parameters");
+	} else {
+		throw std::runtime_error("Wrong number of parameters");
+	}
+
+	json_object_set_new(r.response, "success", json_true());
+}
+
+void dazeus::PluginComm::handleProperty(Request &r) {
+	json_object_set_new(r.response, "did", json_string("property"));
+
+	std::string network, receiver, sender;
+	requestScope(r.input, network, receiver, sender);
+
+	if(r.params.size() < 2) {
+		throw std::runtime_error("Missing parameters");
+	}
+
+	std::string_view op = r.params[0];
+	if(op == "mget") {
+		// {"do":"property", "params":["mget", ["variable", ...]]}
+		json_t *list = r.params.json(1);
+		if(!json_is_array(list)) {
+			throw std::runtime_error("Variables are not an array");
 		}
-		std::string commandName = params.front();
-		params.erase(params.begin());
-		RequirementInfo *req = 0;
-
-		if(params.size() == 0) {
-			// Add it as a global command
-			req = new RequirementInfo();
-		} else if(params.size() == 1 || params.size() == 3) {
-			auto nit = networks.find(params.at(0));
-			if(nit == networks.end()) {
-				throw std::runtime_error("Not on that network");
-			} else if(params.size() == 1) {
-				// Network requirement
-				req = new RequirementInfo(nit->second);
-			} else {
-				// Network and sender/receiver requirement
-				bool isSender = params.at(1) == "true";
-				req = new RequirementInfo(nit->second, params.at(2), isSender);
+		auto variables = std::make_shared<std::vector<std::string> >();
+		for(size_t i = 0; i < json_array_size(list); ++i) {
+			json_t *v = json_array_get(list, i);
+			if(!json_is_string(v)) {
+				throw std::runtime_error("Variable is not a string");
 			}
-		} else {
-			throw std::runtime_error("Wrong number of parameters");
+			variables->push_back(json_string_value(v));
 		}
 
-		info.subscribeToCommand(commandName, req);
-		json_object_set_new(response, "success", json_true());
-	} else if(action == "property") {
-		json_object_set_new(response, "did", json_string("property"));
-
-		std::string network, receiver, sender;
-		switch(scope.size()) {
-		// fall-throughs
-		case 3: sender   = scope[2];
-		case 2: receiver = scope[1];
-		case 1: network  = scope[0];
-		default: break;
+		auto values = std::make_shared<std::vector<std::string> >();
+		deferToDatabase(r, [=](db::Database *database) {
+			*values = database->properties(*variables, network, receiver, sender);
+		}, [=](json_t *response) {
+			json_t *result = json_object();
+			for(size_t i = 0; i < variables->size(); ++i) {
+				if((*values)[i].length() > 0) {
+					json_object_set_new(result, (*variables)[i].c_str(), json_string((*values)[i].c_str()));
+				}
+			}
+			json_object_set_new(response, "values", result);
+			json_object_set_new(response, "success", json_true());
+		});
+		return;
+	} else if(op == "mset") {
+		// {"do":"property", "params":["mset", {"variable":"value", ...}]}
+		json_t *object = r.params.json(1);
+		if(!json_is_object(object)) {
+			throw std::runtime_error("Properties are not an object");
 		}
-
-		if(params.size() < 2) {
-			throw std::runtime_error("Missing parameters");
+		std::vector<db::PropertyChange> changes;
+		const char *key;
+		json_t *value;
+		json_object_foreach(object, key, value) {
+			if(!json_is_string(value)) {
+				throw std::runtime_error("Value is not a string");
+			}
+			db::PropertyChange change;
+			change.variable = key;
+			change.value = json_string_value(value);
+			change.network = network;
+			change.receiver = receiver;
+			change.sender = sender;
+			changes.push_back(change);
 		}
 
-		if(params[0] == "get") {
-			std::string value = database_->property(params[1], network, receiver, sender);
+		deferToDatabase(r, [=](db::Database *database) {
+			database->setProperties(changes);
+		}, [](json_t *response) {
 			json_object_set_new(response, "success", json_true());
-			json_object_set_new(response, "variable", json_string(params[1].c_str()));
-			if(value.length() > 0) {
-				json_object_set_new(response, "value", json_string(value.c_str()));
+		});
+		return;
+	}
+
+	std::string variable = r.params.str(1);
+	if(op == "get") {
+		auto value = std::make_shared<std::string>();
+		deferToDatabase(r, [=](db::Database *database) {
+			*value = database->property(variable, network, receiver, sender);
+		}, [=](json_t *response) {
+			json_object_set_new(response, "success", json_true());
+			json_object_set_new(response, "variable", json_string(variable.c_str()));
+			if(value->length() > 0) {
+				json_object_set_new(response, "value", json_string(value->c_str()));
 			}
-		} else if(params[0] == "set") {
-			if(params.size() < 3) {
+		});
+	} else if(op == "set" || op == "unset") {
+		std::string value;
+		if(op == "set") {
+			if(r.params.size() < 3) {
 				throw std::runtime_error("Missing parameters");
 			}
+			value = r.params.str(2);
+		}
 
-			database_->setProperty(params[1], params[2], network, receiver, sender);
+		deferToDatabase(r, [=](db::Database *database) {
+			database->setProperty(variable, value, network, receiver, sender);
+		}, [](json_t *response) {
 			json_object_set_new(response, "success", json_true());
-		} else if(params[0] == "unset") {
-			database_->setProperty(params[1], std::string(), network, receiver, sender);
+		});
+	} else if(op == "incr") {
+		// {"do":"property", "params":["incr", "variable"]}
+		// {"do":"property", "params":["incr", "variable", delta]}
+		int64_t delta = 1;
+		if(r.params.size() >= 3) {
+			std::string deltaStr = r.params.str(2);
+			char *end;
+			errno = 0;
+			delta = strtoll(deltaStr.c_str(), &end, 10);
+			if(errno != 0 || deltaStr.empty() || *end != 0) {
+				throw std::runtime_error("Increment is not an integer");
+			}
+		}
+
+		auto value = std::make_shared<int64_t>(0);
+		deferToDatabase(r, [=](db::Database *database) {
+			*value = database->incrementProperty(variable, delta, network, receiver, sender);
+		}, [=](json_t *response) {
+			json_object_set_new(response, "success", json_true());
+			json_object_set_new(response, "variable", json_string(variable.c_str()));
+			json_object_set_new(response, "value", json_string(std::to_string(*value).c_str()));
+		});
+	} else if(op == "cas") {
+		// {"do":"property", "params":["cas", "variable", "expected", "new value"]}
+		if(r.params.size() < 4) {
+			throw std::runtime_error("Missing parameters");
+		}
+		std::string expected = r.params.str(2);
+		std::string value = r.params.str(3);
+
+		auto changed = std::make_shared<bool>(false);
+		deferToDatabase(r, [=](db::Database *database) {
+			*changed = database->compareAndSetProperty(variable, expected, value, network, receiver, sender);
+		}, [=](json_t *response) {
 			json_object_set_new(response, "success", json_true());
-		} else if(params[0] == "keys") {
-			std::vector<std::string> pKeys = database_->propertyKeys(params[1], network, receiver, sender);
+			json_object_set_new(response, "variable", json_string(variable.c_str()));
+			json_object_set_new(response, "changed", *changed ? json_true() : json_false());
+		});
+	} else if(op == "keys") {
+		// {"do":"property", "params":["keys", "prefix"]}
+		// {"do":"property", "params":["keys", "prefix", limit]}
+		// {"do":"property", "params":["keys", "prefix", limit, "next"]}
+		size_t limit = 0;
+		std::string after;
+		if(r.params.size() >= 3) {
+			std::string limitStr = r.params.str(2);
+			char *end;
+			errno = 0;
+			unsigned long long l = strtoull(limitStr.c_str(), &end, 10);
+			if(errno != 0 || limitStr.empty() || *end != 0 || l == 0) {
+				throw std::runtime_error("Limit is not a positive integer");
+			}
+			limit = l;
+		}
+		if(r.params.size() >= 4) {
+			after = r.params.str(3);
+		}
+
+		auto pKeys = std::make_shared<std::vector<std::string> >();
+		auto next = std::make_shared<std::string>();
+		deferToDatabase(r, [=](db::Database *database) {
+			*pKeys = database->propertyKeyPage(variable, after, limit, next.get(), network, receiver, sender);
+		}, [=](json_t *response) {
 			json_t *keys = json_array();
 			std::vector<std::string>::iterator kit;
-			for(kit = pKeys.begin(); kit != pKeys.end(); ++kit) {
+			for(kit = pKeys->begin(); kit != pKeys->end(); ++kit) {
 				json_array_append_new(keys, json_string(kit->c_str()));
 			}
 			json_object_set_new(response, "keys", keys);
+			if(next->length() > 0) {
+				json_object_set_new(response, "next", json_string(next->c_str()));
+			}
 			json_object_set_new(response, "success", json_true());
-		} else {
-			throw std::runtime_error("Did not understand request");
-		}
-	} else if(action == "config") {
-		json_object_set_new(response, "got", json_string("config"));
-		if(params.size() != 2) {
-			throw std::runtime_error("Missing parameters");
-		}
+		});
+	} else {
+		throw std::runtime_error("Did not understand request");
+	}
+}
 
-		std::string configtype = params[0];
-		std::string configvar  = params[1];
+void dazeus::PluginComm::handleConfig(Request &r) {
+	json_object_set_new(r.response, "got", json_string("config"));
+	if(r.params.size() != 2) {
+		throw std::runtime_error("Missing parameters");
+	}
 
-		if(configtype == "plugin") {
-			if(!info.didHandshake()) {
-				throw std::runtime_error("Need to do a handshake for retrieving plugin configuration");
-			}
+	std::string_view configtype = r.params[0];
+	std::string configvar  = r.params.str(1);
 
-			json_object_set_new(response, "success", json_true());
-			json_object_set_new(response, "group", json_string(configtype.c_str()));
-			json_object_set_new(response, "variable", json_string(configvar.c_str()));
-
-			// Get the right plugin config
-			const std::vector<PluginConfig> &plugins = config_->getPlugins();
-			for(std::vector<PluginConfig>::const_iterator cit = plugins.begin(); cit != plugins.end(); ++cit) {
-				const PluginConfig &pc = *cit;
-				if(pc.name == info.config_group) {
-					std::map<std::string,std::string>::const_iterator configIt = pc.config.find(configvar);
-					if(configIt != pc.config.end()) {
-						json_object_set_new(response, "value", json_string(configIt->second.c_str()));
-						break;
-					}
+	if(configtype == "plugin") {
+		if(!r.info.didHandshake()) {
+			throw std::runtime_error("Need to do a handshake for retrieving plugin configuration");
+		}
+
+		json_object_set_new(r.response, "success", json_true());
+		json_object_set_new(r.response, "group", json_view(configtype));
+		json_object_set_new(r.response, "variable", json_string(configvar.c_str()));
+
+		// Get the right plugin config
+		const std::vector<PluginConfig> &plugins = config_->getPlugins();
+		for(std::vector<PluginConfig>::const_iterator cit = plugins.begin(); cit != plugins.end(); ++cit) {
+			const PluginConfig &pc = *cit;
+			if(pc.name == r.info.config_group) {
+				std::map<std::string,std::string>::const_iterator configIt = pc.config.find(configvar);
+				if(configIt != pc.config.end()) {
+					json_object_set_new(r.response, "value", json_string(configIt->second.c_str()));
+					break;
 				}
 			}
-		} else if(configtype == "core") {
-			const GlobalConfig &global = config_->getGlobalConfig();
-			json_object_set_new(response, "success", json_true());
-			json_object_set_new(response, "group", json_string(configtype.c_str()));
-			json_object_set_new(response, "variable", json_string(configvar.c_str()));
-			if(configvar == "nickname") {
-				json_object_set_new(response, "value", json_string(global.default_nickname.c_str()));
-			} else if(configvar == "username") {
-				json_object_set_new(response, "value", json_string(global.default_username.c_str()));
-			} else if(configvar == "fullname") {
-				json_object_set_new(response, "value", json_string(global.default_fullname.c_str()));
-			} else if(configvar == "highlight") {
-				json_object_set_new(response, "value", json_string(global.highlight.c_str()));
-			}
-		} else {
-			throw std::runtime_error("Unrecognised config group");
 		}
-	} else if(action == "permission") {
-		json_object_set_new(response, "did", json_string("permission"));
-
-		if(scope.size() == 0) {
-			throw std::runtime_error("Missing scope");
+	} else if(configtype == "core") {
+		const GlobalConfig &global = config_->getGlobalConfig();
+		json_object_set_new(r.response, "success", json_true());
+		json_object_set_new(r.response, "group", json_view(configtype));
+		json_object_set_new(r.response, "variable", json_string(configvar.c_str()));
+		if(configvar == "nickname") {
+			json_object_set_new(r.response, "value", json_string(global.default_nickname.c_str()));
+		} else if(configvar == "username") {
+			json_object_set_new(r.response, "value", json_string(global.default_username.c_str()));
+		} else if(configvar == "fullname") {
+			json_object_set_new(r.response, "value", json_string(global.default_fullname.c_str()));
+		} else if(configvar == "highlight") {
+			json_object_set_new(r.response, "value", json_string(global.highlight.c_str()));
 		}
+	} else {
+		throw std::runtime_error("Unrecognised config group");
+	}
+}
+
+void dazeus::PluginComm::handlePermission(Request &r) {
+	json_object_set_new(r.response, "did", json_string("permission"));
 
-		std::string network = scope[0];
-		std::string channel = scope.size() >= 2 ? scope[1] : "";
-		std::string sender = scope.size() >= 3 ? scope[2] : "";
+	std::string network, channel, sender;
+	if(requestScope(r.input, network, channel, sender) == 0) {
+		throw std::runtime_error("Missing scope");
+	}
 
-		if(params.size() < 2) {
+	if(r.params.size() < 2) {
+		throw std::runtime_error("Missing parameters");
+	}
+
+	std::string_view op = r.params[0];
+	std::string name = r.params.str(1);
+	if(op == "set") {
+		if(r.params.size() < 3) {
 			throw std::runtime_error("Missing parameters");
-		} else if(params[0] == "set") {
-			std::string name = params[1];
-			bool permission = params[2] == "true" || params[2] == "1";
-			database_->setPermission(permission, name, network, channel, sender);
+		}
+		bool permission = r.params[2] == "true" || r.params[2] == "1";
+		deferToDatabase(r, [=](db::Database *database) {
+			database->setPermission(permission, name, network, channel, sender);
+		}, [](json_t *response) {
 			json_object_set_new(response, "success", json_true());
-		} else if(params[0] == "unset") {
-			std::string name = params[1];
-			database_->unsetPermission(name, network, channel, sender);
+		});
+	} else if(op == "unset") {
+		deferToDatabase(r, [=](db::Database *database) {
+			database->unsetPermission(name, network, channel, sender);
+		}, [](json_t *response) {
 			json_object_set_new(response, "success", json_true());
-		} else if(params[0] == "has") {
-			if(params.size() < 3) {
-				throw std::runtime_error("Missing parameters");
-			} else {
-				std::string name = params[1];
-				bool defaultPermission = params[2] == "true" || params[2] == "1";
-				bool permission = database_->hasPermission(name, network, channel, sender, defaultPermission);
-				json_object_set_new(response, "success", json_true());
-				json_object_set_new(response, "has_permission", permission ? json_true() : json_false());
-			}
-		} else {
-			throw std::runtime_error("Did not understand request");
+		});
+	} else if(op == "has") {
+		if(r.params.size() < 3) {
+			throw std::runtime_error("Missing parameters");
 		}
+		bool defaultPermission = r.params[2] == "true" || r.params[2] == "1";
+		auto permission = std::make_shared<bool>(defaultPermission);
+		deferToDatabase(r, [=](db::Database *database) {
+			*permission = database->hasPermission(name, network, channel, sender, defaultPermission);
+		}, [=](json_t *response) {
+			json_object_set_new(response, "success", json_true());
+			json_object_set_new(response, "has_permission", *permission ? json_true() : json_false());
+		});
 	} else {
 		throw std::runtime_error("Did not understand request");
 	}
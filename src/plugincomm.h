@@ -9,6 +9,8 @@
 #include <sstream>
 #include <utility>
 #include <map>
+#include <deque>
+#include <algorithm>
 #include <unistd.h>
 #include <assert.h>
 #include <stdio.h>
@@ -16,6 +18,16 @@
 #include "../contrib/libdazeus-irc/src/utils.h"
 #include "network.h"
 #include "jsonwrap.h"
+#include "framedecoder.h"
+#include "outputqueue.h"
+#include "events.h"
+#include "reactor.h"
+#include "subscriptions.h"
+#include "commandtable.h"
+#include "whoistable.h"
+#include "commandparser.h"
+#include "databaseworker.h"
+#include "router.h"
 #include <memory>
 
 namespace dazeus {
@@ -37,129 +49,66 @@ class PluginComm : public NetworkListener
     std::string command;
     std::string fullArgs;
     std::vector<std::string> args;
-    bool whoisSent;
     Command(Network &n) : network(n), origin(), channel(),
-    command(), fullArgs(), args(), whoisSent(false) {}
-  };
-
-  struct RequirementInfo {
-    bool needsNetwork;
-    bool needsReceiver;
-    bool needsSender;
-    Network *wantedNetwork;
-    std::string wantedReceiver;
-    std::string wantedSender;
-    // Constructor which allows anything
-    RequirementInfo() : needsNetwork(false), needsReceiver(false),
-        needsSender(false), wantedNetwork(0), wantedReceiver(),
-        wantedSender() {}
-    // Constructor which allows anything on a network
-    RequirementInfo(Network *n) : needsNetwork(true), needsReceiver(false),
-        needsSender(false), wantedNetwork(n), wantedReceiver(),
-        wantedSender() {}
-    // Constructor which allows anything from a sender (isSender=true)
-    // or to some receiver (isSender=false)
-    RequirementInfo(Network *n, std::string obj, bool isSender) :
-        needsNetwork(true), needsReceiver(false),
-        needsSender(false), wantedNetwork(n), wantedReceiver(),
-        wantedSender()
-    {
-        if(isSender) {
-            needsSender = true; wantedSender = obj;
-        } else {
-            needsReceiver = true; wantedReceiver = obj;
-        }
-    }
-    private:
-    // explicitly disable copy constructor
-    RequirementInfo(const RequirementInfo&);
-    void operator=(const RequirementInfo&);
+    command(), fullArgs(), args() {}
   };
 
   struct SocketInfo {
    public:
-    SocketInfo(std::string t = std::string()) : type(t),
-      subscriptions(), commands(), waitingSize(0), readahead(),
-      writebuffer(), protocol_version(0) {}
-    bool isSubscribed(std::string t) const {
-      return contains(subscriptions, strToUpper(t));
-    }
-    bool unsubscribe(std::string t) {
-      if(!isSubscribed(t)) return false;
-      erase(subscriptions, strToUpper(t));
-      return true;
-    }
-    bool subscribe(std::string t) {
-      if(isSubscribed(t))
+    SocketInfo(std::string t = std::string(), int s = -1,
+      SubscriptionIndex *i = 0) : type(t), sock(s), index(i),
+      subscriptions(), decoder(),
+      output(), responses(), firstResponse(0), serial(0),
+      protocol_version(0) {}
+    bool unsubscribe(const std::string &t) {
+      EventId event = eventFromName(t);
+      if(event == EVENT_INVALID || !index->unsubscribe(event, sock))
         return false;
-      subscriptions.push_back(strToUpper(t));
+      subscriptions.erase(std::find(subscriptions.begin(),
+        subscriptions.end(), event));
       return true;
     }
-    bool isSubscribedToCommand(const std::string &cmd, const std::string &recv,
-        const std::string &sender, bool identified, const Network &network)
-    {
-        std::multimap<std::string,RequirementInfo*>::iterator it;
-        for(it = commands.begin(); it != commands.end(); ++it) {
-            if(it->first != cmd) {
-                continue;
-            } else if(it->second->needsNetwork && it->second->wantedNetwork != &network) {
-                continue;
-            } else if(it->second->needsReceiver && it->second->wantedReceiver != recv) {
-                continue;
-            } else if(it->second->needsSender) {
-                if(!identified || it->second->wantedSender != sender)
-                    continue;
-            }
-            return true;
-        }
+    bool subscribe(const std::string &t) {
+      EventId event = eventFromName(t);
+      if(event == EVENT_INVALID || !index->subscribe(event, sock))
         return false;
+      subscriptions.push_back(event);
+      return true;
     }
-    bool commandMightNeedWhois(const std::string &cmd) {
-        std::multimap<std::string,RequirementInfo*>::iterator it;
-        for(it = commands.begin(); it != commands.end(); ++it) {
-            if(it->first != cmd) {
-                continue;
-            } else if(it->second->needsSender) {
-                return true;
-            }
-        }
-        return false;
+    void unsubscribeAll() {
+      std::vector<EventId>::iterator it;
+      for(it = subscriptions.begin(); it != subscriptions.end(); ++it) {
+        index->unsubscribe(*it, sock);
+      }
+      subscriptions.clear();
     }
-    void subscribeToCommand(const std::string &cmd, RequirementInfo *info) {
-        commands.insert(std::make_pair(cmd, info));
+    uint64_t reserveResponse() {
+      responses.push_back(OutputQueue::Frame());
+      return firstResponse + responses.size() - 1;
     }
-    void dispatch(std::string event, std::vector<std::string> parameters) {
-      assert(!contains(event, ' '));
-
-      json_t *params = json_array();
-      std::vector<std::string>::iterator it;
-      for(it = parameters.begin(); it != parameters.end(); ++it) {
-        json_array_append_new(params, json_string(it->c_str()));
+    void completeResponse(uint64_t slot, OutputQueue::Frame frame) {
+      responses[slot - firstResponse] = frame;
+      while(!responses.empty() && responses.front()) {
+        output.push(responses.front());
+        responses.pop_front();
+        ++firstResponse;
       }
-
-      json_t *n = json_object();
-      json_object_set_new(n, "event", json_string(event.c_str()));
-      json_object_set_new(n, "params", params);
-
-      char *json_raw = json_dumps(n, 0);
-      std::string jsonMsg = json_raw;
-      free(json_raw);
-      std::stringstream mstr;
-      mstr << jsonMsg.length();
-      mstr << jsonMsg;
-      mstr << "\n";
-      writebuffer += mstr.str();
-      json_decref(n);
     }
     bool didHandshake() {
       return protocol_version != 0;
     }
     std::string type;
-    std::vector<std::string> subscriptions;
-    std::multimap<std::string,RequirementInfo*> commands;
-    int waitingSize;
-    std::string readahead;
-    std::string writebuffer;
+    int sock;
+    SubscriptionIndex *index;
+    std::vector<EventId> subscriptions;
+    FrameDecoder decoder;
+    OutputQueue output;
+    // responses to requests, in the order of the requests; empty frames
+    // are responses that aren't ready yet
+    std::deque<OutputQueue::Frame> responses;
+    uint64_t firstResponse;
+    // reactor registration of the socket
+    unsigned serial;
     std::string plugin_name;
     std::string plugin_version;
     int protocol_version;
@@ -167,16 +116,36 @@ class PluginComm : public NetworkListener
   };
 
   public:
-            PluginComm( db::Database *d, ConfigReaderPtr c, DaZeus *bot );
+    /**
+     * @brief A request of a plugin, as seen by the handler of its action.
+     *
+     * The action and parameters point into the JSON tree of the input, and
+     * are valid for the duration of the handler.
+     */
+    struct Request {
+      std::string_view action;
+      RequestParams params;
+      json_t *input;
+      json_t *response;
+      SocketInfo &info;
+      // place of the response in the output
+      uint64_t slot;
+      // whether the response is sent later, see deferToDatabase()
+      bool deferred;
+    };
+    typedef Router<Request>::Handler ActionHandler;
+    typedef std::function<void(db::Database *database)> Query;
+    typedef std::function<void(json_t *response)> Responder;
+
+            PluginComm( db::Database *d, ConfigReaderPtr c, DaZeus *bot, Reactor *reactor );
   virtual  ~PluginComm();
-  void dispatch(const std::string &event, const std::vector<std::string> &parameters);
+  void dispatch(EventId event, const std::vector<std::string> &parameters);
   void init();
   void ircEvent(const std::string &event, const std::string &origin,
                 const std::vector<std::string> &params, Network *n );
-  void run(int timeout);
-  void setDatabase(db::Database *database) {
-    database_ = database;
-  }
+  void registerAction(const std::string &action, ActionHandler handler);
+  void setDatabase(db::Database *database);
+  void deferToDatabase(Request &r, Query query, Responder respond);
 
   private:
     // explicitly disable copy constructor
@@ -185,18 +154,45 @@ class PluginComm : public NetworkListener
 
     void newTcpConnection();
     void newLocalConnection();
-    void poll();
+    void addSocket(int sock, std::string type);
+    void updateInterest(int sock, const SocketInfo &info);
+    void socketReady(int sock, uint32_t events);
+    static OutputQueue::Frame eventFrame(EventId event, const std::vector<std::string> &parameters);
+    void closeSocket(int sock);
     void messageReceived(const std::string &origin, const std::string &message, const std::string &receiver, Network *n);
+    void scheduleWhoisExpiry();
+    void expireWhois();
 
     std::vector<int> tcpServers_;
     std::vector<int> localServers_;
-    std::vector<Command*> commandQueue_;
     std::map<int,SocketInfo> sockets_;
-    db::Database *database_;
+    SubscriptionIndex subscriptions_;
+    CommandTable commands_;
+    WhoisTable whois_;
+    // reactor timer for the next expiry in the whois table, and when it is due
+    unsigned whoisTimer_;
+    Reactor::Clock::time_point whoisDeadline_;
     ConfigReaderPtr config_;
     DaZeus *dazeus_;
-    void handle(JSON &input, JSON &output, SocketInfo &info);
-    void flushCommandQueue(const std::string &nick = std::string(), bool identified = false);
+    Reactor *reactor_;
+    Router<Request> actions_;
+    CommandParser parser_;
+    DatabaseWorker worker_;
+    void registerActions();
+    bool handle(JSON &input, JSON &output, SocketInfo &info, uint64_t slot);
+    void handleNetworks(Request &r);
+    void handleHandshake(Request &r);
+    void handleReload(Request &r);
+    void handleNetworkRequest(Request &r);
+    void handleChannelRequest(Request &r);
+    void handleSubscribe(Request &r);
+    void handleUnsubscribe(Request &r);
+    void handleCommand(Request &r);
+    void handleProperty(Request &r);
+    void handleConfig(Request &r);
+    void handlePermission(Request &r);
+    void commandReceived(const Command &cmd);
+    void dispatchCommand(const Command &cmd, bool identified);
 };
 
 }
@@ -6,15 +6,16 @@
 #include "pluginmonitor.h"
 #include "utils.h"
 #include "config.h"
+#include "reactor.h"
 #include <unistd.h>
 #include <signal.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
-#include <time.h>
 #include <assert.h>
 #include <iostream>
 #include <errno.h>
 #include <string.h>
+#include <algorithm>
 
 #define PLUGIN_EXIT_VALUE_CHDIR -7
 #define PLUGIN_EXIT_VALUE_EXEC -8
@@ -26,12 +27,28 @@
 // maximum time to wait between plugin restarts
 #define PLUGIN_RUNTIME_MAX_WAIT_TIME 300
 
+// time a plugin gets to quit after SIGINT, before it is sent SIGKILL
+#define PLUGIN_STOP_TIMEOUT 2
+
+// time to wait for a plugin to die after SIGKILL, before giving up on it
+#define PLUGIN_KILL_TIMEOUT 2
+
 
 namespace dazeus {
+	// A plugin process goes from running to stopping (sent SIGINT) to
+	// killing (sent SIGKILL), and is reaped when it exits.
+	enum PluginPhase {
+		PluginRunning,
+		PluginStopping,
+		PluginKilling,
+		PluginReaped
+	};
+
 	struct PluginState {
 		PluginState(const PluginConfig &c, std::string network)
 		: config(c), will_autostart(true), pid(0), network(network)
-		, num_failures(0), last_start(0) {
+		, num_failures(0), last_start(), phase(PluginReaped)
+		, deadline(std::chrono::steady_clock::time_point::max()) {
 			assert(config.per_network || network.length() == 0);
 			assert(!config.per_network || network.length() > 0);
 		}
@@ -42,7 +59,10 @@ namespace dazeus {
 		pid_t pid;
 		std::string network;
 		int num_failures;
-		time_t last_start;
+		std::chrono::steady_clock::time_point last_start;
+		PluginPhase phase;
+		// when the current phase times out, or time_point::max() if it doesn't
+		std::chrono::steady_clock::time_point deadline;
 	};
 }
 
@@ -64,10 +84,13 @@ bool executable_exists(std::string file) {
 	return access(file.c_str(), X_OK) == 0;
 }
 
-dazeus::PluginMonitor::PluginMonitor(ConfigReaderPtr config)
+dazeus::PluginMonitor::PluginMonitor(ConfigReaderPtr config, Reactor *reactor)
 : pluginDirectory_(config->getGlobalConfig().plugindirectory)
 , config_(config)
-, should_run_(1)
+, should_run_(true)
+, reactor_(reactor)
+, timer_(0)
+, timerDeadline_()
 {
 }
 
@@ -132,51 +155,142 @@ void dazeus::PluginMonitor::configReloaded() {
 		}
 	}
 
-	kill_plugins(plugins_to_kill);
-	should_run_ = 1;
+	stop_plugins(plugins_to_kill);
+	should_run_ = true;
 	runOnce();
 }
 
+/**
+ * @brief Kill any plugins that are still alive, without waiting for them.
+ *
+ * Plugins should have been stopped with shutdown() before; this is a last
+ * resort.
+ */
 dazeus::PluginMonitor::~PluginMonitor() {
-	kill_plugins(state_);
+	reactor_->cancelTimer(timer_);
 	for(auto it = state_.begin(); it != state_.end(); ++it) {
+		if(it->second->pid != 0 && it->second->phase != PluginKilling) {
+			stop_plugin(it->second, true);
+		}
 		delete it->second;
 	}
 }
 
-void dazeus::PluginMonitor::kill_plugins(std::map<std::string, PluginState*> &plugins) {
-	// Try a graceful stop of all plugins...
-	bool pluginsStopped = false;
-	for(auto it = plugins.begin(); it != plugins.end(); ++it) {
-		if(it->second->pid != 0) {
-			stop_plugin(it->second, false);
-			pluginsStopped = true;
-		}
+/**
+ * @brief Stop all plugins, and don't restart them.
+ *
+ * Returns immediately; the plugins are stopped from the event loop until
+ * stopping() returns false.
+ */
+void dazeus::PluginMonitor::shutdown() {
+	for(auto it = state_.begin(); it != state_.end(); ++it) {
+		it->second->will_autostart = false;
 	}
+	stop_plugins(state_);
+	should_run_ = true;
+	runOnce();
+}
 
-	if(pluginsStopped) {
-		sleep(2);
-		runOnce();
+/**
+ * @brief Returns whether any plugins are still being stopped.
+ *
+ * Plugins that survived SIGKILL for PLUGIN_KILL_TIMEOUT seconds are given up
+ * on, and don't count.
+ */
+bool dazeus::PluginMonitor::stopping() const {
+	for(auto it = state_.begin(); it != state_.end(); ++it) {
+		PluginState *state = it->second;
+		if(state->pid != 0 && (state->phase == PluginStopping
+		                       || (state->phase == PluginKilling && state->deadline != Clock::time_point::max()))) {
+			return true;
+		}
 	}
+	return false;
+}
 
-	pluginsStopped = false;
+/**
+ * @brief Ask the given plugins to quit, and return immediately.
+ *
+ * runOnce() sends SIGKILL to plugins that haven't quit when their deadline
+ * passes, and reaps them when they exit.
+ */
+void dazeus::PluginMonitor::stop_plugins(std::map<std::string, PluginState*> &plugins) {
+	Clock::time_point now = Clock::now();
 	for(auto it = plugins.begin(); it != plugins.end(); ++it) {
-		if(it->second->pid != 0) {
-			stop_plugin(it->second, true);
-			pluginsStopped = true;
+		PluginState *state = it->second;
+		if(state->pid != 0 && state->phase == PluginRunning) {
+			stop_plugin(state, false);
+			state->phase = PluginStopping;
+			state->deadline = now + std::chrono::seconds(PLUGIN_STOP_TIMEOUT);
 		}
 	}
+}
 
-	if(pluginsStopped) {
-		sleep(2);
-		runOnce();
+/**
+ * @brief Move plugins that are being stopped to their next phase when their
+ * deadline has passed.
+ *
+ * Returns the earliest deadline of the plugins that are still being stopped,
+ * or time_point::max() if there are none.
+ */
+dazeus::PluginMonitor::Clock::time_point dazeus::PluginMonitor::advance_stopping(Clock::time_point now) {
+	Clock::time_point next = Clock::time_point::max();
+	for(auto it = state_.begin(); it != state_.end(); ++it) {
+		PluginState *state = it->second;
+		if(state->pid == 0 || state->deadline == Clock::time_point::max()) {
+			continue;
+		}
+		if(state->deadline <= now) {
+			if(state->phase == PluginStopping) {
+				stop_plugin(state, true);
+				state->phase = PluginKilling;
+				state->deadline = now + std::chrono::seconds(PLUGIN_KILL_TIMEOUT);
+			} else {
+				std::cerr << "Failed to stop plugin " << state->config.name
+				          << ", PID " << state->pid << ", giving up on it" << std::endl;
+				state->deadline = Clock::time_point::max();
+				continue;
+			}
+		}
+		next = std::min(next, state->deadline);
 	}
+	return next;
+}
 
-	for(auto it = plugins.begin(); it != plugins.end(); ++it) {
-		if(it->second->pid != 0) {
-			std::cerr << "In PluginMonitor::kill_plugins(), failed to stop plugin " << it->second->config.name << std::endl;
-		}
+/**
+ * @brief Returns when the given plugin may be started again: the more often
+ * it failed, the longer it has to wait after its last start.
+ */
+dazeus::PluginMonitor::Clock::time_point dazeus::PluginMonitor::restart_time(const PluginState *state) {
+	int wait_seconds = 0;
+	if(state->num_failures > 0) {
+		wait_seconds = 5 * (1 << std::min(state->num_failures - 1, 16));
+	}
+	if(wait_seconds > PLUGIN_RUNTIME_MAX_WAIT_TIME) {
+		wait_seconds = PLUGIN_RUNTIME_MAX_WAIT_TIME;
+	}
+	return state->last_start + std::chrono::seconds(wait_seconds);
+}
+
+/**
+ * @brief Run runOnce() from the reactor at the given deadline, replacing
+ * the previous timer; time_point::max() runs it not at all.
+ */
+void dazeus::PluginMonitor::schedule(Clock::time_point deadline) {
+	if(timer_ != 0 && timerDeadline_ == deadline) {
+		return;
 	}
+	reactor_->cancelTimer(timer_);
+	timer_ = 0;
+	if(deadline == Clock::time_point::max()) {
+		return;
+	}
+	timerDeadline_ = deadline;
+	timer_ = reactor_->addTimer(deadline, [this]() {
+		timer_ = 0;
+		should_run_ = true;
+		runOnce();
+	});
 }
 
 void dazeus::PluginMonitor::stop_plugin(PluginState *state, bool hard) {
@@ -205,7 +319,7 @@ bool dazeus::PluginMonitor::start_plugin(PluginState *state) {
 	assert(state->pid == 0);
 	const PluginConfig &config = state->config;
 
-	state->last_start = time(NULL);
+	state->last_start = Clock::now();
 
 	// Configuration loading
 	std::string path = config.path;
@@ -309,6 +423,8 @@ bool dazeus::PluginMonitor::start_plugin(PluginState *state) {
 
 	// we are the parent, plugin is running
 	state->pid = res;
+	state->phase = PluginRunning;
+	state->deadline = Clock::time_point::max();
 	std::cout << "Plugin " << config.name << " started, PID " << state->pid << std::endl;
 	return true;
 }
@@ -321,6 +437,12 @@ pid_t dazeus::PluginMonitor::fork_plugin(const std::string path, const std::vect
 
 	// we are the child; chdir() and execve()
 	// path executable per_network parameters
+
+	// DaZeus blocks the signals it reads from its signalfd, and the mask
+	// would be inherited by the plugin
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigprocmask(SIG_SETMASK, &signals, NULL);
 	if(chdir(path.c_str()) < 0) {
 		exit(PLUGIN_EXIT_VALUE_CHDIR);
 	}
@@ -344,12 +466,6 @@ void dazeus::PluginMonitor::runOnce() {
 		return;
 	}
 
-	// First, block CHLD signals while we process childs
-	sigset_t signalblock;
-	sigemptyset(&signalblock);
-	sigaddset(&signalblock, SIGCHLD);
-	sigprocmask(SIG_BLOCK, &signalblock, NULL);
-
 	// Process died childs
 	pid_t child;
 	int child_status;
@@ -386,7 +502,14 @@ void dazeus::PluginMonitor::runOnce() {
 		}
 
 		state->pid = 0;
-		if(state->last_start + PLUGIN_RUNTIME_RESET_FAILURE < time(NULL)) {
+		bool stopped = state->phase != PluginRunning;
+		state->phase = PluginReaped;
+		state->deadline = Clock::time_point::max();
+		if(stopped) {
+			// we asked it to quit; that's no failure
+			continue;
+		}
+		if(state->last_start + std::chrono::seconds(PLUGIN_RUNTIME_RESET_FAILURE) < Clock::now()) {
 			// more than PLUGIN_RUNTIME_RESET_FAILURE seconds have passed
 			// since the last start attempt; assume the last start was succesful
 			// up to now and reset num_failures
@@ -396,7 +519,8 @@ void dazeus::PluginMonitor::runOnce() {
 	}
 
 	// Process plugins that should start now
-	bool waiting_plugin = false;
+	Clock::time_point now = Clock::now();
+	Clock::time_point next = Clock::time_point::max();
 	for(auto it = state_.begin(); it != state_.end(); ++it) {
 		PluginState  *state  = it->second;
 		assert(state != NULL);
@@ -411,30 +535,25 @@ void dazeus::PluginMonitor::runOnce() {
 			continue;
 		}
 
-		int wait_seconds = 0;
-		if(state->num_failures > 0) {
-			wait_seconds = 5 * (1 << (state->num_failures - 1));
-		}
-		if(wait_seconds > PLUGIN_RUNTIME_MAX_WAIT_TIME) {
-			wait_seconds = PLUGIN_RUNTIME_MAX_WAIT_TIME;
-		}
-
-		if(state->last_start + wait_seconds > time(NULL)) {
+		Clock::time_point restart = restart_time(state);
+		if(restart > now) {
 			// The new starting point hasn't passed yet, don't
 			// re-start the plugin yet
-			waiting_plugin = true;
+			next = std::min(next, restart);
 			continue;
 		}
 
 		// See if we can auto-run it
-		if(!start_plugin(state)) {
-			waiting_plugin = true;
+		if(!start_plugin(state) && state->will_autostart) {
+			next = std::min(next, restart_time(state));
 		}
 	}
 
-	// Only run again if there is a plugin waiting to be started again
-	should_run_ = waiting_plugin;
+	// Send SIGKILL to plugins that didn't quit in time
+	next = std::min(next, advance_stopping(now));
 
-	// Allow CHLD signals to interrupt us again
-	sigprocmask(SIG_UNBLOCK, &signalblock, NULL);
+	// Only run again when a plugin exits, or when the next plugin may be
+	// started again or has to be stopped harder
+	should_run_ = false;
+	schedule(next);
 }
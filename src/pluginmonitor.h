@@ -6,7 +6,8 @@
 #ifndef PLUGINMONITOR_H
 #define PLUGINMONITOR_H
 
-#include <signal.h>
+#include <sys/types.h>
+#include <chrono>
 #include <string>
 #include <vector>
 #include <memory>
@@ -18,6 +19,7 @@ struct PluginState;
 struct PluginConfig;
 struct NetworkConfig;
 class ConfigReader;
+class Reactor;
 typedef std::shared_ptr<ConfigReader> ConfigReaderPtr;
 
 /**
@@ -30,6 +32,14 @@ typedef std::shared_ptr<ConfigReader> ConfigReaderPtr;
  * the plugin on incremental hold, meaning that it will continuously try to
  * restart the plugin with longer intervals.
  *
+ * Plugins are stopped without waiting for them: they are asked to quit with
+ * SIGINT, killed with SIGKILL if they haven't quit after a while, and
+ * forgotten once they are reaped.
+ *
+ * runOnce() must be called after sigchild(), when a plugin exited. Plugin
+ * restarts and the stop deadlines are run from a timer on the Reactor, set
+ * for the earliest of them.
+ *
  * Plugins don't need to be run through PluginMonitor to connect to DaZeus:
  * connecting directly to the socket is always possible. The added value is
  * that PluginMonitor will auto-start the plugins and keep them running.
@@ -37,21 +47,27 @@ typedef std::shared_ptr<ConfigReader> ConfigReaderPtr;
 class PluginMonitor
 {
   public:
-          PluginMonitor(ConfigReaderPtr config);
+          PluginMonitor(ConfigReaderPtr config, Reactor *reactor);
          ~PluginMonitor();
 
-    bool  shouldRun() { return should_run_; }
     void  configReloaded();
     void  runOnce();
-    void  sigchild() { should_run_ = 1; }
+    void  sigchild() { should_run_ = true; }
+    void  shutdown();
+    bool  stopping() const;
 
   private:
     // explicitly disable copy constructor
     PluginMonitor(const PluginMonitor&);
     void operator=(const PluginMonitor&);
 
+    typedef std::chrono::steady_clock Clock;
+
     bool start_plugin(PluginState *state);
-    void kill_plugins(std::map<std::string, PluginState*> &plugins);
+    void stop_plugins(std::map<std::string, PluginState*> &plugins);
+    Clock::time_point advance_stopping(Clock::time_point now);
+    void schedule(Clock::time_point deadline);
+    static Clock::time_point restart_time(const PluginState *state);
     static pid_t fork_plugin(const std::string path, const std::vector<std::string> arguments, const std::string executable);
     static void stop_plugin(PluginState *state, bool hard);
     static void plugin_failed(PluginState *state, bool permanent = false);
@@ -59,7 +75,11 @@ class PluginMonitor
     std::string pluginDirectory_;
     ConfigReaderPtr config_;
     std::map<std::string, PluginState*> state_;
-    volatile sig_atomic_t should_run_;
+    bool should_run_;
+    Reactor *reactor_;
+    // reactor timer for the next restart or stop deadline, and when it is due
+    unsigned timer_;
+    Clock::time_point timerDeadline_;
 };
 
 }
@@ -0,0 +1,244 @@
+/**
+ * Copyright (c) Sjors Gielen, 2014
+ * See LICENSE for license.
+ */
+
+#include "reactor.h"
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <stdio.h>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+// maximum amount of ready descriptors handled per wakeup
+#define REACTOR_MAX_EVENTS 64
+
+dazeus::Reactor::Reactor()
+: epoll_(epoll_create1(EPOLL_CLOEXEC))
+, lastSerial_(0)
+, watches_()
+, sources_()
+, lastTimer_(0)
+, timers_()
+, deadlines_()
+{
+	if(epoll_ < 0) {
+		throw std::runtime_error("Failed to create epoll instance: " + std::string(strerror(errno)));
+	}
+}
+
+dazeus::Reactor::~Reactor() {
+	close(epoll_);
+}
+
+/**
+ * @brief Start watching a descriptor.
+ *
+ * The callback is run with the ready events every time the descriptor is
+ * ready for one of the given events (EPOLLIN, EPOLLOUT); errors and hangups
+ * are always reported. Returns a serial number for this registration, which
+ * can be used to check whether it is still the current one, or 0 if the
+ * descriptor could not be registered.
+ */
+unsigned dazeus::Reactor::add(int fd, uint32_t events, Callback callback) {
+	unsigned serial = ++lastSerial_;
+	if(serial == 0) {
+		serial = ++lastSerial_;
+	}
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.u64 = ((uint64_t)serial << 32) | (uint32_t)fd;
+
+	int res = epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &ev);
+	if(res < 0 && errno == EEXIST) {
+		// A previous owner of this descriptor number didn't unregister it
+		res = epoll_ctl(epoll_, EPOLL_CTL_MOD, fd, &ev);
+	}
+	if(res < 0) {
+		fprintf(stderr, "Failed to watch descriptor %d: %s\n", fd, strerror(errno));
+		watches_.erase(fd);
+		return 0;
+	}
+
+	Watch &w = watches_[fd];
+	w.events = events;
+	w.serial = serial;
+	w.callback = callback;
+	return serial;
+}
+
+/**
+ * @brief Change the events a registered descriptor is watched for.
+ */
+void dazeus::Reactor::modify(int fd, uint32_t events) {
+	auto it = watches_.find(fd);
+	if(it == watches_.end() || it->second.events == events) {
+		return;
+	}
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.u64 = ((uint64_t)it->second.serial << 32) | (uint32_t)fd;
+	if(epoll_ctl(epoll_, EPOLL_CTL_MOD, fd, &ev) < 0) {
+		fprintf(stderr, "Failed to change events for descriptor %d: %s\n", fd, strerror(errno));
+		return;
+	}
+	it->second.events = events;
+}
+
+/**
+ * @brief Stop watching a descriptor.
+ *
+ * This may be called after the descriptor was already closed.
+ */
+void dazeus::Reactor::remove(int fd) {
+	if(watches_.erase(fd) == 0) {
+		return;
+	}
+	if(epoll_ctl(epoll_, EPOLL_CTL_DEL, fd, NULL) < 0 && errno != ENOENT && errno != EBADF) {
+		fprintf(stderr, "Failed to stop watching descriptor %d: %s\n", fd, strerror(errno));
+	}
+}
+
+/**
+ * @brief Returns whether the given registration of a descriptor is current.
+ */
+bool dazeus::Reactor::isRegistered(int fd, unsigned serial) const {
+	auto it = watches_.find(fd);
+	return it != watches_.end() && it->second.serial == serial;
+}
+
+void dazeus::Reactor::addSource(Source *source) {
+	sources_.push_back(source);
+}
+
+void dazeus::Reactor::removeSource(Source *source) {
+	sources_.erase(std::remove(sources_.begin(), sources_.end(), source), sources_.end());
+}
+
+/**
+ * @brief Run the callback once the monotonic clock reaches the deadline.
+ *
+ * Timers that are due are run after the ready descriptors have been
+ * handled, in the order of their deadlines. Returns an identifier for the
+ * timer, which can be used to cancel it before it runs.
+ */
+unsigned dazeus::Reactor::addTimer(Clock::time_point deadline, TimerCallback callback) {
+	unsigned timer = ++lastTimer_;
+	if(timer == 0) {
+		timer = ++lastTimer_;
+	}
+	timers_[timer] = callback;
+	Deadline d;
+	d.when = deadline;
+	d.timer = timer;
+	deadlines_.push(d);
+	return timer;
+}
+
+/**
+ * @brief Cancel a timer that did not run yet.
+ *
+ * Cancelling a timer that already ran, or the timer 0, does nothing.
+ */
+void dazeus::Reactor::cancelTimer(unsigned timer) {
+	timers_.erase(timer);
+}
+
+/**
+ * @brief Returns how long to wait for events: timeout_ms, or less if a
+ * timer is due earlier.
+ */
+int dazeus::Reactor::waitTimeout(int timeout_ms) {
+	// forget cancelled timers, so they don't cut the wait short
+	while(!deadlines_.empty() && timers_.count(deadlines_.top().timer) == 0) {
+		deadlines_.pop();
+	}
+	if(deadlines_.empty()) {
+		return timeout_ms;
+	}
+
+	Clock::duration left = deadlines_.top().when - Clock::now();
+	if(left <= Clock::duration::zero()) {
+		return 0;
+	}
+	// round up, so the timer is due when the wait ends
+	auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(left);
+	if(ms < left) {
+		++ms;
+	}
+	if(ms.count() > INT_MAX) {
+		ms = std::chrono::milliseconds(INT_MAX);
+	}
+	if(timeout_ms < 0 || ms.count() < timeout_ms) {
+		return (int)ms.count();
+	}
+	return timeout_ms;
+}
+
+/**
+ * @brief Run the timers that are due.
+ */
+void dazeus::Reactor::runTimers() {
+	Clock::time_point now = Clock::now();
+	while(!deadlines_.empty() && deadlines_.top().when <= now) {
+		unsigned timer = deadlines_.top().timer;
+		deadlines_.pop();
+		auto it = timers_.find(timer);
+		if(it == timers_.end()) {
+			// cancelled
+			continue;
+		}
+		// the callback may add or cancel timers
+		TimerCallback callback = it->second;
+		timers_.erase(it);
+		callback();
+	}
+}
+
+/**
+ * @brief Wait for events and handle them, then run the timers that are due.
+ *
+ * Waits until the earliest timer is due, but at most timeout_ms
+ * milliseconds; a negative timeout_ms waits for as long as it takes. Signals
+ * interrupt the wait, after which this method returns early.
+ */
+void dazeus::Reactor::runOnce(int timeout_ms) {
+	// sources may remove themselves while being called
+	std::vector<Source*> sources = sources_;
+	for(auto it = sources.begin(); it != sources.end(); ++it) {
+		(*it)->prepare();
+	}
+
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	int ready = epoll_wait(epoll_, events, REACTOR_MAX_EVENTS, waitTimeout(timeout_ms));
+	if(ready < 0) {
+		if(errno != EINTR) {
+			fprintf(stderr, "epoll_wait() failed: %s\n", strerror(errno));
+		}
+		ready = 0;
+	}
+
+	for(int i = 0; i < ready; ++i) {
+		int fd = (int)(events[i].data.u64 & 0xffffffff);
+		unsigned serial = (unsigned)(events[i].data.u64 >> 32);
+
+		// An earlier callback may have removed or replaced this watch
+		auto it = watches_.find(fd);
+		if(it == watches_.end() || it->second.serial != serial) {
+			continue;
+		}
+
+		// Copy the callback, so it survives the watch being removed
+		Callback callback = it->second.callback;
+		callback(events[i].events);
+	}
+
+	runTimers();
+}
@@ -0,0 +1,102 @@
+/**
+ * Copyright (c) Sjors Gielen, 2014
+ * See LICENSE for license.
+ */
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <chrono>
+#include <functional>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+namespace dazeus {
+
+/**
+ * @class Reactor
+ * @brief The main event loop of DaZeus, built on epoll.
+ *
+ * Descriptors are registered once, together with the events they are
+ * interested in and a callback that is run when they become ready. They stay
+ * registered until they are removed, so waiting for events costs nothing for
+ * descriptors that aren't ready.
+ *
+ * Event sources that can't register their descriptors by themselves (such as
+ * the IRC networks, which only expose select()-style descriptor sets) can be
+ * added as a Source. They are asked to update their registrations before
+ * every wait.
+ *
+ * Work that has to happen at a certain time registers a timer on the
+ * monotonic clock. The reactor sleeps until the earliest timer is due, so
+ * nothing needs to wake up periodically to see whether it is time yet.
+ */
+class Reactor
+{
+  public:
+    typedef std::function<void(uint32_t events)> Callback;
+    typedef std::function<void()> TimerCallback;
+    typedef std::chrono::steady_clock Clock;
+
+    struct Source {
+      virtual ~Source() {}
+      // Called before the reactor waits for events
+      virtual void prepare() {}
+    };
+
+             Reactor();
+            ~Reactor();
+
+    unsigned add(int fd, uint32_t events, Callback callback);
+    void     modify(int fd, uint32_t events);
+    void     remove(int fd);
+    bool     isRegistered(int fd, unsigned serial) const;
+
+    void     addSource(Source *source);
+    void     removeSource(Source *source);
+
+    unsigned addTimer(Clock::time_point deadline, TimerCallback callback);
+    void     cancelTimer(unsigned timer);
+
+    void     runOnce(int timeout_ms = -1);
+
+  private:
+    // explicitly disable copy constructor
+    Reactor(const Reactor&);
+    void operator=(const Reactor&);
+
+    struct Watch {
+      uint32_t events;
+      unsigned serial;
+      Callback callback;
+    };
+
+    struct Deadline {
+      Clock::time_point when;
+      unsigned timer;
+      // the earliest deadline goes first in the heap
+      bool operator<(const Deadline &other) const {
+        return when > other.when || (when == other.when && timer > other.timer);
+      }
+    };
+
+    int  waitTimeout(int timeout_ms);
+    void runTimers();
+
+    int epoll_;
+    unsigned lastSerial_;
+    std::unordered_map<int, Watch> watches_;
+    std::vector<Source*> sources_;
+    unsigned lastTimer_;
+    // callbacks of the pending timers; cancelled timers are only removed
+    // from here, and skipped when their deadline comes up in the heap
+    std::unordered_map<unsigned, TimerCallback> timers_;
+    std::priority_queue<Deadline> deadlines_;
+};
+
+}
+
+#endif
@@ -0,0 +1,60 @@
+/**
+ * Copyright (c) Sjors Gielen, 2014
+ * See LICENSE for license.
+ */
+
+#include "router.h"
+#include <stdio.h>
+
+dazeus::RequestParams::RequestParams(json_t *params)
+: params_(params)
+, size_(0)
+, formatted_()
+{
+	if(params_) {
+		if(!json_is_array(params_)) {
+			throw std::runtime_error("Parameters are of the wrong type");
+		}
+		size_ = json_array_size(params_);
+	}
+}
+
+/**
+ * @brief Returns a parameter as JSON, borrowed from the request.
+ */
+json_t *dazeus::RequestParams::json(size_t i) const {
+	if(i >= size_) {
+		throw std::out_of_range("Parameter " + std::to_string(i) + " is missing");
+	}
+	return json_array_get(params_, i);
+}
+
+std::string_view dazeus::RequestParams::operator[](size_t i) const {
+	if(i >= size_) {
+		throw std::out_of_range("Parameter " + std::to_string(i) + " is missing");
+	}
+
+	json_t *v = json_array_get(params_, i);
+	if(json_is_string(v)) {
+		return std::string_view(json_string_value(v), json_string_length(v));
+	}
+
+	// Allocated once, so views into it stay valid
+	if(formatted_.empty()) {
+		formatted_.resize(size_);
+	}
+	std::string &value = formatted_[i];
+	if(value.empty()) {
+		char buf[64];
+		switch(json_typeof(v)) {
+		case JSON_INTEGER: snprintf(buf, sizeof(buf), "%" JSON_INTEGER_FORMAT, json_integer_value(v)); break;
+		case JSON_REAL: snprintf(buf, sizeof(buf), "%g", json_real_value(v)); break;
+		case JSON_TRUE: snprintf(buf, sizeof(buf), "true"); break;
+		case JSON_FALSE: snprintf(buf, sizeof(buf), "false"); break;
+		default:
+			throw std::runtime_error("Parameter " + std::to_string(i) + " is of an unsupported type");
+		}
+		value = buf;
+	}
+	return value;
+}
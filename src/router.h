@@ -0,0 +1,93 @@
+/**
+ * Copyright (c) Sjors Gielen, 2014
+ * See LICENSE for license.
+ */
+
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stddef.h>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <jansson.h>
+#include "namehash.h"
+
+namespace dazeus {
+
+/**
+ * @class RequestParams
+ * @brief The parameters of a plugin request, decoded on demand.
+ *
+ * String parameters are returned as views into the JSON tree of the request,
+ * so they are valid as long as the request is. Other scalar parameters are
+ * formatted into a string the first time they are asked for. Structured
+ * parameters, such as arrays and objects, are available as JSON.
+ */
+class RequestParams
+{
+  public:
+    RequestParams(json_t *params);
+
+    size_t size() const { return size_; }
+    bool   empty() const { return size_ == 0; }
+    std::string_view operator[](size_t i) const;
+    std::string str(size_t i) const { return std::string((*this)[i]); }
+    json_t *json(size_t i) const;
+
+  private:
+    json_t *params_;
+    size_t size_;
+    mutable std::vector<std::string> formatted_;
+};
+
+/**
+ * @class Router
+ * @brief Maps request actions to the handlers that implement them.
+ *
+ * Actions are looked up by their hash. Adding an action whose hash collides
+ * with an existing one is refused, so the hash is perfect for the registered
+ * actions and every lookup is a single hash probe plus one comparison.
+ */
+template <typename Request>
+class Router
+{
+  public:
+    typedef std::function<void(Request&)> Handler;
+
+    Router() : routes_() {}
+
+    void add(const std::string &action, Handler handler) {
+      uint32_t hash = nameHash(action.c_str(), action.length());
+      auto it = routes_.find(hash);
+      if(it != routes_.end() && it->second.action != action) {
+        throw std::runtime_error("Action " + action + " collides with action " + it->second.action);
+      }
+      Route &route = routes_[hash];
+      route.action = action;
+      route.handler = handler;
+    }
+
+    const Handler *find(std::string_view action) const {
+      auto it = routes_.find(nameHash(action.data(), action.length()));
+      if(it == routes_.end() || it->second.action != action) {
+        return NULL;
+      }
+      return &it->second.handler;
+    }
+
+  private:
+    struct Route {
+      std::string action;
+      Handler handler;
+    };
+
+    std::unordered_map<uint32_t, Route> routes_;
+};
+
+}
+
+#endif
@@ -0,0 +1,26 @@
+/**
+ * Copyright (c) Sjors Gielen, 2014
+ * See LICENSE for license.
+ */
+
+#include "subscriptions.h"
+#include <algorithm>
+
+bool dazeus::SubscriptionIndex::subscribe(EventId event, int sock) {
+	std::vector<int> &subs = subscribers_.at(event);
+	if(std::find(subs.begin(), subs.end(), sock) != subs.end()) {
+		return false;
+	}
+	subs.push_back(sock);
+	return true;
+}
+
+bool dazeus::SubscriptionIndex::unsubscribe(EventId event, int sock) {
+	std::vector<int> &subs = subscribers_.at(event);
+	auto it = std::find(subs.begin(), subs.end(), sock);
+	if(it == subs.end()) {
+		return false;
+	}
+	subs.erase(it);
+	return true;
+}
@@ -0,0 +1,39 @@
+/**
+ * Copyright (c) Sjors Gielen, 2014
+ * See LICENSE for license.
+ */
+
+#ifndef SUBSCRIPTIONS_H
+#define SUBSCRIPTIONS_H
+
+#include <vector>
+#include "events.h"
+
+namespace dazeus {
+
+/**
+ * @class SubscriptionIndex
+ * @brief Maps events to the plugin sockets subscribed to them.
+ *
+ * Subscribing and finding the subscribers of an event work on its EventId,
+ * so dispatching an event costs as much as the number of its subscribers
+ * instead of the number of connected plugins.
+ */
+class SubscriptionIndex
+{
+  public:
+    SubscriptionIndex() : subscribers_(EVENT_COUNT) {}
+
+    bool subscribe(EventId event, int sock);
+    bool unsubscribe(EventId event, int sock);
+    const std::vector<int> &subscribers(EventId event) const {
+      return subscribers_[event];
+    }
+
+  private:
+    std::vector<std::vector<int> > subscribers_;
+};
+
+}
+
+#endif
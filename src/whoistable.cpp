@@ -0,0 +1,170 @@
+/**
+ * Copyright (c) Sjors Gielen, 2014
+ * See LICENSE for license.
+ */
+
+#include "whoistable.h"
+#include "network.h"
+#include "utils.h"
+#include <algorithm>
+
+dazeus::WhoisTable::WhoisTable(Clock::duration timeout, Clock::duration ttl)
+: timeout_(timeout)
+, ttl_(ttl)
+, pending_()
+, known_()
+, nextExpiry_(Clock::time_point::max())
+{
+}
+
+dazeus::WhoisTable::Key dazeus::WhoisTable::key(const Network &network, const std::string &nick) {
+	// nicknames are case-insensitive
+	return Key(&network, strToLower(nick));
+}
+
+/**
+ * @brief Run all waiters with the given identification.
+ */
+void dazeus::WhoisTable::release(std::vector<Waiter> &waiters, bool identified) {
+	for(auto it = waiters.begin(); it != waiters.end(); ++it) {
+		(*it)(identified);
+	}
+}
+
+/**
+ * @brief Returns the remembered identification of a nick, if any.
+ */
+dazeus::WhoisTable::Status dazeus::WhoisTable::lookup(const Network &network, const std::string &nick) {
+	auto it = known_.find(key(network, nick));
+	if(it == known_.end()) {
+		return Unknown;
+	} else if(it->second.expires <= Clock::now()) {
+		known_.erase(it);
+		return Unknown;
+	}
+	return it->second.identified ? Identified : NotIdentified;
+}
+
+/**
+ * @brief Run a waiter once the identification of a nick is known.
+ *
+ * A WHOIS is only sent if there isn't one outstanding for the nick already.
+ */
+void dazeus::WhoisTable::wait(Network &network, const std::string &nick, Waiter waiter) {
+	Key k = key(network, nick);
+	auto it = pending_.find(k);
+	if(it == pending_.end()) {
+		Pending &p = pending_[k];
+		p.deadline = Clock::now() + timeout_;
+		p.waiters.push_back(waiter);
+		nextExpiry_ = std::min(nextExpiry_, p.deadline);
+		network.sendWhois(nick);
+	} else {
+		it->second.waiters.push_back(waiter);
+	}
+}
+
+/**
+ * @brief Handle a WHOIS reply: remember it and release the nick's waiters.
+ *
+ * Replies to WHOIS requests that weren't sent by this table are ignored.
+ */
+void dazeus::WhoisTable::resolved(const Network &network, const std::string &nick, bool identified) {
+	Key k = key(network, nick);
+	auto it = pending_.find(k);
+	if(it == pending_.end()) {
+		return;
+	}
+
+	Known &known = known_[k];
+	known.expires = Clock::now() + ttl_;
+	known.identified = identified;
+	nextExpiry_ = std::min(nextExpiry_, known.expires);
+
+	// Waiters may add new work to the table
+	std::vector<Waiter> waiters;
+	waiters.swap(it->second.waiters);
+	pending_.erase(it);
+	release(waiters, identified);
+}
+
+/**
+ * @brief Forget what is known about a nick, because it changed or quit.
+ *
+ * Anything waiting for the nick is released as not identified, as the WHOIS
+ * reply can't be trusted to be about the same user anymore.
+ */
+void dazeus::WhoisTable::forget(const Network &network, const std::string &nick) {
+	Key k = key(network, nick);
+	known_.erase(k);
+
+	auto it = pending_.find(k);
+	if(it != pending_.end()) {
+		std::vector<Waiter> waiters;
+		waiters.swap(it->second.waiters);
+		pending_.erase(it);
+		release(waiters, false);
+	}
+}
+
+/**
+ * @brief Forget everything about a network, because it was disconnected.
+ */
+void dazeus::WhoisTable::forgetNetwork(const Network &network) {
+	Key first(&network, std::string());
+	auto kit = known_.lower_bound(first);
+	while(kit != known_.end() && kit->first.first == &network) {
+		kit = known_.erase(kit);
+	}
+
+	std::vector<Waiter> waiters;
+	auto pit = pending_.lower_bound(first);
+	while(pit != pending_.end() && pit->first.first == &network) {
+		waiters.insert(waiters.end(), pit->second.waiters.begin(), pit->second.waiters.end());
+		pit = pending_.erase(pit);
+	}
+	release(waiters, false);
+}
+
+/**
+ * @brief Release waiters whose WHOIS went unanswered, and drop old replies.
+ */
+void dazeus::WhoisTable::expire() {
+	Clock::time_point now = Clock::now();
+	Clock::time_point next = Clock::time_point::max();
+	for(auto kit = known_.begin(); kit != known_.end();) {
+		if(kit->second.expires <= now) {
+			kit = known_.erase(kit);
+		} else {
+			next = std::min(next, kit->second.expires);
+			++kit;
+		}
+	}
+
+	std::vector<Waiter> waiters;
+	for(auto pit = pending_.begin(); pit != pending_.end();) {
+		if(pit->second.deadline <= now) {
+			waiters.insert(waiters.end(), pit->second.waiters.begin(), pit->second.waiters.end());
+			pit = pending_.erase(pit);
+		} else {
+			next = std::min(next, pit->second.deadline);
+			++pit;
+		}
+	}
+
+	// set before releasing, as waiters may add new work to the table
+	nextExpiry_ = next;
+	release(waiters, false);
+}
+
+/**
+ * @brief Returns when expire() has work to do next, or Clock::time_point::max()
+ * if the table is empty.
+ *
+ * This is kept up to date as work is added, so it can be asked for every
+ * command. After nicks are forgotten it may be earlier than needed; calling
+ * expire() then finds nothing to do, and updates it.
+ */
+dazeus::WhoisTable::Clock::time_point dazeus::WhoisTable::nextExpiry() const {
+	return nextExpiry_;
+}
@@ -0,0 +1,83 @@
+/**
+ * Copyright (c) Sjors Gielen, 2014
+ * See LICENSE for license.
+ */
+
+#ifndef WHOISTABLE_H
+#define WHOISTABLE_H
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace dazeus {
+
+class Network;
+
+/**
+ * @class WhoisTable
+ * @brief Keeps track of the identification of nicks on the networks.
+ *
+ * Work that needs to know whether a nick is identified waits in this table
+ * until the WHOIS reply for that nick comes in. All waiters for the same
+ * nick share a single outstanding WHOIS, and are released together when the
+ * reply arrives. Replies are remembered for a while, so work for a nick that
+ * was seen recently doesn't need a WHOIS at all.
+ *
+ * Remembered replies are forgotten when the nick changes or quits; waiters
+ * whose WHOIS isn't answered in time are released as not identified.
+ */
+class WhoisTable
+{
+  public:
+    typedef std::function<void(bool identified)> Waiter;
+    typedef std::chrono::steady_clock Clock;
+
+    enum Status {
+      Unknown,
+      Identified,
+      NotIdentified
+    };
+
+    WhoisTable(Clock::duration timeout = std::chrono::seconds(30),
+               Clock::duration ttl = std::chrono::seconds(60));
+
+    Status lookup(const Network &network, const std::string &nick);
+    void   wait(Network &network, const std::string &nick, Waiter waiter);
+    void   resolved(const Network &network, const std::string &nick, bool identified);
+    void   forget(const Network &network, const std::string &nick);
+    void   forgetNetwork(const Network &network);
+    void   expire();
+    Clock::time_point nextExpiry() const;
+
+  private:
+    typedef std::pair<const Network*, std::string> Key;
+
+    struct Pending {
+      Clock::time_point deadline;
+      std::vector<Waiter> waiters;
+    };
+
+    struct Known {
+      Clock::time_point expires;
+      bool identified;
+    };
+
+    static Key key(const Network &network, const std::string &nick);
+    static void release(std::vector<Waiter> &waiters, bool identified);
+
+    Clock::duration timeout_;
+    Clock::duration ttl_;
+    std::map<Key, Pending> pending_;
+    std::map<Key, Known> known_;
+    // earliest deadline or expiry; may be earlier than any left in the
+    // table after entries are forgotten, until the next expire()
+    Clock::time_point nextExpiry_;
+};
+
+}
+
+#endif